@@ -15,6 +15,25 @@
 #include <BLEServer.h>
 #include <BLE2902.h>
 #include <ArduinoJson.h> // Necesario para parsear los comandos de la app
+#include <Preferences.h>
+#include <WiFi.h>
+#include <mqtt_client.h>
+#include <esp_timer.h>
+#include <esp_idf_version.h>
+#include <esp_pm.h>
+#include <esp_bt.h>
+#include <esp_sleep.h>
+#include <driver/gpio.h>
+#include <esp_partition.h>
+#include <esp_ota_ops.h>
+#include <mbedtls/sha256.h>
+#include <mbedtls/base64.h>
+#if ESP_IDF_VERSION_MAJOR >= 5
+#include <esp_adc/adc_continuous.h>
+#endif
+#include <algorithm>
+#include <atomic>
+#include <type_traits>
 
 // --- Nombre del Dispositivo BLE ---
 // Este es el nombre que aparecerá en la aplicación cuando busques dispositivos.
@@ -36,124 +55,6153 @@
 #define CHARACTERISTIC_UUID_TX "6e400003-b5a3-f393-e0a9-e50e24dcca9e"
 
 
+// --- Límites del protocolo ---
+// Longitud máxima de un comando JSON (sin contar el salto de línea).
+// Coincide con el rxbuf de 512 bytes de la versión MicroPython (src/main.py).
+#define MAX_COMMAND_LENGTH 512
+
+// --- Varios centrales ---
+// Hasta MAX_CENTRALS apps conectadas a la vez (p. ej. el operario y un técnico),
+// cada una con su sesión. No debe superar CONFIG_BTDM_CTRL_BLE_MAX_CONN (3 por
+// defecto). Mientras quede hueco se sigue anunciando.
+#define MAX_CENTRALS           3
+#define TX_BROADCAST_FRAME_MAX 512  // Mayor trama que se serializa una vez para todos
+
+// --- Reparto de núcleos ---
+// Núcleo 0 (PRO_CPU): radio y protocolo. Bluedroid, comandos, TX y el
+// procesamiento de muestras. Núcleo 1 (APP_CPU): la adquisición de las sondas,
+// con la tarea de más prioridad del núcleo, y loop().
+
+// --- Tarea de procesamiento de comandos ---
+// El callback BLE solo encola líneas; el parseo y la respuesta se hacen en esta
+// tarea, en el mismo núcleo que Bluedroid para no robar tiempo a la adquisición.
+#define COMMAND_QUEUE_DEPTH    16   // Comandos en vuelo (potencia de 2)
+#define COMMAND_TASK_STACK     8192
+#define COMMAND_TASK_PRIORITY  2
+#define COMMAND_TASK_CORE      PRO_CPU_NUM
+// Tabla de despacho con sondeo lineal (potencia de 2). Debe ser al menos el
+// doble del número de handlers para que las búsquedas sigan siendo cortas;
+// setup() avisa si no es así.
+#define MAX_COMMAND_HANDLERS   128
+
+// --- Control de flujo RX ---
+// RX acepta también escrituras sin respuesta. Como entonces nada frena a la
+// app, quien la use pide créditos con "set_rx_flow" y el dispositivo anuncia
+// por TX cuántas líneas suyas ya no ocupan la cola ("rx_credit"). La cola de
+// comandos es común: el callback RX no deja a ninguna sesión tener más de
+// RX_CREDIT_WINDOW líneas dentro, así una central que no respete su ventana no
+// quita sitio a las demás. Lo que pase de ahí se descarta y se anuncia aparte
+// ("dropped" y los números de línea en "resend") para que la app lo reenvíe.
+#define RX_CREDIT_WINDOW       (COMMAND_QUEUE_DEPTH / MAX_CENTRALS)
+#define RX_DROP_LOG            8    // Números de línea descartada que se recuerdan por sesión
+
+// --- Memoria para documentos JSON ---
+// Cada comando usa dos documentos (petición y respuesta). Con 4 se cubre un
+// comando en curso más los mensajes que envíen otras tareas a la vez.
+#define JSON_POOL_SIZE         4
+#define JSON_ARENA_SIZE        3072 // Bytes por documento (petición de 512 B + margen)
+
+// --- Transmisión (TX) ---
+// Las tramas salientes se acumulan en un anillo y una tarea las envía en
+// notificaciones del tamaño que permite el MTU negociado: las tramas largas se
+// parten y las cortas que coinciden en el tiempo viajan juntas. La app ya
+// reensambla por '\n' (handleNotifications en use-ble.ts).
+#define TX_RING_SIZE           4096 // Bytes pendientes por sesión (potencia de 2)
+#define TX_COALESCE_MS         8    // Espera para agrupar tramas cortas
+#define TX_TASK_STACK          4096
+#define TX_TASK_PRIORITY       3
+#define TX_TASK_CORE           PRO_CPU_NUM
+#define ATT_DEFAULT_MTU        23
+#define ATT_NOTIFY_OVERHEAD    3    // Opcode + handle de la notificación
+
+// --- Telemetría ---
+#define SENSOR_PERIOD_MS       3000 // Igual que el ciclo de src/main.py
+#define TELEMETRY_FRAME_MAGIC  0xA5 // Primer byte de una trama binaria (nunca empieza así un JSON)
+#define TELEMETRY_FRAME_VERSION 1
+
+// --- Telemetría por cambios ---
+// Se envían solo los campos que se alejan del último valor enviado más que su
+// banda muerta y, cada TELEMETRY_KEYFRAME_S, la lectura completa para que la
+// app se resincronice. Con el estanque estable casi no se emite nada.
+#define TELEMETRY_DELTA_MAGIC  0xA8 // Trama binaria parcial, de longitud variable
+#define TELEMETRY_DELTA_VERSION 1
+#define TELEMETRY_KEYFRAME_S   60   // 0 = todas las lecturas completas, como antes
+#define DEADBAND_PH            0.02f
+#define DEADBAND_DO_CONC       0.05f // mg/L
+#define DEADBAND_DO_SAT        0.5f  // %
+#define DEADBAND_TEMP          0.1f  // °C
+
+// --- Alertas en el dispositivo ---
+// Cada lectura pasa por un detector con memoria fija por canal (media y
+// varianza exponenciales, último valor) que compara con umbrales, ritmo de
+// cambio y desviación respecto a lo habitual. Las alertas salen en el acto por
+// BLE y MQTT, sin esperar a que la app procese la telemetría.
+#define ALERT_CHANNELS         4      // pH, OD (mg/L), OD (%), temperatura
+#define ALERT_EWMA_ALPHA       0.05f  // Memoria de ~20 lecturas (1 min)
+#define ALERT_WARMUP_READINGS  20     // Lecturas antes de juzgar desviaciones
+#define ALERT_Z_LIMIT          4.0f   // Sigmas; 0 = sin alerta de desviación
+#define ALERT_CLEAR_READINGS   3      // Lecturas en rango para dar por resuelta
+#define ALERT_COOLDOWN_MS      60000  // Entre avisos de ritmo o desviación del mismo canal
+#define ALERT_FRAME_MAX        192
+#define MQTT_ALERT_TOPIC       "aquadata/alerts"
+
+// --- Pipeline de adquisición ---
+// La tarea de adquisición toma una muestra cruda cada ACQ_PERIOD_MS y la deja
+// en un anillo SPSC sin bloqueos; la de procesamiento, en el otro núcleo, lo
+// vacía, promedia SENSOR_PERIOD_MS de muestras en una lectura y la publica.
+#define ACQ_PERIOD_MS          100
+#define ACQ_RING_DEPTH         64   // Muestras crudas en vuelo (potencia de 2)
+#define ACQ_TASK_STACK         3072
+#define ACQ_TASK_PRIORITY      5    // Por encima del resto de tareas del núcleo 1
+#define ACQ_TASK_CORE          APP_CPU_NUM
+#define PROC_TASK_STACK        6144
+#define PROC_TASK_PRIORITY     2
+#define PROC_TASK_CORE         PRO_CPU_NUM
+#define ADC_FULL_SCALE         4095 // ADC de 12 bits
+
+// --- Ráfagas del ADC ---
+// En cada periodo se captura por DMA una ráfaga de ADC_BURST_SAMPLES
+// conversiones por canal y la CPU solo despierta al completarse. Cada canal se
+// filtra con la mediana, se descartan los valores atípicos (más de
+// ADC_OUTLIER_MAD_K desviaciones absolutas medianas) y se promedia el resto.
+// Con ADC_DMA_ENABLE a 0 las ráfagas se simulan y no hace falta hardware.
+#define ADC_DMA_ENABLE         0     // 1 = modo continuo del ADC (requiere IDF 5)
+#define ADC_BURST_SAMPLES      64    // Conversiones por canal en cada ráfaga
+#define ADC_SAMPLE_FREQ_HZ     20000 // Mínimo del modo continuo en el ESP32
+#define ADC_OVERSAMPLE         16    // Escala de la media: 2 bits más de resolución
+#define ADC_OUTLIER_MAD_K      3
+#define ADC_OUTLIER_MIN_COUNTS 24    // Umbral mínimo de rechazo respecto a la mediana
+#define PH_ADC_CHANNEL         6     // ADC1_CH6, GPIO34
+#define DO_ADC_CHANNEL         7     // ADC1_CH7, GPIO35
+#define TEMP_ADC_CHANNEL       4     // ADC1_CH4, GPIO32 (ADC2 no se puede usar con WiFi)
+
+// --- WiFi y MQTT ---
+// Mismo broker y tema que src/main.py y src/hooks/use-mqtt.ts. Las lecturas se
+// acumulan en RAM y se publican en lotes de varias líneas JSON (la app ya
+// separa por '\n'), así la radio despierta una vez cada MQTT_BATCH_INTERVAL_MS
+// y no una por lectura. Sin conexión, lo que no cabe en RAM va al histórico de
+// flash y se vuelve a publicar al reconectar.
+#define MQTT_BROKER_URI        "mqtt://broker.hivemq.com:1883"
+#define MQTT_TOPIC             "aquadata/sensor-data"
+#define MQTT_QOS               1
+#define MQTT_KEEPALIVE_S       60
+#define MQTT_OUTBOX_DEPTH      32    // Lecturas en RAM (potencia de 2)
+#define MQTT_SPILL_THRESHOLD   16    // Sin conexión, el exceso pasa al histórico
+#define MQTT_BATCH_READINGS    10    // Publicar en cuanto haya tantas lecturas...
+#define MQTT_BATCH_INTERVAL_MS 30000 // ...o la más antigua tenga esta edad
+#define MQTT_PAYLOAD_SIZE      4096
+#define MQTT_ACK_TIMEOUT_MS    10000
+#define MQTT_PENDING_ALERTS    4     // Alertas QoS 1 seguidas hasta su PUBACK
+#define MQTT_TASK_STACK        6144
+#define MQTT_TASK_PRIORITY     1
+#define MQTT_TASK_CORE         PRO_CPU_NUM
+
+// --- Gestor de WiFi ---
+// Máquina de estados en su propia tarea, alimentada por una cola de órdenes y
+// de eventos del sistema. Reintenta con espera exponencial y, si conoce el
+// punto de acceso (BSSID y canal) de la última conexión, se asocia sin escanear.
+#define WIFI_QUEUE_DEPTH       8
+#define WIFI_TASK_STACK        4096
+#define WIFI_TASK_PRIORITY     2
+#define WIFI_TASK_CORE         PRO_CPU_NUM
+#define WIFI_CONNECT_TIMEOUT_MS 15000
+#define WIFI_BACKOFF_MIN_MS    1000
+#define WIFI_BACKOFF_MAX_MS    60000
+#define WIFI_PROVISION_ATTEMPTS 3   // Intentos antes de avisar a la app del fallo
+#define WIFI_AUTH_FAIL_LIMIT   3    // Fallos de autenticación seguidos antes de rendirse
+
+// --- Configuración persistente ---
+// Los ajustes viven en RAM; los cambios se escriben en NVS como un único blob
+// CONFIG_COMMIT_DELAY_MS después del último cambio (nunca más tarde de
+// CONFIG_MAX_DEFER_MS desde el primero) o al desconectarse la app.
+#define CONFIG_NVS_NAMESPACE   "config"
+#define CONFIG_VERSION         1
+#define CONFIG_COMMIT_DELAY_MS 2000
+#define CONFIG_MAX_DEFER_MS    10000
+
+// --- Calibración ---
+// Las tablas de compensación cubren de CAL_LUT_MIN_C a CAL_LUT_MAX_C en pasos
+// de 0,5 °C y se regeneran solo al cambiar la altitud, la salinidad o la
+// calibración de pH. Las lecturas se evalúan en punto fijo Q16.
+#define CAL_LUT_MIN_C          -10
+#define CAL_LUT_MAX_C          50
+#define CAL_MAX_PH_POINTS      3     // Tampones de pH guardados en NVS
+#define ADC_VREF_MV            3300  // Tensión de fondo de escala del ADC (11 dB)
+#define PH_BIAS_MV             1650  // Desplazamiento del amplificador del electrodo
+#define DO_SPAN_SAT_PCT        200   // Saturación de OD a fondo de escala
+
+#if ADC_DMA_ENABLE && ESP_IDF_VERSION_MAJOR < 5
+#error "ADC_DMA_ENABLE requiere ESP-IDF 5 (Arduino-ESP32 3.x)"
+#endif
+
+// --- Planificador de loop() ---
+#define KEEP_ALIVE_PERIOD_MS   10000
+#define MAX_SCHEDULED_JOBS     8
+#define SCHEDULER_MAX_WAIT_MS  60000 // Tope de espera aunque no haya trabajos
+
+// --- Gestión de energía ---
+// El modo de bajo consumo activa DFS y light sleep automático: la CPU baja de
+// frecuencia y duerme cuando todas las tareas están bloqueadas. Requiere
+// CONFIG_PM_ENABLE y CONFIG_FREERTOS_USE_TICKLESS_IDLE en sdkconfig; para
+// dormir con una conexión BLE activa el controlador necesita además un cristal
+// de 32 kHz como reloj de bajo consumo (CONFIG_BTDM_CTRL_LOW_POWER_CLOCK).
+#define POWER_SAVE_DEFAULT     1     // Arrancar en modo de bajo consumo
+#define PM_MAX_FREQ_MHZ        160
+#define PM_MIN_FREQ_MHZ        40    // Frecuencia del cristal
+#define SENSOR_IRQ_PIN         -1    // GPIO de interrupción de las sondas (-1 = ninguno)
+
+// --- Ciclo de trabajo con deep sleep ---
+// En el modo "duty_cycle" el chip pasa casi todo el tiempo en deep sleep. Cada
+// despertar por temporizador toma una lectura corta, sin BLE ni WiFi, y la
+// guarda en la memoria RTC. Solo cuando el lote se llena o una lectura sale de
+// los límites de alerta arranca entero: vuelca el lote al histórico (y de ahí a
+// MQTT), se anuncia por BLE un rato y vuelve a dormir.
+#define DUTY_PERIOD_S          300   // Entre lecturas
+#define DUTY_BATCH_SIZE        12    // Lecturas por arranque completo (1 h)
+#define DUTY_BATCH_MAX         32    // Capacidad del lote en memoria RTC (ver set_power_mode)
+#define DUTY_SAMPLES_PER_READING 5   // Ráfagas por lectura al despertar (0,5 s)
+#define DUTY_SAMPLE_TIMEOUT_MS 5000  // Sin lectura en este tiempo se vuelve a dormir
+#define DUTY_AWAKE_MIN_MS      30000 // Publicidad tras un arranque completo, para la app
+#define DUTY_AWAKE_MAX_MS      180000 // Tope aunque MQTT no haya terminado
+#define DUTY_CHECK_MS          5000
+
+// --- Benchmark de extremo a extremo ---
+// "start_benchmark" emite tramas sintéticas numeradas y con marca de tiempo
+// (esp_timer, µs) al ritmo y tamaño pedidos, por BLE a quien lo pidió o por
+// MQTT. La app mide pérdida, desorden, caudal y latencia (ver src/lib/benchmark.ts);
+// "bench_sync" le da la hora del dispositivo para estimar el desfase de relojes.
+#define BENCH_FRAME_MAGIC      0xA9 // Trama binaria de benchmark, longitud en el byte 2
+#define BENCH_FRAME_VERSION    1
+#define BENCH_BINARY_MIN_SIZE  14   // Cabecera de 12 bytes + CRC
+#define BENCH_BINARY_MAX_SIZE  244  // MTU máximo (247) menos la cabecera de la notificación
+#define BENCH_JSON_MIN_SIZE    64   // Línea sin relleno, con secuencia y hora de 10 cifras
+#define BENCH_JSON_MAX_SIZE    TX_BROADCAST_FRAME_MAX
+#define BENCH_MAX_RATE_HZ      1000
+#define BENCH_MAX_DURATION_S   600
+#define BENCH_TICK_MS          10   // Las tramas vencidas salen en cada pasada
+#define BENCH_DRAIN_MS         5000 // Tras la duración, margen para vaciar lo atrasado
+#define MQTT_BENCH_TOPIC       "aquadata/bench"
+
+// --- Perfiles de enlace BLE ---
+// Tras arrancar o desconectarse se anuncia rápido durante FAST_ADV_WINDOW_MS
+// para que la app reconecte enseguida, y después lento para ahorrar energía.
+// Con conexión se pide un intervalo corto mientras hay tráfico y uno largo
+// tras CONN_IDLE_AFTER_MS sin actividad.
+#define FAST_ADV_WINDOW_MS     30000
+#define CONN_IDLE_AFTER_MS     15000
+#define BULK_TX_THRESHOLD      1024  // Bytes en una ráfaga TX que cuentan como actividad
+
+// --- Histórico en flash ---
+// Registro circular de muestras en la partición "history" (ver partitions.csv).
+// Con 640 KB y una muestra por minuto caben unos 14 días.
+#define HISTORY_PERIOD_MS      60000
+#define HISTORY_PARTITION_LABEL "history"
+#define HISTORY_PARTITION_SUBTYPE 0x40
+#define HISTORY_RECORD_MAGIC   0xA6 // También marca el registro en el flujo TX
+#define HISTORY_RECORD_VERSION 1
+#define HISTORY_SYNC_BATCH     64   // Registros por pasada antes de atender comandos
+
+// --- Actualización OTA por BLE ---
+// La imagen llega en líneas "ota_data" con trozos en base64, dentro del flujo
+// de créditos RX, y commandTask la escribe directamente en la partición OTA
+// inactiva (app0/app1 en partitions.csv), sin guardarla en RAM. El SHA-256 se
+// calcula según llega; si la conexión se corta, un "ota_begin" con la misma
+// imagen continúa desde lo ya escrito.
+#define OTA_CHUNK_MAX          256   // Bytes por línea: 344 en base64
+#define OTA_REBOOT_DELAY_MS    1500  // Para que salga la respuesta antes de reiniciar
+
+// --- Presupuesto de memoria ---
+// Con STATIC_ALLOCATION las tareas, colas y mutex propios se crean con las
+// variantes *Static de FreeRTOS: pilas y TCB van en .bss y el heap queda para
+// las pilas BLE, WiFi y MQTT. HEAP_GUARD instala el gancho de asignación de
+// ESP-IDF (CONFIG_HEAP_USE_HOOKS, IDF >= 5.1) y, terminado el arranque, cuenta
+// cada reserva hecha desde una tarea propia. Bluedroid y esp-mqtt reservan en
+// la tarea que llama a su API, así que solo las tareas que nunca las llaman
+// (adquisición y log) provocan un abort con HEAP_GUARD_TRAP.
+// "get_memory_stats" informa además del mínimo de pila libre de cada tarea.
+#define STATIC_ALLOCATION      1
+#define HEAP_GUARD_OFF         0
+#define HEAP_GUARD_COUNT       1
+#define HEAP_GUARD_TRAP        2
+#define HEAP_GUARD             HEAP_GUARD_COUNT
+#define MAX_TRACKED_TASKS      10
+#define STACK_LOW_WATER_BYTES  512   // Menos pila libre que esto se marca como "low"
+
+// --- Registro (log) ---
+// Las llamadas LOG_x() solo copian el puntero al formato y los argumentos a un
+// anillo sin bloqueos; una tarea de baja prioridad los formatea y escribe por
+// el puerto serie. Los niveles por encima de LOG_LEVEL desaparecen al compilar.
+// Con LOG_BINARY_OUTPUT cada entrada sale como registro binario y el formato
+// como su dirección en flash (se traduce en el PC con el .elf de la misma build).
+#define LOG_LEVEL_NONE         0
+#define LOG_LEVEL_ERROR        1
+#define LOG_LEVEL_WARN         2
+#define LOG_LEVEL_INFO         3
+#define LOG_LEVEL_DEBUG        4
+#ifndef LOG_LEVEL
+#define LOG_LEVEL              LOG_LEVEL_INFO // DEBUG vuelca además cada comando y respuesta
+#endif
+#define LOG_BINARY_OUTPUT      0
+#define LOG_RING_DEPTH         32   // Entradas en vuelo (potencia de 2)
+#define LOG_MAX_ARGS           4
+#define LOG_TEXT_BYTES         48   // Texto copiado de los argumentos %s (truncado)
+#define LOG_RATE_BURST         5    // Líneas seguidas permitidas por punto de llamada...
+#define LOG_RATE_WINDOW_MS     1000 // ...en cada ventana; el resto se cuenta y se omite
+#define LOG_TASK_STACK         3072
+#define LOG_TASK_PRIORITY      1
+#define LOG_TASK_CORE          APP_CPU_NUM
+
+// --- Diagnóstico ---
+// Histogramas de latencia de cubetas fijas en potencias de 2 de microsegundo
+// para cada etapa del camino de un comando. Se mide con esp_timer y no con el
+// contador de ciclos porque DFS cambia la frecuencia de la CPU en marcha.
+#define DIAG_HISTOGRAM_BUCKETS 16   // La última acumula todo lo >= 2^15 us
+
+// --- Arranque por etapas ---
+// setup() solo hace lo necesario para que la app vea el dispositivo (ajustes,
+// pila BLE y publicidad). Histórico, sondas y red se inician después, una
+// etapa por pasada de loop(). Cada hito queda en bootTimeline y se informa en
+// "get_diagnostics".
+#define BOOT_STAGE_GAP_MS      0    // Pausa entre etapas diferidas
+
+
 BLECharacteristic *pTxCharacteristic;
-bool deviceConnected = false;
-String rxBuffer = ""; // Buffer para acumular datos entrantes
+bool deviceConnected = false; // Al menos un central conectado
+
+// Formato de la telemetría, negociado por cada app con "set_telemetry_mode"
+// ("alerts": solo alertas, para una app en segundo plano)
+enum TelemetryMode : uint8_t { TELEMETRY_JSON, TELEMETRY_BINARY, TELEMETRY_ALERTS_ONLY };
+const char* const TELEMETRY_MODE_NAMES[] = {"json", "binary", "alerts"};
+// La siguiente lectura sale completa (nueva suscripción, cambio de formato...)
+std::atomic<bool> telemetryKeyframePending{true};
+std::atomic<uint32_t> lastTelemetryMs{0}; // millis() del último envío de telemetría
+
+// Estado del enlace WiFi, tal como lo espera la app en "wifi_status"
+enum WifiLinkState : uint8_t { WIFI_LINK_DISCONNECTED, WIFI_LINK_CONNECTING, WIFI_LINK_CONNECTED };
+const char* const WIFI_STATUS_TEXT[] = {"disconnected", "connecting", "connected"};
+std::atomic<uint8_t> wifiLinkState{WIFI_LINK_DISCONNECTED};
+
+// --- Tareas propias y reservas tras el arranque ---
+// Registro de las tareas creadas con SPAWN_TASK (y la de loop()), para el
+// mínimo de pila libre y para atribuir las reservas que ve el gancho del heap.
+// Solo se añaden entradas durante el arranque, desde la tarea de setup().
+class TaskRegistry {
+  public:
+    enum HeapPolicy : uint8_t { HEAP_ALLOWED, HEAP_FORBIDDEN };
+
+    struct Entry {
+        const char* name;
+        TaskHandle_t handle;
+        uint32_t stackBytes;
+        HeapPolicy policy;
+        std::atomic<uint32_t> allocs;     // Desde seal()
+        std::atomic<uint32_t> allocBytes;
+    };
+
+    void add(TaskHandle_t handle, const char* name, uint32_t stackBytes, HeapPolicy policy) {
+        uint8_t index = count.load(std::memory_order_relaxed);
+        if (handle == nullptr || index >= MAX_TRACKED_TASKS) return;
+        Entry& entry = entries[index];
+        entry.name = name;
+        entry.handle = handle;
+        entry.stackBytes = stackBytes;
+        entry.policy = policy;
+        count.store(index + 1, std::memory_order_release); // El gancho ya la puede ver
+    }
+
+    // Fin del arranque: desde aquí cada reserva cuenta en contra de su tarea
+    void seal() {
+        sealedAtMs = millis();
+        sealed.store(true, std::memory_order_release);
+    }
+
+    // Gancho del heap: cualquier tarea, incluso con la caché desactivada
+    void IRAM_ATTR onAlloc(size_t size) {
+        if (!sealed.load(std::memory_order_acquire) || xPortInIsrContext()) return;
+        TaskHandle_t self = xTaskGetCurrentTaskHandle();
+        uint8_t n = count.load(std::memory_order_acquire);
+        for (uint8_t i = 0; i < n; i++) {
+            Entry& entry = entries[i];
+            if (entry.handle != self) continue;
+            entry.allocs.fetch_add(1, std::memory_order_relaxed);
+            entry.allocBytes.fetch_add(size, std::memory_order_relaxed);
+#if HEAP_GUARD == HEAP_GUARD_TRAP
+            if (entry.policy == HEAP_FORBIDDEN) esp_system_abort("heap allocation after boot");
+#endif
+            return;
+        }
+        otherAllocs.fetch_add(1, std::memory_order_relaxed); // Pilas BLE, WiFi, lwIP...
+    }
+
+    uint8_t size() const { return count.load(std::memory_order_acquire); }
+    const Entry& at(uint8_t index) const { return entries[index]; }
+    bool isSealed() const { return sealed.load(std::memory_order_acquire); }
+    uint32_t sealedAt() const { return sealedAtMs; }
+    uint32_t otherAllocCount() const { return otherAllocs.load(std::memory_order_relaxed); }
+
+  private:
+    Entry entries[MAX_TRACKED_TASKS] = {};
+    std::atomic<uint8_t> count{0};
+    std::atomic<bool> sealed{false};
+    std::atomic<uint32_t> otherAllocs{0};
+    uint32_t sealedAtMs = 0;
+};
+
+TaskRegistry taskRegistry;
+
+#if HEAP_GUARD != HEAP_GUARD_OFF && CONFIG_HEAP_USE_HOOKS
+extern "C" void IRAM_ATTR esp_heap_trace_alloc_hook(void* ptr, size_t size, uint32_t caps) {
+    taskRegistry.onAlloc(size);
+}
+#endif
+
+// Crea una tarea propia y la registra. Con STATIC_ALLOCATION la pila y el TCB
+// son estáticos de cada punto de llamada, así que cada uno crea una sola tarea.
+#if STATIC_ALLOCATION
+#define SPAWN_TASK(fn, name, stackBytes, arg, priority, handle, core, policy) do {           \
+        static StackType_t taskStack[(stackBytes) / sizeof(StackType_t)];                    \
+        static StaticTask_t taskBuffer;                                                       \
+        *(handle) = xTaskCreateStaticPinnedToCore(fn, name, (stackBytes) / sizeof(StackType_t), \
+                                                  arg, priority, taskStack, &taskBuffer, core); \
+        taskRegistry.add(*(handle), name, stackBytes, TaskRegistry::policy);                 \
+    } while (0)
+#else
+#define SPAWN_TASK(fn, name, stackBytes, arg, priority, handle, core, policy) do {           \
+        xTaskCreatePinnedToCore(fn, name, stackBytes, arg, priority, handle, core);          \
+        taskRegistry.add(*(handle), name, stackBytes, TaskRegistry::policy);                 \
+    } while (0)
+#endif
+
+// Mutex propio; con STATIC_ALLOCATION sobre el buffer de quien lo posee
+inline SemaphoreHandle_t createMutex(StaticSemaphore_t* buffer) {
+#if STATIC_ALLOCATION
+    return xSemaphoreCreateMutexStatic(buffer);
+#else
+    return xSemaphoreCreateMutex();
+#endif
+}
+
+// --- Registro asíncrono ---
+// Anillo acotado multiproductor (esquema de Vyukov): cada hueco lleva un número
+// de secuencia que indica si está libre para el productor con esa posición o ya
+// escrito para el consumidor. Escribir es un CAS y unas copias; si está lleno la
+// entrada se descarta y se cuenta, nunca se espera.
+enum LogArgType : uint8_t { LOG_ARG_INT, LOG_ARG_UINT, LOG_ARG_FLOAT, LOG_ARG_TEXT };
+
+struct LogRecord {
+    uint32_t timestampMs;
+    const char* format;         // Literal en flash: es también el token del formato
+    uint8_t level;
+    uint8_t argCount;
+    uint8_t textLen;
+    uint8_t suppressed;         // Líneas omitidas en este punto justo antes (saturado)
+    uint8_t types[LOG_MAX_ARGS];
+    uint32_t args[LOG_MAX_ARGS]; // Enteros tal cual, float por bits, texto = desplazamiento
+    char text[LOG_TEXT_BYTES];
+};
+
+// Límite de frecuencia por punto de llamada. Los contadores no son atómicos:
+// con dos núcleos el límite es aproximado, que es suficiente.
+struct LogSite {
+    uint32_t windowStartMs = 0;
+    uint16_t emitted = 0;
+    uint16_t suppressed = 0;
+};
+
+__attribute__((format(printf, 1, 2))) inline void logFormatCheck(const char*, ...) {}
+
+class Logger {
+  public:
+    void begin() {
+        SPAWN_TASK(taskEntry, "log", LOG_TASK_STACK, this, LOG_TASK_PRIORITY, &task, LOG_TASK_CORE, HEAP_FORBIDDEN);
+    }
+
+    template <typename... Args>
+    void write(uint8_t level, LogSite& site, const char* format, Args... args) {
+        static_assert(sizeof...(Args) <= LOG_MAX_ARGS, "LOG: demasiados argumentos");
+        uint32_t now = millis();
+        if (now - site.windowStartMs >= LOG_RATE_WINDOW_MS) {
+            site.windowStartMs = now;
+            site.emitted = 0;
+        }
+        if (site.emitted >= LOG_RATE_BURST) {
+            site.suppressed++;
+            suppressedCount++;
+            return;
+        }
+        site.emitted++;
+
+        uint32_t pos = enqueuePos.load(std::memory_order_relaxed);
+        Slot* slot;
+        for (;;) {
+            slot = &slots[pos & (LOG_RING_DEPTH - 1)];
+            int32_t diff = (int32_t)(slot->sequence.load(std::memory_order_acquire) - pos);
+            if (diff == 0) {
+                if (enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+            } else if (diff < 0) {
+                droppedCount++; // Lleno: el consumidor no ha liberado este hueco
+                return;
+            } else {
+                pos = enqueuePos.load(std::memory_order_relaxed);
+            }
+        }
+
+        LogRecord& record = slot->record;
+        record.timestampMs = now;
+        record.format = format;
+        record.level = level;
+        record.argCount = 0;
+        record.textLen = 0;
+        record.suppressed = site.suppressed > 255 ? 255 : site.suppressed;
+        site.suppressed = 0;
+        int expand[] = {0, (encode(record, args), 0)...};
+        (void)expand;
+        slot->sequence.store(pos + 1, std::memory_order_release);
+        writtenCount++;
+
+        // Solo hace falta despertar al consumidor si el anillo estaba vacío
+        if (task != nullptr && pos == dequeuePos.load(std::memory_order_relaxed)) xTaskNotifyGive(task);
+    }
+
+    uint32_t written() const { return writtenCount.load(); }
+    uint32_t dropped() const { return droppedCount.load(); }
+    uint32_t suppressed() const { return suppressedCount.load(); }
+
+  private:
+    struct Slot {
+        std::atomic<uint32_t> sequence;
+        LogRecord record;
+    };
+
+    template <typename T>
+    static void encode(LogRecord& record, T value) {
+        static_assert(std::is_arithmetic<T>::value && sizeof(T) <= 4, "LOG: tipo de argumento no soportado");
+        uint8_t i = record.argCount++;
+        if (std::is_floating_point<T>::value) {
+            float f = (float)value;
+            record.types[i] = LOG_ARG_FLOAT;
+            memcpy(&record.args[i], &f, sizeof(f));
+        } else {
+            record.types[i] = std::is_signed<T>::value ? LOG_ARG_INT : LOG_ARG_UINT;
+            record.args[i] = (uint32_t)value;
+        }
+    }
+
+    static void encode(LogRecord& record, double value) { encode(record, (float)value); }
+
+    static void encode(LogRecord& record, const char* data, size_t dataLen) {
+        uint8_t i = record.argCount++;
+        record.types[i] = LOG_ARG_TEXT;
+        size_t room = sizeof(record.text) - record.textLen;
+        if (room == 0) {
+            record.args[i] = sizeof(record.text) - 1; // Sin sitio: el '\0' del último texto
+            return;
+        }
+        record.args[i] = record.textLen;
+        size_t len = std::min(dataLen, room - 1);
+        memcpy(record.text + record.textLen, data, len);
+        record.text[record.textLen + len] = '\0';
+        record.textLen += len + 1;
+    }
+
+    static void encode(LogRecord& record, const char* value) {
+        size_t room = sizeof(record.text) - record.textLen;
+        encode(record, value ? value : "", value ? strnlen(value, room) : 0);
+    }
+
+    static void encode(LogRecord& record, char* value) { encode(record, (const char*)value); }
+
+    static void taskEntry(void* context) {
+        static_cast<Logger*>(context)->run();
+    }
+
+    void run() {
+        for (;;) {
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+            for (;;) {
+                uint32_t pos = dequeuePos.load(std::memory_order_relaxed);
+                Slot& slot = slots[pos & (LOG_RING_DEPTH - 1)];
+                if (slot.sequence.load(std::memory_order_acquire) != pos + 1) break;
+                LogRecord record = slot.record;
+                slot.sequence.store(pos + LOG_RING_DEPTH, std::memory_order_release);
+                dequeuePos.store(pos + 1, std::memory_order_relaxed);
+                output(record);
+            }
+        }
+    }
+
+#if LOG_BINARY_OUTPUT
+    // 0xA7, longitud, nivel, nº de argumentos, omitidas, tiempo (u32), token
+    // (u32), tipos y argumentos (u32 cada uno) y el texto, todo little-endian
+    void output(const LogRecord& record) {
+        uint8_t buffer[16 + LOG_MAX_ARGS * 5 + LOG_TEXT_BYTES];
+        uint8_t* out = buffer + 2;
+        *out++ = record.level;
+        *out++ = record.argCount;
+        *out++ = record.suppressed;
+        memcpy(out, &record.timestampMs, 4); out += 4;
+        uint32_t token = (uint32_t)(uintptr_t)record.format;
+        memcpy(out, &token, 4); out += 4;
+        memcpy(out, record.types, record.argCount); out += record.argCount;
+        memcpy(out, record.args, record.argCount * 4); out += record.argCount * 4;
+        memcpy(out, record.text, record.textLen); out += record.textLen;
+        buffer[0] = 0xA7;
+        buffer[1] = out - buffer;
+        Serial.write(buffer, out - buffer);
+    }
+#else
+    // Formatea cada especificador por separado con el tipo guardado: así no
+    // hace falta reconstruir una va_list
+    void output(const LogRecord& record) {
+        static const char LEVEL_TAG[] = "?EWID";
+        char line[192];
+        int len = snprintf(line, sizeof(line), "[%7lu.%03u] %c ", (unsigned long)(record.timestampMs / 1000),
+                           (unsigned)(record.timestampMs % 1000), LEVEL_TAG[record.level]);
+        const char* cursor = record.format;
+        uint8_t arg = 0;
+        while (*cursor && len < (int)sizeof(line) - 1) {
+            if (*cursor != '%' || cursor[1] == '%') {
+                line[len++] = *cursor;
+                cursor += (*cursor == '%') ? 2 : 1;
+                continue;
+            }
+            const char* end = cursor + 1;
+            while (*end && !strchr("diuxXcfeEgGs", *end)) end++;
+            if (*end == '\0' || arg >= record.argCount) break;
+            char spec[16];
+            size_t specLen = std::min<size_t>(end - cursor + 1, sizeof(spec) - 1);
+            memcpy(spec, cursor, specLen);
+            spec[specLen] = '\0';
+
+            size_t room = sizeof(line) - len;
+            uint32_t raw = record.args[arg];
+            int written = 0;
+            switch (record.types[arg]) {
+                case LOG_ARG_INT:   written = snprintf(line + len, room, spec, (int32_t)raw); break;
+                case LOG_ARG_UINT:  written = snprintf(line + len, room, spec, raw); break;
+                case LOG_ARG_FLOAT: {
+                    float f;
+                    memcpy(&f, &raw, sizeof(f));
+                    written = snprintf(line + len, room, spec, (double)f);
+                    break;
+                }
+                case LOG_ARG_TEXT:  written = snprintf(line + len, room, spec, record.text + raw); break;
+            }
+            len += std::min<int>(std::max(written, 0), room - 1);
+            arg++;
+            cursor = end + 1;
+        }
+        if (record.suppressed && len < (int)sizeof(line) - 1) {
+            len += snprintf(line + len, sizeof(line) - len, " (+%u omitidas)", (unsigned)record.suppressed);
+            len = std::min<int>(len, sizeof(line) - 1);
+        }
+        line[len] = '\0';
+        Serial.println(line);
+    }
+#endif
+
+    Slot slots[LOG_RING_DEPTH] = {};
+    std::atomic<uint32_t> enqueuePos{0};
+    std::atomic<uint32_t> dequeuePos{0};
+    TaskHandle_t task = nullptr;
+    std::atomic<uint32_t> writtenCount{0};
+    std::atomic<uint32_t> droppedCount{0};
+    std::atomic<uint32_t> suppressedCount{0};
+
+  public:
+    Logger() {
+        for (uint32_t i = 0; i < LOG_RING_DEPTH; i++) slots[i].sequence.store(i, std::memory_order_relaxed);
+    }
+};
+
+Logger logger;
+
+// El formato se comprueba como un printf aunque el nivel esté desactivado, y
+// entonces el compilador elimina la llamada entera
+#define LOG_AT(level, format, ...) do { \
+        if (false) logFormatCheck(format, ##__VA_ARGS__); \
+        if ((level) <= LOG_LEVEL) { \
+            static LogSite logSite; \
+            logger.write(level, logSite, format, ##__VA_ARGS__); \
+        } \
+    } while (0)
+#define LOG_E(format, ...) LOG_AT(LOG_LEVEL_ERROR, format, ##__VA_ARGS__)
+#define LOG_W(format, ...) LOG_AT(LOG_LEVEL_WARN, format, ##__VA_ARGS__)
+#define LOG_I(format, ...) LOG_AT(LOG_LEVEL_INFO, format, ##__VA_ARGS__)
+#define LOG_D(format, ...) LOG_AT(LOG_LEVEL_DEBUG, format, ##__VA_ARGS__)
+
+// --- Framer de líneas sin memoria dinámica ---
+// Recorre cada bloque recibido buscando '\n' directamente sobre los datos de la
+// característica. Las líneas completas dentro de un bloque se entregan sin copiar;
+// solo el fragmento final incompleto se guarda en un buffer fijo hasta que llegue
+// el resto en la siguiente escritura. Una línea más larga que la capacidad se
+// descarta entera (hasta su '\n') y se cuenta en `overflowCount`.
+template <size_t Capacity>
+class LineFramer {
+  public:
+    // Procesa un bloque y llama a onLine(const char* line, size_t len) por cada
+    // línea completa, ya sin espacios ni '\r' en los extremos. Las líneas vacías
+    // se ignoran. El puntero solo es válido durante la llamada.
+    template <typename Handler>
+    void feed(const uint8_t* data, size_t len, Handler&& onLine) {
+        const char* cursor = reinterpret_cast<const char*>(data);
+        const char* end = cursor + len;
+
+        while (cursor < end) {
+            const char* newline = static_cast<const char*>(memchr(cursor, '\n', end - cursor));
+            if (newline == nullptr) {
+                append(cursor, end - cursor);
+                return;
+            }
+
+            size_t segmentLen = newline - cursor;
+            if (discarding) {
+                // Fin de una línea demasiado larga: se resincroniza aquí
+                discarding = false;
+            } else if (pendingLen == 0 && segmentLen <= Capacity) {
+                // Caso común: la línea completa está dentro de este bloque
+                emit(cursor, segmentLen, onLine);
+            } else if (append(cursor, segmentLen)) {
+                emit(pending, pendingLen, onLine);
+            } else {
+                discarding = false;
+            }
+            pendingLen = 0;
+            cursor = newline + 1;
+        }
+    }
+
+    void reset() {
+        pendingLen = 0;
+        discarding = false;
+    }
+
+    std::atomic<uint32_t> overflowCount{0}; // Líneas descartadas por superar Capacity
+
+  private:
+    char pending[Capacity];
+    size_t pendingLen = 0;
+    bool discarding = false;
+
+    // Acumula un fragmento parcial; devuelve false si la línea no cabe
+    bool append(const char* src, size_t len) {
+        if (discarding) return false;
+        if (pendingLen + len > Capacity) {
+            discarding = true;
+            pendingLen = 0;
+            overflowCount++;
+            return false;
+        }
+        memcpy(pending + pendingLen, src, len);
+        pendingLen += len;
+        return true;
+    }
+
+    template <typename Handler>
+    static void emit(const char* line, size_t len, Handler& onLine) {
+        while (len > 0 && isspace((unsigned char)line[0])) { line++; len--; }
+        while (len > 0 && isspace((unsigned char)line[len - 1])) { len--; }
+        if (len > 0) onLine(line, len);
+    }
+};
+
+
+// --- Cola SPSC sin bloqueos entre el callback RX y la tarea de comandos ---
+// Un único productor (el callback BLE) y un único consumidor (commandTask).
+// Cada hueco guarda una línea completa terminada en '\0', así el consumidor la
+// procesa en su sitio sin copiarla. Si la cola está llena la línea se descarta
+// y se cuenta; el productor nunca se bloquea.
+template <size_t Depth, size_t SlotSize>
+class SpscLineQueue {
+    static_assert((Depth & (Depth - 1)) == 0, "Depth debe ser potencia de 2");
+
+  public:
+    struct Slot {
+        size_t len;
+        uint8_t session;  // Índice en la tabla de sesiones...
+        uint16_t connId;  // ...y conexión que lo ocupaba al recibirse
+        int64_t receivedUs; // esp_timer al recibirse, para "queue_us"
+        char data[SlotSize + 1];
+    };
+
+    // Productor: copia la línea en el siguiente hueco libre
+    bool push(const char* line, size_t len, uint8_t session, uint16_t connId) {
+        uint32_t head = headIndex.load(std::memory_order_relaxed);
+        uint32_t tail = tailIndex.load(std::memory_order_acquire);
+        if (head - tail >= Depth || len > SlotSize) {
+            overflowCount.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+
+        Slot& slot = slots[head & (Depth - 1)];
+        memcpy(slot.data, line, len);
+        slot.data[len] = '\0';
+        slot.len = len;
+        slot.session = session;
+        slot.connId = connId;
+        slot.receivedUs = esp_timer_get_time();
+        headIndex.store(head + 1, std::memory_order_release);
+
+        enqueuedCount.fetch_add(1, std::memory_order_relaxed);
+        uint32_t used = head + 1 - tail;
+        if (used > highWater.load(std::memory_order_relaxed)) {
+            highWater.store(used, std::memory_order_relaxed);
+        }
+        return true;
+    }
+
+    // Consumidor: hueco más antiguo, o nullptr si la cola está vacía
+    const Slot* front() const {
+        uint32_t tail = tailIndex.load(std::memory_order_relaxed);
+        if (tail == headIndex.load(std::memory_order_acquire)) return nullptr;
+        return &slots[tail & (Depth - 1)];
+    }
+
+    // Consumidor: libera el hueco devuelto por front()
+    void pop() {
+        tailIndex.store(tailIndex.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    uint32_t depth() const {
+        return headIndex.load(std::memory_order_acquire) - tailIndex.load(std::memory_order_acquire);
+    }
+    uint32_t capacity() const { return Depth; }
+    uint32_t highWaterMark() const { return highWater.load(std::memory_order_relaxed); }
+    uint32_t overflows() const { return overflowCount.load(std::memory_order_relaxed); }
+    uint32_t enqueued() const { return enqueuedCount.load(std::memory_order_relaxed); }
+
+  private:
+    Slot slots[Depth];
+    std::atomic<uint32_t> headIndex{0};
+    std::atomic<uint32_t> tailIndex{0};
+    std::atomic<uint32_t> highWater{0};
+    std::atomic<uint32_t> overflowCount{0};
+    std::atomic<uint32_t> enqueuedCount{0};
+};
+
+SpscLineQueue<COMMAND_QUEUE_DEPTH, MAX_COMMAND_LENGTH> commandQueue;
+TaskHandle_t commandTaskHandle = nullptr;
+
+// --- Instrumentación del camino caliente ---
+// Cada etapa la registra una sola tarea (RX en la de Bluedroid, notify en txTask
+// y el resto en commandTask), así que no hacen falta bloqueos; una lectura
+// concurrente desde get_diagnostics puede ver una muestra a medias, sin más.
+class LatencyHistogram {
+  public:
+    void record(uint32_t us) {
+        // Cubeta i = [2^i, 2^(i+1)) us; la 0 incluye también el 0
+        uint32_t bucket = us ? 31 - __builtin_clz(us) : 0;
+        if (bucket >= DIAG_HISTOGRAM_BUCKETS) bucket = DIAG_HISTOGRAM_BUCKETS - 1;
+        buckets[bucket]++;
+        count++;
+        totalUs += us;
+        if (us > maxUs) maxUs = us;
+    }
+
+    // Cota superior del percentil (borde de la cubeta donde cae)
+    uint32_t percentileUs(uint32_t percent) const {
+        if (count == 0) return 0;
+        uint64_t target = ((uint64_t)count * percent + 99) / 100;
+        uint64_t seen = 0;
+        for (uint32_t i = 0; i < DIAG_HISTOGRAM_BUCKETS; i++) {
+            seen += buckets[i];
+            if (seen >= target) return i == DIAG_HISTOGRAM_BUCKETS - 1 ? maxUs : (2u << i) - 1;
+        }
+        return maxUs;
+    }
+
+    void reset() { *this = LatencyHistogram(); }
+
+    uint32_t buckets[DIAG_HISTOGRAM_BUCKETS] = {};
+    uint32_t count = 0;
+    uint32_t maxUs = 0;
+    uint64_t totalUs = 0;
+};
+
+enum DiagStage : uint8_t {
+    DIAG_RX_FRAME,   // Framer de líneas sobre una escritura RX
+    DIAG_PARSE,      // deserializeJson
+    DIAG_HANDLER,    // Handler del comando
+    DIAG_SERIALIZE,  // Serialización de la respuesta en el anillo TX
+    DIAG_NOTIFY,     // setValue() + notify() de un trozo
+    DIAG_COMMAND,    // Comando completo, de la cola a la respuesta encolada
+    DIAG_STAGE_COUNT
+};
+
+const char* const DIAG_STAGE_NAMES[DIAG_STAGE_COUNT] = {"rx_frame", "parse", "handler", "serialize", "notify", "command"};
+
+struct Diagnostics {
+    LatencyHistogram stages[DIAG_STAGE_COUNT];
+    uint32_t rxWrites = 0;
+    uint32_t rxBytes = 0;
+    uint32_t commands = 0;
+    uint32_t parseErrors = 0;
+    uint32_t unknownCommands = 0;
+    uint32_t sinceMs = 0;    // Desde cuándo acumulan (último reset)
+} diagnostics;
+
+// Hitos del arranque en µs de esp_timer (0 = aún no). El primero es la entrada
+// en setup(): lo anterior es bootloader y arranque del IDF.
+enum BootPhase : uint8_t {
+    BOOT_SETUP, BOOT_CONFIG, BOOT_BLE, BOOT_ADVERTISING, BOOT_HISTORY, BOOT_SENSORS, BOOT_NETWORK,
+    BOOT_READY, BOOT_FIRST_SAMPLE, BOOT_FIRST_CONNECTION, BOOT_PHASE_COUNT
+};
+
+const char* const BOOT_PHASE_NAMES[BOOT_PHASE_COUNT] = {
+    "setup", "config", "ble_init", "advertising", "history", "sensors", "network",
+    "ready", "first_sample", "first_connection",
+};
+
+// En 64 bits: first_connection o first_sample pueden llegar pasados los
+// 71 min en los que 32 bits de µs dan la vuelta.
+class BootTimeline {
+  public:
+    // Solo cuenta la primera vez; se puede llamar desde cualquier tarea
+    void mark(BootPhase phase) {
+        uint64_t now = esp_timer_get_time();
+        portENTER_CRITICAL(&lock);
+        if (at[phase] == 0) at[phase] = std::max<uint64_t>(now, 1);
+        portEXIT_CRITICAL(&lock);
+    }
+
+    bool reached(BootPhase phase) const { return atUs(phase) != 0; }
+    uint64_t atUs(BootPhase phase) const {
+        portENTER_CRITICAL(&lock);
+        uint64_t value = at[phase];
+        portEXIT_CRITICAL(&lock);
+        return value;
+    }
+
+  private:
+    mutable portMUX_TYPE lock = portMUX_INITIALIZER_UNLOCKED;
+    uint64_t at[BOOT_PHASE_COUNT] = {};
+};
+
+BootTimeline bootTimeline;
+
+// Mide el ámbito en el que se declara: DiagTimer t(DIAG_PARSE);
+class DiagTimer {
+  public:
+    explicit DiagTimer(DiagStage stage) : stage(stage), started(esp_timer_get_time()) {}
+    ~DiagTimer() { diagnostics.stages[stage].record((uint32_t)(esp_timer_get_time() - started)); }
+
+  private:
+    DiagStage stage;
+    int64_t started;
+};
+
+// --- Planificador de notificaciones TX ---
+// Anillo de bytes con varios productores (tarea de comandos, loop()) y un solo
+// consumidor (txTask). Las respuestas JSON se serializan directamente en el
+// anillo, de modo que la única copia es la de setValue() al notificar. La
+// memoria que se está notificando no se libera hasta después de setValue().
+template <size_t Size>
+class TxScheduler {
+    static_assert((Size & (Size - 1)) == 0, "Size debe ser potencia de 2");
+
+  public:
+    struct Stats {
+        uint32_t frames;        // Tramas aceptadas
+        uint32_t dropped;       // Tramas descartadas por falta de espacio
+        uint32_t notifications;
+        uint32_t bytes;
+        uint32_t coalesced;     // Notificaciones con más de una trama completa
+        uint32_t split;         // Notificaciones que terminan a mitad de trama
+        uint32_t notifyErrors;  // Fallos informados por la pila (onStatus)
+        uint64_t activeUs;      // Tiempo total notificando
+    };
+
+    void begin(TaskHandle_t consumer) {
+        mutex = createMutex(&mutexBuffer);
+        task = consumer;
+    }
+
+    // Encola un documento como una trama terminada en '\n'
+    bool sendJson(const JsonDocument& doc) {
+        size_t len = measureJson(doc);
+        xSemaphoreTake(mutex, portMAX_DELAY);
+        if (!reserve(len + 1)) {
+            xSemaphoreGive(mutex);
+            return false;
+        }
+        RingWriter writer{ ring, head };
+        serializeJson(doc, writer);
+        ring[(head + len) & (Size - 1)] = '\n';
+        commit(len + 1);
+        xSemaphoreGive(mutex);
+        return true;
+    }
+
+    // Encola una trama ya formada, que debe incluir su '\n'
+    bool sendRaw(const uint8_t* frame, size_t len) {
+        xSemaphoreTake(mutex, portMAX_DELAY);
+        if (!reserve(len)) {
+            xSemaphoreGive(mutex);
+            return false;
+        }
+        RingWriter writer{ ring, head };
+        writer.write(frame, len);
+        commit(len);
+        xSemaphoreGive(mutex);
+        return true;
+    }
+
+    // Consumidor: envía todo lo pendiente en trozos de hasta payloadSize().
+    // Devuelve los bytes enviados.
+    // Plantilla sobre la característica para poder vaciarlo contra cualquier
+    // objeto con setValue(uint8_t*, size_t) y notify(), p. ej. uno simulado
+    template <typename Characteristic>
+    size_t drain(Characteristic* characteristic) {
+        int64_t started = esp_timer_get_time();
+        size_t sent = 0;
+        for (;;) {
+            xSemaphoreTake(mutex, portMAX_DELAY);
+            uint32_t start = tail;
+            size_t available = head - tail;
+            size_t offset = start & (Size - 1);
+            size_t chunk = available;
+            if (chunk > payloadSize()) chunk = payloadSize();
+            if (chunk > Size - offset) chunk = Size - offset; // No cruzar el final del anillo
+            xSemaphoreGive(mutex);
+            if (chunk == 0) break;
+
+            {
+                DiagTimer timer(DIAG_NOTIFY);
+                characteristic->setValue(ring + offset, chunk);
+                characteristic->notify();
+            }
+
+            uint32_t frameEnds = 0;
+            for (const uint8_t* p = ring + offset; (p = (const uint8_t*)memchr(p, '\n', ring + offset + chunk - p)); p++) {
+                frameEnds++;
+            }
+            stats.notifications++;
+            stats.bytes += chunk;
+            sent += chunk;
+            if (frameEnds > 1) stats.coalesced++;
+            if (ring[offset + chunk - 1] != '\n') stats.split++;
+
+            xSemaphoreTake(mutex, portMAX_DELAY);
+            if (tail == start) tail = start + chunk; // reset() pudo vaciar el anillo
+            xSemaphoreGive(mutex);
+            if (spaceWaiter != nullptr) xTaskNotifyGive(spaceWaiter);
+        }
+        stats.activeUs += esp_timer_get_time() - started;
+        return sent;
+    }
+
+    // Empieza a aceptar tramas para una conexión nueva, con estadísticas a cero
+    void open(uint16_t peerMtu) {
+        xSemaphoreTake(mutex, portMAX_DELAY);
+        tail = head;
+        mtu = peerMtu;
+        stats = {};
+        connected = true;
+        xSemaphoreGive(mutex);
+    }
+
+    // Descarta lo pendiente (al desconectar) y vuelve al MTU por defecto
+    void reset() {
+        xSemaphoreTake(mutex, portMAX_DELAY);
+        tail = head;
+        mtu = ATT_DEFAULT_MTU;
+        connected = false;
+        xSemaphoreGive(mutex);
+    }
+
+    void setMtu(uint16_t negotiated) { mtu = negotiated; }
+    uint16_t currentMtu() const { return mtu; }
+    size_t payloadSize() const { return mtu - ATT_NOTIFY_OVERHEAD; }
+    size_t pending() const { return head - tail; }
+    size_t freeSpace() const { return Size - (head - tail); }
+
+    // Tarea a avisar cada vez que se libera espacio (para envíos masivos)
+    void setSpaceWaiter(TaskHandle_t waiter) { spaceWaiter = waiter; }
+    void noteNotifyError() { stats.notifyErrors++; }
+    const Stats& statistics() const { return stats; }
+
+  private:
+    // Destino de serializeJson que escribe en el anillo dando la vuelta al final
+    struct RingWriter {
+        uint8_t* ring;
+        uint32_t pos;
+
+        size_t write(uint8_t c) {
+            ring[pos++ & (Size - 1)] = c;
+            return 1;
+        }
+        size_t write(const uint8_t* data, size_t len) {
+            size_t offset = pos & (Size - 1);
+            size_t first = len < Size - offset ? len : Size - offset;
+            memcpy(ring + offset, data, first);
+            memcpy(ring, data + first, len - first);
+            pos += len;
+            return len;
+        }
+    };
+
+    // Requieren tener el mutex
+    bool reserve(size_t len) {
+        if (!connected || len > Size - (head - tail)) {
+            stats.dropped++;
+            return false;
+        }
+        return true;
+    }
+    void commit(size_t len) {
+        head += len;
+        stats.frames++;
+        xTaskNotifyGive(task);
+    }
+
+    uint8_t ring[Size];
+    uint32_t head = 0; // Contadores crecientes; se enmascaran al indexar
+    uint32_t tail = 0;
+    volatile uint16_t mtu = ATT_DEFAULT_MTU;
+    bool connected = false;
+    Stats stats = {};
+    SemaphoreHandle_t mutex = nullptr;
+    StaticSemaphore_t mutexBuffer;
+    TaskHandle_t task = nullptr;
+    TaskHandle_t volatile spaceWaiter = nullptr;
+};
+
+TaskHandle_t txTaskHandle = nullptr;
+uint16_t connIntervalUnits = 0; // Intervalo de conexión en unidades de 1,25 ms
+
+// --- Sesiones por central ---
+// Cada conexión tiene su framer RX, su anillo TX con su MTU, su suscripción al
+// CCCD de TX y su formato de telemetría, buscados por el conn_id de Bluedroid.
+// Las respuestas van solo a la sesión que envió el comando; la telemetría y los
+// avisos se serializan una vez y la trama se copia a cada sesión suscrita.
+struct Session {
+    volatile bool active = false;
+    volatile bool subscribed = false; // Notificaciones activadas en el CCCD de TX
+    uint16_t connId = 0;
+    esp_bd_addr_t address = {};
+    uint32_t connectedAtMs = 0;
+    std::atomic<uint8_t> telemetryMode{TELEMETRY_JSON}; // Cada conexión empieza en JSON
+    LineFramer<MAX_COMMAND_LENGTH> framer;
+    TxScheduler<TX_RING_SIZE> tx;
+
+    // Control de flujo RX. Las líneas se numeran desde la conexión, contando
+    // también las demasiado largas, igual que las cuenta la app.
+    std::atomic<bool> rxFlow{false};
+    std::atomic<uint32_t> rxReceived{0};  // Entregadas por el framer (callback RX)
+    std::atomic<uint32_t> rxConsumed{0};  // Procesadas y fuera de la cola (commandTask)
+    std::atomic<uint32_t> rxDropped{0};   // Descartadas: sin ventana o con la cola llena
+    uint32_t rxDropSeq[RX_DROP_LOG] = {}; // Número de las últimas descartadas
+    uint32_t rxOverflowBase = 0;          // framer.overflowCount al conectar
+    uint32_t rxAdvertised = 0;            // Último "acked" enviado (commandTask)
+    uint32_t rxDropReported = 0;          // "dropped" ya avisado (commandTask)
+
+    // Líneas que ya no ocupan la cola: procesadas o desbordadas en el framer.
+    // Las descartadas no cuentan, van en "dropped".
+    uint32_t rxAcked() const {
+        return rxConsumed.load() + framer.overflowCount.load() - rxOverflowBase;
+    }
+
+    // Solo desde el callback RX
+    uint32_t rxInQueue() const { return rxReceived.load() - rxDropped.load() - rxConsumed.load(); }
+    uint32_t rxNextSeq() const { return rxReceived.load() + framer.overflowCount.load() - rxOverflowBase; }
+    void rxDrop(uint32_t seq) {
+        uint32_t n = rxDropped.load(std::memory_order_relaxed);
+        rxDropSeq[n % RX_DROP_LOG] = seq;
+        rxDropped.store(n + 1, std::memory_order_release);
+    }
+};
+
+static_assert(RX_CREDIT_WINDOW >= 1, "La cola de comandos debe dar al menos una línea por sesión");
+
+class SessionTable {
+  public:
+    void start(TaskHandle_t consumer) {
+        for (Session& session : sessions) session.tx.begin(consumer);
+    }
+
+    // Alta y baja: solo desde los callbacks de Bluedroid (una única tarea)
+    Session* open(uint16_t connId, const esp_bd_addr_t address, uint16_t mtu) {
+        for (Session& session : sessions) {
+            if (session.active) continue;
+            session.connId = connId;
+            memcpy(session.address, address, sizeof(session.address));
+            session.connectedAtMs = millis();
+            session.subscribed = false;
+            session.telemetryMode = TELEMETRY_JSON;
+            session.framer.reset();
+            session.rxFlow = false;
+            session.rxReceived = 0;
+            session.rxConsumed = 0;
+            session.rxDropped = 0;
+            session.rxOverflowBase = session.framer.overflowCount.load();
+            session.rxAdvertised = 0;
+            session.rxDropReported = 0;
+            session.tx.open(mtu);
+            session.active = true;
+            activeCount++;
+            return &session;
+        }
+        return nullptr;
+    }
+
+    void close(Session& session) {
+        session.active = false;
+        session.subscribed = false;
+        session.tx.reset();
+        session.framer.reset(); // Descartar cualquier comando a medias
+        activeCount--;
+    }
+
+    Session* find(uint16_t connId) {
+        for (Session& session : sessions) {
+            if (session.active && session.connId == connId) return &session;
+        }
+        return nullptr;
+    }
+
+    Session& at(uint8_t index) { return sessions[index]; }
+    uint8_t indexOf(const Session& session) const { return &session - sessions; }
+    uint8_t count() const { return activeCount; }
+    bool full() const { return activeCount >= MAX_CENTRALS; }
+    Session* begin() { return sessions; }
+    Session* end() { return sessions + MAX_CENTRALS; }
+
+    // Envía a las sesiones suscritas que acepte `filter`. Con un solo destino se
+    // serializa directamente en su anillo; con varios, una vez a un buffer que
+    // después se copia. Devuelve a cuántas sesiones se encoló.
+    template <typename Filter>
+    uint8_t broadcastJson(const JsonDocument& doc, Filter&& filter) {
+        Session* targets[MAX_CENTRALS];
+        uint8_t targetCount = collect(targets, filter);
+        if (targetCount == 1) return targets[0]->tx.sendJson(doc) ? 1 : 0;
+
+        uint8_t queued = 0;
+        char frame[TX_BROADCAST_FRAME_MAX];
+        size_t len = measureJson(doc);
+        if (targetCount > 1 && len + 1 <= sizeof(frame)) {
+            serializeJson(doc, frame, sizeof(frame));
+            frame[len] = '\n';
+            for (uint8_t i = 0; i < targetCount; i++) {
+                if (targets[i]->tx.sendRaw((const uint8_t*)frame, len + 1)) queued++;
+            }
+            return queued;
+        }
+        // Documento grande (raro): se serializa por sesión
+        for (uint8_t i = 0; i < targetCount; i++) {
+            if (targets[i]->tx.sendJson(doc)) queued++;
+        }
+        return queued;
+    }
+
+    uint8_t broadcastJson(const JsonDocument& doc) {
+        return broadcastJson(doc, [](const Session&) { return true; });
+    }
+
+    // Trama ya formada (binaria o JSON con su '\n'), copiada a cada destino
+    template <typename Filter>
+    uint8_t broadcastRaw(const uint8_t* frame, size_t len, Filter&& filter) {
+        Session* targets[MAX_CENTRALS];
+        uint8_t targetCount = collect(targets, filter);
+        uint8_t queued = 0;
+        for (uint8_t i = 0; i < targetCount; i++) {
+            if (targets[i]->tx.sendRaw(frame, len)) queued++;
+        }
+        return queued;
+    }
+
+    uint8_t broadcastRaw(const uint8_t* frame, size_t len) {
+        return broadcastRaw(frame, len, [](const Session&) { return true; });
+    }
+
+  private:
+    template <typename Filter>
+    uint8_t collect(Session** targets, Filter& filter) {
+        uint8_t targetCount = 0;
+        for (Session& session : sessions) {
+            if (session.active && session.subscribed && filter(session)) targets[targetCount++] = &session;
+        }
+        return targetCount;
+    }
+
+    Session sessions[MAX_CENTRALS];
+    std::atomic<uint8_t> activeCount{0};
+};
+
+SessionTable sessions;
+Session* currentSession = nullptr; // Sesión del comando en curso (solo en commandTask)
+uint16_t gattsInterface = 0;       // Para notificar a una conexión concreta
+uint16_t txValueHandle = 0;
+uint16_t txCccdHandle = 0;
+
+// Destino de TxScheduler::drain que notifica a una sola conexión. notify() de
+// BLECharacteristic enviaría el mismo valor a todos los centrales.
+struct SessionNotifier {
+    Session& session;
+    const uint8_t* data = nullptr;
+    size_t len = 0;
+
+    void setValue(const uint8_t* value, size_t length) {
+        data = value;
+        len = length;
+    }
+    void notify() {
+        if (esp_ble_gatts_send_indicate(gattsInterface, session.connId, txValueHandle, len,
+                                        const_cast<uint8_t*>(data), false) != ESP_OK) {
+            session.tx.noteNotifyError();
+        }
+    }
+};
+
+// --- Arenas fijas para JsonDocument ---
+// Asignador lineal sobre un buffer propio: ArduinoJson pide aquí sus bloques en
+// lugar de usar malloc. Liberar solo recupera memoria si es el último bloque;
+// el resto se recupera de golpe con reset() al devolver el documento al pool.
+// Si la arena se llena, allocate() devuelve nullptr y el documento queda
+// marcado como overflowed().
+template <size_t Capacity>
+class JsonArena : public ArduinoJson::Allocator {
+  public:
+    void* allocate(size_t size) override {
+        size_t offset = used + HEADER_SIZE;
+        size_t end = offset + align(size);
+        if (end > Capacity) return nullptr;
+
+        *reinterpret_cast<size_t*>(storage + used) = size;
+        lastOffset = offset;
+        used = end;
+        if (used > peak) peak = used;
+        return storage + offset;
+    }
+
+    void deallocate(void* ptr) override {
+        if (ptr != nullptr && ptr == storage + lastOffset) {
+            used = lastOffset - HEADER_SIZE;
+            lastOffset = 0;
+        }
+    }
+
+    void* reallocate(void* ptr, size_t newSize) override {
+        if (ptr == nullptr) return allocate(newSize);
+
+        // El último bloque crece o encoge en su sitio
+        if (ptr == storage + lastOffset) {
+            size_t end = lastOffset + align(newSize);
+            if (end > Capacity) return nullptr;
+            *reinterpret_cast<size_t*>(storage + lastOffset - HEADER_SIZE) = newSize;
+            used = end;
+            if (used > peak) peak = used;
+            return ptr;
+        }
+
+        size_t oldSize = *reinterpret_cast<size_t*>(static_cast<uint8_t*>(ptr) - HEADER_SIZE);
+        void* moved = allocate(newSize);
+        if (moved != nullptr) memcpy(moved, ptr, oldSize < newSize ? oldSize : newSize);
+        return moved;
+    }
+
+    void reset() {
+        used = 0;
+        lastOffset = 0;
+    }
+
+    size_t peakBytes() const { return peak; }
+
+  private:
+    static constexpr size_t HEADER_SIZE = 8; // Tamaño del bloque, alineado a 8
+    static size_t align(size_t size) { return (size + 7) & ~size_t(7); }
+
+    alignas(8) uint8_t storage[Capacity];
+    size_t used = 0;
+    size_t lastOffset = 0;
+    size_t peak = 0;
+};
+
+// Pool de documentos ya construidos sobre sus arenas. Se reserva entero en
+// memoria estática al arrancar, así que pedir y devolver un documento no toca
+// el heap. El préstamo usa una máscara atómica: lo pueden usar varias tareas.
+template <size_t Count, size_t ArenaSize>
+class JsonDocumentPool {
+    static_assert(Count <= 32, "La máscara de libres es de 32 bits");
+
+  public:
+    JsonDocument* acquire() {
+        uint32_t mask = freeMask.load(std::memory_order_relaxed);
+        while (mask != 0) {
+            uint32_t index = __builtin_ctz(mask);
+            if (freeMask.compare_exchange_weak(mask, mask & ~(1u << index),
+                                               std::memory_order_acquire)) {
+                uint32_t busy = inUse.fetch_add(1, std::memory_order_relaxed) + 1;
+                if (busy > highWater.load(std::memory_order_relaxed)) {
+                    highWater.store(busy, std::memory_order_relaxed);
+                }
+                return &members[index].doc;
+            }
+        }
+        exhaustedCount.fetch_add(1, std::memory_order_relaxed);
+        return nullptr;
+    }
+
+    void release(JsonDocument* doc) {
+        for (uint32_t i = 0; i < Count; i++) {
+            if (&members[i].doc == doc) {
+                members[i].doc.clear();
+                members[i].arena.reset();
+                inUse.fetch_sub(1, std::memory_order_relaxed);
+                freeMask.fetch_or(1u << i, std::memory_order_release);
+                return;
+            }
+        }
+    }
+
+    uint32_t capacity() const { return Count; }
+    uint32_t arenaSize() const { return ArenaSize; }
+    uint32_t inUseCount() const { return inUse.load(std::memory_order_relaxed); }
+    uint32_t highWaterMark() const { return highWater.load(std::memory_order_relaxed); }
+    uint32_t exhausted() const { return exhaustedCount.load(std::memory_order_relaxed); }
+
+    // Mayor ocupación alcanzada por cualquier arena, en bytes
+    uint32_t peakArenaBytes() const {
+        size_t peak = 0;
+        for (const Member& member : members) {
+            if (member.arena.peakBytes() > peak) peak = member.arena.peakBytes();
+        }
+        return peak;
+    }
+
+  private:
+    struct Member {
+        JsonArena<ArenaSize> arena;
+        JsonDocument doc{&arena};
+    };
+
+    Member members[Count];
+    std::atomic<uint32_t> freeMask{Count == 32 ? 0xffffffffu : (1u << Count) - 1};
+    std::atomic<uint32_t> inUse{0};
+    std::atomic<uint32_t> highWater{0};
+    std::atomic<uint32_t> exhaustedCount{0};
+};
+
+JsonDocumentPool<JSON_POOL_SIZE, JSON_ARENA_SIZE> jsonPool;
+
+// Préstamo RAII de un documento del pool; se devuelve al salir de ámbito.
+// Comprobar con `if (!doc)` por si el pool está agotado.
+class PooledJsonDocument {
+  public:
+    PooledJsonDocument() : doc(jsonPool.acquire()) {}
+    ~PooledJsonDocument() { if (doc) jsonPool.release(doc); }
+    PooledJsonDocument(const PooledJsonDocument&) = delete;
+    PooledJsonDocument& operator=(const PooledJsonDocument&) = delete;
+
+    explicit operator bool() const { return doc != nullptr; }
+    JsonDocument& operator*() const { return *doc; }
+    JsonDocument* operator->() const { return doc; }
+
+  private:
+    JsonDocument* doc;
+};
+
+// --- Gestión de energía ---
+// Aplica el modo de energía y mide el ciclo de trabajo de la aplicación: el
+// tiempo que las tareas propias (loop, comandos, TX) pasan despiertas sobre el
+// tiempo total. Junto con los consumos medidos en placa permite comparar
+// mAh/día entre versiones.
+// POWER_DUTY_CYCLE se comporta como POWER_LOW mientras está despierto
+enum PowerMode : uint8_t { POWER_PERFORMANCE, POWER_LOW, POWER_DUTY_CYCLE };
+const char* const POWER_MODE_NAMES[] = {"performance", "low_power", "duty_cycle"};
+
+class PowerManager {
+  public:
+    void begin(PowerMode initial) {
+#if SENSOR_IRQ_PIN >= 0
+        // Las sondas pueden despertar al chip durante el light sleep
+        gpio_wakeup_enable((gpio_num_t)SENSOR_IRQ_PIN, GPIO_INTR_LOW_LEVEL);
+        esp_sleep_enable_gpio_wakeup();
+#endif
+        apply(initial);
+    }
+
+    // Devuelve ESP_OK o el error de esp_pm_configure(); si falla sigue vigente
+    // el modo anterior. El modem sleep de BLE no depende de esp_pm y sigue
+    // siempre al modo pedido.
+    esp_err_t apply(PowerMode newMode) {
+        requested = newMode;
+#if CONFIG_PM_ENABLE
+#if ESP_IDF_VERSION_MAJOR >= 5
+        esp_pm_config_t config = {};
+#else
+        esp_pm_config_esp32_t config = {};
+#endif
+        bool low = newMode != POWER_PERFORMANCE;
+        config.max_freq_mhz = low ? PM_MAX_FREQ_MHZ : 240;
+        config.min_freq_mhz = low ? PM_MIN_FREQ_MHZ : 240;
+        config.light_sleep_enable = low;
+        lastError = esp_pm_configure(&config);
+#else
+        lastError = ESP_ERR_NOT_SUPPORTED;
+#endif
+
+#if CONFIG_IDF_TARGET_ESP32
+        // Modem sleep del controlador BLE entre eventos de conexión
+        if (btReady) {
+            if (newMode != POWER_PERFORMANCE) esp_bt_sleep_enable(); else esp_bt_sleep_disable();
+        }
+#endif
+        if (lastError == ESP_OK) mode = newMode;
+        resetStats();
+        return lastError;
+    }
+
+    // Se llama cuando la pila BLE ya está inicializada
+    void onBluetoothReady() {
+        btReady = true;
+        apply(requested);
+    }
+
+    // Cada tarea informa de un despertar y del tiempo que ha estado trabajando
+    void noteWake(uint32_t busyUs) {
+        portENTER_CRITICAL(&lock);
+        wakeups++;
+        this->busyUs += busyUs;
+        portEXIT_CRITICAL(&lock);
+    }
+
+    void resetStats() {
+        portENTER_CRITICAL(&lock);
+        wakeups = 0;
+        busyUs = 0;
+        sinceUs = esp_timer_get_time();
+        portEXIT_CRITICAL(&lock);
+    }
+
+    PowerMode currentMode() const { return mode; }
+    esp_err_t configureError() const { return lastError; }
+    uint32_t wakeupCount() const { return wakeups; }
+    uint64_t busyMicros() const { return busyUs; }
+    uint64_t windowMicros() const { return esp_timer_get_time() - sinceUs; }
+
+  private:
+    portMUX_TYPE lock = portMUX_INITIALIZER_UNLOCKED;
+    PowerMode mode = POWER_PERFORMANCE;      // El que está aplicado
+    PowerMode requested = POWER_PERFORMANCE; // El último pedido a apply()
+    esp_err_t lastError = ESP_OK;
+    bool btReady = false;
+    uint32_t wakeups = 0;
+    uint64_t busyUs = 0;
+    int64_t sinceUs = 0;
+};
+
+PowerManager powerManager;
+
+// --- Planificador cooperativo para loop() ---
+// Trabajos periódicos o de un solo disparo con plazo absoluto. loop() ejecuta
+// los vencidos (por prioridad, mayor primero) y duerme hasta el siguiente plazo
+// con ulTaskNotifyTake(), así que no se despierta si no hay nada que hacer. Otra
+// tarea que programe un trabajo despierta a loop() con una notificación.
+// Con tan pocos trabajos basta una tabla fija recorrida entera; una rueda de
+// temporizadores no aportaría nada.
+typedef void (*JobFunction)();
+
+class CooperativeScheduler {
+  public:
+    struct Job {
+        const char* name;
+        JobFunction fn;
+        uint32_t periodMs;   // 0 = un solo disparo
+        uint32_t dueMs;
+        uint8_t priority;
+        bool active;
+        uint32_t generation; // Cambia cada vez que add() reutiliza la ranura
+        // Contabilidad
+        uint32_t runs;
+        uint32_t overruns;   // Veces que se saltó un periodo entero por retraso
+        uint32_t maxLateMs;  // Mayor retraso sobre el plazo al empezar
+        uint64_t totalUs;
+        uint32_t maxUs;
+    };
+
+    void begin(TaskHandle_t owner) { task = owner; }
+
+    // Devuelven el identificador del trabajo, o -1 si la tabla está llena
+    int addPeriodic(const char* name, uint32_t periodMs, JobFunction fn,
+                    uint8_t priority = 1, uint32_t firstDelayMs = 0) {
+        return add(name, periodMs, firstDelayMs, fn, priority);
+    }
+    int addOneShot(const char* name, uint32_t delayMs, JobFunction fn, uint8_t priority = 1) {
+        return add(name, 0, delayMs, fn, priority);
+    }
+
+    void cancel(int id) {
+        if (id < 0 || id >= MAX_SCHEDULED_JOBS) return;
+        portENTER_CRITICAL(&lock);
+        jobs[id].active = false;
+        portEXIT_CRITICAL(&lock);
+    }
+
+    // Programa un disparo único de `fn`, o mueve su plazo si ya estaba pendiente
+    int rearmOneShot(const char* name, uint32_t delayMs, JobFunction fn, uint8_t priority = 1) {
+        portENTER_CRITICAL(&lock);
+        for (int i = 0; i < MAX_SCHEDULED_JOBS; i++) {
+            Job& job = jobs[i];
+            if (job.active && job.fn == fn && job.periodMs == 0) {
+                job.dueMs = millis() + delayMs;
+                portEXIT_CRITICAL(&lock);
+                wakeOwner();
+                return i;
+            }
+        }
+        portEXIT_CRITICAL(&lock);
+        return add(name, 0, delayMs, fn, priority);
+    }
+
+    // Ejecuta los trabajos vencidos y devuelve los ms hasta el siguiente plazo.
+    // El trabajo se elige, se desactiva o se reprograma y se copia bajo `lock`;
+    // `fn` corre fuera de él, así un rearmOneShot() del hilo de comandos durante
+    // la ejecución no se pierde y un add() que reutilice la ranura no pisa nada.
+    uint32_t runDue() {
+        for (;;) {
+            int next = -1;
+            uint32_t now = millis();
+            portENTER_CRITICAL(&lock);
+            for (int i = 0; i < MAX_SCHEDULED_JOBS; i++) {
+                const Job& job = jobs[i];
+                if (!job.active || (int32_t)(now - job.dueMs) < 0) continue;
+                if (next < 0 || job.priority > jobs[next].priority) next = i;
+            }
+            if (next < 0) {
+                portEXIT_CRITICAL(&lock);
+                break;
+            }
+            Job& job = jobs[next];
+            uint32_t late = now - job.dueMs;
+            if (late > job.maxLateMs) job.maxLateMs = late;
+            if (job.periodMs == 0) {
+                job.active = false;
+            } else {
+                // Plazos fijos sin deriva; si vamos más de un periodo tarde, resincronizar
+                job.dueMs += job.periodMs;
+                if ((int32_t)(now - job.dueMs) >= 0) {
+                    job.dueMs = now + job.periodMs;
+                    job.overruns++;
+                }
+            }
+            JobFunction fn = job.fn;
+            uint32_t generation = job.generation;
+            portEXIT_CRITICAL(&lock);
+
+            run(next, fn, generation);
+        }
+        return msUntilNextDeadline();
+    }
+
+    uint32_t msUntilNextDeadline() const {
+        uint32_t now = millis();
+        uint32_t wait = SCHEDULER_MAX_WAIT_MS;
+        for (const Job& job : jobs) {
+            if (!job.active) continue;
+            int32_t remaining = (int32_t)(job.dueMs - now);
+            if (remaining <= 0) return 0;
+            if ((uint32_t)remaining < wait) wait = remaining;
+        }
+        return wait;
+    }
+
+    const Job& job(int id) const { return jobs[id]; }
+
+  private:
+    int add(const char* name, uint32_t periodMs, uint32_t delayMs, JobFunction fn, uint8_t priority) {
+        int id = -1;
+        portENTER_CRITICAL(&lock);
+        for (int i = 0; i < MAX_SCHEDULED_JOBS; i++) {
+            if (!jobs[i].active) {
+                Job& job = jobs[i];
+                uint32_t generation = job.generation + 1;
+                job = Job();
+                job.generation = generation;
+                job.name = name;
+                job.fn = fn;
+                job.periodMs = periodMs;
+                job.dueMs = millis() + delayMs;
+                job.priority = priority;
+                job.active = true;
+                id = i;
+                break;
+            }
+        }
+        portEXIT_CRITICAL(&lock);
+        if (id >= 0) wakeOwner();
+        return id;
+    }
+
+    void wakeOwner() {
+        if (task != nullptr && xTaskGetCurrentTaskHandle() != task) {
+            xTaskNotifyGive(task); // Recalcular la espera de loop()
+        }
+    }
+
+    void run(int id, JobFunction fn, uint32_t generation) {
+        int64_t started = esp_timer_get_time();
+        fn();
+        uint32_t elapsed = (uint32_t)(esp_timer_get_time() - started);
+
+        // Si add() reasignó la ranura mientras corría, la contabilidad ya no es suya
+        portENTER_CRITICAL(&lock);
+        Job& job = jobs[id];
+        if (job.generation == generation) {
+            job.runs++;
+            job.totalUs += elapsed;
+            if (elapsed > job.maxUs) job.maxUs = elapsed;
+        }
+        portEXIT_CRITICAL(&lock);
+    }
+
+    Job jobs[MAX_SCHEDULED_JOBS] = {};
+    portMUX_TYPE lock = portMUX_INITIALIZER_UNLOCKED;
+    TaskHandle_t task = nullptr;
+};
+
+CooperativeScheduler scheduler;
+
+// --- Configuración persistente en NVS ---
+// Una copia tipada de todos los ajustes vive en RAM y es la que leen los
+// handlers. Cambiarla solo marca el blob como sucio y (re)programa una
+// escritura diferida en loop(), así una ráfaga de cambios desde un deslizador
+// de la app acaba en una sola escritura. Al arrancar se lee el blob entero con
+// una única consulta a NVS.
+
+struct PhCalPoint {
+    float ph;    // Valor del tampón
+    float mv25;  // Potencial medido, normalizado a 25 °C
+};
+
+// Límites de alerta de un canal; NAN o 0 desactivan cada comprobación
+struct AlertLimits {
+    float min;         // Por debajo, alerta "low"
+    float max;         // Por encima, alerta "high"
+    float ratePerMin;  // Cambio máximo por minuto entre lecturas seguidas
+    float zLimit;      // Desviación máxima en sigmas frente a la media móvil
+};
+
+struct Settings {
+    int32_t altitudeM = 0;
+    float salinityPsu = 0.0f;
+    uint8_t powerMode = POWER_SAVE_DEFAULT ? POWER_LOW : POWER_PERFORMANCE;
+    uint8_t phPointCount = 0;
+    PhCalPoint phPoints[CAL_MAX_PH_POINTS] = {};
+    char wifiSsid[33] = "";
+    char wifiPassword[65] = "";
+    // Campos nuevos siempre al final, y el primero de cada tanda en
+    // ConfigStore::storedPrefix(): un blob más corto de una versión anterior
+    // del firmware se carga y el resto queda por defecto
+    uint8_t wifiBssid[6] = {};  // Punto de acceso de la última conexión
+    uint8_t wifiChannel = 0;    // 0 = desconocido, escanear
+    float deadbandPh = DEADBAND_PH;
+    float deadbandDoConc = DEADBAND_DO_CONC;
+    float deadbandDoSat = DEADBAND_DO_SAT;
+    float deadbandTemp = DEADBAND_TEMP;
+    uint16_t keyframeS = TELEMETRY_KEYFRAME_S;
+    AlertLimits alertLimits[ALERT_CHANNELS] = {
+        {6.0f, 9.0f, 1.0f, ALERT_Z_LIMIT},   // pH, mismos umbrales críticos que statusLevel()
+        {4.0f, NAN, 2.0f, ALERT_Z_LIMIT},    // OD, mg/L
+        {60.0f, NAN, 20.0f, ALERT_Z_LIMIT},  // OD, %
+        {NAN, NAN, 1.0f, ALERT_Z_LIMIT},     // Temperatura, °C
+    };
+    uint32_t dutyPeriodS = DUTY_PERIOD_S;
+    uint8_t dutyBatch = DUTY_BATCH_SIZE;
+};
+
+static_assert(std::is_trivially_copyable<Settings>::value, "Settings se guarda byte a byte");
+
+void configFlushJob();
+
+class ConfigStore {
+  public:
+    // Carga el blob; si falta o es de otra versión se usan los valores por defecto
+    void begin() {
+        Preferences prefs;
+        if (prefs.begin(CONFIG_NVS_NAMESPACE, true)) {
+            Stored stored;
+            size_t length = prefs.getBytes("settings", &stored, sizeof(stored));
+            prefs.end();
+            size_t header = offsetof(Stored, settings);
+            size_t prefix = stored.version == CONFIG_VERSION ? storedPrefix(stored.size) : 0;
+            if (length > header && prefix > 0 && length == header + stored.size) {
+                memcpy(&settings, &stored.settings, prefix); // Lo que sigue queda por defecto
+                loaded = true;
+            }
+        }
+        persisted = settings;
+        LOG_I("%s", loaded ? "Configuración cargada de NVS." : "Configuración por defecto.");
+    }
+
+    // Copia de los ajustes actuales
+    Settings get() const {
+        portENTER_CRITICAL(&lock);
+        Settings copy = settings;
+        portEXIT_CRITICAL(&lock);
+        return copy;
+    }
+
+    // Modifica los ajustes en RAM con `change(Settings&)` (sin acceder a flash)
+    // y aplaza la escritura
+    template <typename Change>
+    void update(Change&& change) {
+        uint32_t now = millis();
+        uint32_t delayMs = CONFIG_COMMIT_DELAY_MS;
+        portENTER_CRITICAL(&lock);
+        change(settings);
+        updates++;
+        if (!dirty) {
+            dirty = true;
+            firstDirtyMs = now;
+        }
+        uint32_t waited = now - firstDirtyMs;
+        if (waited + delayMs > CONFIG_MAX_DEFER_MS) {
+            delayMs = waited < CONFIG_MAX_DEFER_MS ? CONFIG_MAX_DEFER_MS - waited : 0;
+        }
+        portEXIT_CRITICAL(&lock);
+        scheduler.rearmOneShot("config_flush", delayMs, configFlushJob);
+    }
+
+    // Adelanta la escritura pendiente (p. ej. al desconectarse la app)
+    void flushSoon() {
+        if (dirty) scheduler.rearmOneShot("config_flush", 0, configFlushJob);
+    }
+
+    // Escribe en NVS si algo cambió de verdad respecto a lo guardado. Solo
+    // desde loop().
+    void flush() {
+        Stored stored;
+        portENTER_CRITICAL(&lock);
+        if (!dirty) {
+            portEXIT_CRITICAL(&lock);
+            return;
+        }
+        dirty = false;
+        stored.settings = settings;
+        portEXIT_CRITICAL(&lock);
+
+        if (memcmp(&stored.settings, &persisted, sizeof(Settings)) == 0) {
+            skipped++; // Los cambios se desharon antes de escribir
+            return;
+        }
+        stored.version = CONFIG_VERSION;
+        stored.size = sizeof(Settings);
+
+        Preferences prefs;
+        bool ok = prefs.begin(CONFIG_NVS_NAMESPACE, false) &&
+                  prefs.putBytes("settings", &stored, sizeof(stored)) == sizeof(stored);
+        prefs.end();
+        if (ok) {
+            persisted = stored.settings;
+            writes++;
+        } else {
+            writeErrors++;
+            update([](Settings&) {}); // Reintentar más tarde
+        }
+    }
+
+    bool loadedFromFlash() const { return loaded; }
+    bool isDirty() const { return dirty; }
+    uint32_t updateCount() const { return updates; }
+    uint32_t writeCount() const { return writes; }
+    uint32_t skippedCount() const { return skipped; }
+    uint32_t writeErrorCount() const { return writeErrors; }
+
+  private:
+    struct Stored {
+        uint16_t version;
+        uint16_t size;
+        Settings settings;
+    };
+
+    // Bytes de campos reales en un blob de `size` bytes, o 0 si no es el tamaño
+    // de ninguna versión. El blob de una versión anterior incluye el relleno
+    // final de su Settings, que cae sobre el comienzo de los campos nuevos: se
+    // copia solo hasta el primero de ellos.
+    static size_t storedPrefix(size_t size) {
+        static const size_t boundaries[] = {
+            offsetof(Settings, wifiBssid),   // Antes de la reconexión rápida
+            offsetof(Settings, deadbandPh),  // Antes de la telemetría por deltas
+            offsetof(Settings, alertLimits), // Antes de las alertas
+            offsetof(Settings, dutyPeriodS), // Antes del ciclo de trabajo
+            sizeof(Settings),
+        };
+        constexpr size_t align = alignof(Settings);
+        for (size_t boundary : boundaries) {
+            if (size == (boundary + align - 1) / align * align) return boundary;
+        }
+        return 0;
+    }
+
+    Settings settings;
+    Settings persisted;  // Lo último escrito en flash
+    volatile bool dirty = false;
+    bool loaded = false;
+    uint32_t firstDirtyMs = 0;
+    uint32_t updates = 0;
+    uint32_t writes = 0;
+    uint32_t skipped = 0;
+    uint32_t writeErrors = 0;
+    mutable portMUX_TYPE lock = portMUX_INITIALIZER_UNLOCKED;
+};
+
+ConfigStore config;
+
+void configFlushJob() {
+    config.flush();
+}
+
+// --- Perfiles de publicidad y de conexión ---
+// Intervalos de publicidad en unidades de 0,625 ms; de conexión en 1,25 ms y
+// supervisión en 10 ms. Los valores respetan las guías de Apple para iOS.
+struct AdvProfile {
+    const char* name;
+    uint16_t minInterval, maxInterval;
+};
+struct ConnProfile {
+    const char* name;
+    uint16_t minInterval, maxInterval, latency, timeout;
+};
+
+const AdvProfile ADV_FAST = { "fast", 0x20, 0x30 };    // 20-30 ms
+const AdvProfile ADV_SLOW = { "slow", 0x640, 0x780 };  // 1-1,2 s
+const ConnProfile CONN_BULK = { "bulk", 12, 24, 0, 400 }; // 15-30 ms, sin latencia
+const ConnProfile CONN_IDLE = { "idle", 80, 160, 4, 600 }; // 100-200 ms, 4 eventos saltables
+
+// Política "auto" por defecto; la app puede fijar un perfil con "set_link_profile"
+enum LinkPolicy : uint8_t { LINK_AUTO, LINK_FIXED };
+
+void linkEvaluateJob();
+
+class LinkManager {
+  public:
+    void begin(BLEServer* server) { this->server = server; }
+
+    // Publicidad rápida y, pasada la ventana, lenta (salvo perfil fijo). También
+    // con centrales conectados, mientras quede hueco para otro.
+    void startAdvertising() {
+        advertisingSince = millis();
+        applyAdv(advPolicy == LINK_AUTO ? &ADV_FAST : advFixed);
+        if (advPolicy == LINK_AUTO) scheduler.rearmOneShot("link", fastWindowMs, linkEvaluateJob);
+    }
+
+    void onConnect() {
+        connectedAt = millis();
+        lastReconnectMs = connectedAt - advertisingSince;
+        currentAdv = nullptr; // Al conectar la pila deja de anunciar
+        currentConn = nullptr;
+        // Intervalo corto para el descubrimiento de servicios y la configuración inicial
+        noteActivity();
+    }
+
+    // Hay tráfico: pasar a intervalo corto y aplazar la vuelta a reposo
+    void noteActivity() {
+        lastActivity = millis();
+        if (connPolicy != LINK_AUTO) return;
+        if (currentConn != &CONN_BULK) requestConn(&CONN_BULK);
+        // Sin retrasar el paso a publicidad lenta si se está anunciando a la vez
+        scheduler.rearmOneShot("link", std::min<uint32_t>(CONN_IDLE_AFTER_MS, fastAdvRemaining(lastActivity)),
+                               linkEvaluateJob);
+    }
+
+    // Trabajo del planificador: aplica las transiciones cuyo plazo ha vencido y
+    // se reprograma para la siguiente
+    void evaluate() {
+        uint32_t now = millis();
+        uint32_t next = UINT32_MAX;
+        if (deviceConnected && connPolicy == LINK_AUTO && currentConn != &CONN_IDLE) {
+            uint32_t idle = now - lastActivity;
+            if (idle >= CONN_IDLE_AFTER_MS) {
+                requestConn(&CONN_IDLE);
+            } else {
+                next = CONN_IDLE_AFTER_MS - idle;
+            }
+        }
+        uint32_t advRemaining = fastAdvRemaining(now);
+        if (advRemaining == 0) {
+            applyAdv(&ADV_SLOW);
+        } else {
+            next = std::min(next, advRemaining);
+        }
+        if (next != UINT32_MAX) scheduler.rearmOneShot("link", next, linkEvaluateJob);
+    }
+
+    void setConnPolicy(const ConnProfile* fixed) {
+        connPolicy = fixed ? LINK_FIXED : LINK_AUTO;
+        if (fixed) requestConn(fixed); else noteActivity();
+    }
+    void setAdvPolicy(const AdvProfile* fixed) {
+        advPolicy = fixed ? LINK_FIXED : LINK_AUTO;
+        advFixed = fixed;
+    }
+    void setFastWindow(uint32_t ms) { fastWindowMs = ms; }
+
+    const char* advName() const { return currentAdv ? currentAdv->name : "none"; }
+    const char* connName() const { return currentConn ? currentConn->name : "default"; }
+    bool connAuto() const { return connPolicy == LINK_AUTO; }
+    bool advAuto() const { return advPolicy == LINK_AUTO; }
+    uint32_t fastWindow() const { return fastWindowMs; }
+    uint32_t reconnectMs() const { return lastReconnectMs; }
+    uint32_t updateRequests() const { return connUpdates; }
+
+  private:
+    // Tiempo hasta pasar a publicidad lenta (UINT32_MAX si no aplica)
+    uint32_t fastAdvRemaining(uint32_t now) const {
+        if (advPolicy != LINK_AUTO || currentAdv != &ADV_FAST) return UINT32_MAX;
+        uint32_t advertised = now - advertisingSince;
+        return advertised >= fastWindowMs ? 0 : fastWindowMs - advertised;
+    }
+
+    void applyAdv(const AdvProfile* profile) {
+        BLEAdvertising* advertising = BLEDevice::getAdvertising();
+        advertising->stop();
+        advertising->setMinInterval(profile->minInterval);
+        advertising->setMaxInterval(profile->maxInterval);
+        advertising->start();
+        currentAdv = profile;
+        LOG_I("Publicidad: %s", profile->name);
+    }
+
+    void requestConn(const ConnProfile* profile) {
+        if (!deviceConnected || server == nullptr) return;
+        for (Session& session : sessions) {
+            if (!session.active) continue;
+            server->updateConnParams(session.address, profile->minInterval, profile->maxInterval,
+                                     profile->latency, profile->timeout);
+        }
+        currentConn = profile;
+        connUpdates++;
+    }
+
+    BLEServer* server = nullptr;
+    const AdvProfile* volatile currentAdv = nullptr;
+    const ConnProfile* volatile currentConn = nullptr;
+    const AdvProfile* advFixed = nullptr;
+    LinkPolicy advPolicy = LINK_AUTO;
+    LinkPolicy connPolicy = LINK_AUTO;
+    uint32_t fastWindowMs = FAST_ADV_WINDOW_MS;
+    volatile uint32_t lastActivity = 0;
+    uint32_t advertisingSince = 0;
+    uint32_t connectedAt = 0;
+    uint32_t lastReconnectMs = 0;
+    uint32_t connUpdates = 0;
+};
+
+LinkManager linkManager;
+
+const ConnProfile* findConnProfile(const char* name) {
+    if (!strcmp(name, CONN_BULK.name)) return &CONN_BULK;
+    if (!strcmp(name, CONN_IDLE.name)) return &CONN_IDLE;
+    return nullptr;
+}
+
+const AdvProfile* findAdvProfile(const char* name) {
+    if (!strcmp(name, ADV_FAST.name)) return &ADV_FAST;
+    if (!strcmp(name, ADV_SLOW.name)) return &ADV_SLOW;
+    return nullptr;
+}
+
+// Actualiza el intervalo real cuando el central acepta (o impone) parámetros nuevos
+void gapEventHandler(esp_gap_ble_cb_event_t event, esp_ble_gap_cb_param_t* param) {
+    if (event == ESP_GAP_BLE_UPDATE_CONN_PARAMS_EVT && param->update_conn_params.status == ESP_BT_STATUS_SUCCESS) {
+        connIntervalUnits = param->update_conn_params.conn_int;
+    }
+}
+
+void linkEvaluateJob() { linkManager.evaluate(); }
+
+// --- Registro de comandos ---
+// Cada tipo de comando ("type" en el JSON) se asocia a un handler mediante su
+// hash FNV-1a, calculado en compilación para los nombres registrados y una sola
+// vez por comando recibido. La tabla usa direccionamiento abierto; tras
+// coincidir el hash se compara el nombre para no aceptar tipos desconocidos
+// que colisionen.
+typedef void (*CommandHandler)(JsonDocument& request, JsonDocument& response);
+
+constexpr uint32_t commandHash(const char* str, uint32_t hash = 2166136261u) {
+    return *str == '\0' ? hash : commandHash(str + 1, (hash ^ (uint8_t)*str) * 16777619u);
+}
+
+class CommandRegistry {
+    static_assert((MAX_COMMAND_HANDLERS & (MAX_COMMAND_HANDLERS - 1)) == 0,
+                  "MAX_COMMAND_HANDLERS debe ser potencia de 2");
+
+  public:
+    struct Entry {
+        uint32_t hash;
+        const char* name;
+        CommandHandler handler;
+    };
+
+    // Se llama desde constructores estáticos (ver COMMAND_HANDLER), antes de setup().
+    // Todavía no hay registro: los fallos se cuentan y setup() los informa.
+    bool add(const char* name, uint32_t hash, CommandHandler handler) {
+        for (uint32_t i = 0; i < MAX_COMMAND_HANDLERS; i++) {
+            Entry& entry = entries[(hash + i) & (MAX_COMMAND_HANDLERS - 1)];
+            if (entry.name == nullptr) {
+                entry = { hash, name, handler };
+                registered++;
+                return true;
+            }
+            if (entry.hash == hash && strcmp(entry.name, name) == 0) {
+                break; // Tipo registrado dos veces
+            }
+        }
+        if (failures++ == 0) firstFailure = name; // Dos veces o tabla llena
+        return false;
+    }
+
+    CommandHandler find(const char* name) const {
+        uint32_t hash = commandHash(name);
+        for (uint32_t i = 0; i < MAX_COMMAND_HANDLERS; i++) {
+            const Entry& entry = entries[(hash + i) & (MAX_COMMAND_HANDLERS - 1)];
+            if (entry.name == nullptr) return nullptr;
+            if (entry.hash == hash && strcmp(entry.name, name) == 0) return entry.handler;
+        }
+        return nullptr;
+    }
+
+    uint32_t size() const { return registered; }
+    uint32_t registrationErrors() const { return failures; }
+    const char* firstRegistrationError() const { return firstFailure; }
+
+  private:
+    // Sin inicializadores: todo queda a cero antes de cualquier constructor
+    Entry entries[MAX_COMMAND_HANDLERS];
+    uint32_t registered;
+    uint32_t failures;
+    const char* firstFailure;
+};
+
+CommandRegistry commandRegistry;
+
+struct CommandRegistrar {
+    CommandRegistrar(const char* name, uint32_t hash, CommandHandler handler) {
+        commandRegistry.add(name, hash, handler);
+    }
+};
+
+// Declara y registra un handler. El hash del nombre se fuerza a constante de
+// compilación; el cuerpo va a continuación de la macro:
+//
+//   COMMAND_HANDLER("mi_comando", handleMiComando) {
+//       response["type"] = "mi_comando_response";
+//   }
+#define COMMAND_HANDLER(typeName, fn)                                                  \
+    static void fn(JsonDocument& request, JsonDocument& response);                     \
+    static CommandRegistrar fn##Registrar(                                             \
+        typeName, std::integral_constant<uint32_t, commandHash(typeName)>::value, fn); \
+    static void fn(JsonDocument& request, JsonDocument& response)
+
+// Clase para manejar los eventos de conexión/desconexión del servidor BLE
+class MyServerCallbacks: public BLEServerCallbacks {
+    void onConnect(BLEServer* pServer, esp_ble_gatts_cb_param_t* param) {
+      uint16_t connId = param->connect.conn_id;
+      // El MTU real llega después en onMtuChanged; hasta entonces, el por defecto
+      Session* session = sessions.open(connId, param->connect.remote_bda, pServer->getPeerMTU(connId));
+      if (session == nullptr) {
+          pServer->disconnect(connId); // Sin sesión libre (no debería anunciarse)
+          return;
+      }
+      deviceConnected = true;
+      bootTimeline.mark(BOOT_FIRST_CONNECTION);
+      connIntervalUnits = param->connect.conn_params.interval;
+      linkManager.onConnect();
+      LOG_I("Device Connected (conn %u, %u/%u)", connId, sessions.count(), MAX_CENTRALS);
+      if (!sessions.full()) linkManager.startAdvertising();
+    }
+
+    void onMtuChanged(BLEServer* pServer, esp_ble_gatts_cb_param_t* param) {
+      Session* session = sessions.find(param->mtu.conn_id);
+      if (session == nullptr) return;
+      session->tx.setMtu(param->mtu.mtu);
+      LOG_I("MTU negociado: %u (conn %u)", param->mtu.mtu, param->mtu.conn_id);
+    }
+
+    void onDisconnect(BLEServer* pServer, esp_ble_gatts_cb_param_t* param) {
+      Session* session = sessions.find(param->disconnect.conn_id);
+      if (session != nullptr) sessions.close(*session);
+      deviceConnected = sessions.count() > 0;
+      config.flushSoon(); // No esperar al temporizador de escritura
+      LOG_I("Device Disconnected (conn %u)", param->disconnect.conn_id);
+      // Reiniciar la publicidad (en modo rápido) para que se pueda volver a conectar
+      linkManager.startAdvertising();
+    }
+};
+
+// Sigue por conexión las escrituras en el CCCD de TX: el BLE2902 de Arduino
+// guarda un único estado para todos los centrales
+void gattsEventHandler(esp_gatts_cb_event_t event, esp_gatt_if_t gattsIf, esp_ble_gatts_cb_param_t* param) {
+    if (event != ESP_GATTS_WRITE_EVT || param->write.handle != txCccdHandle || param->write.len < 2) return;
+    Session* session = sessions.find(param->write.conn_id);
+    if (session == nullptr) return;
+    bool subscribed = (param->write.value[0] & 0x01) != 0;
+    if (subscribed && !session->subscribed) telemetryKeyframePending = true;
+    session->subscribed = subscribed;
+}
+
+// Tarea que vacía los anillos TX de todas las sesiones. Tras despertar espera
+// TX_COALESCE_MS si ninguna tiene pendiente una notificación completa, para
+// agrupar mensajes cortos.
+void txTask(void* param) {
+    for (;;) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        bool fullChunk = false;
+        for (Session& session : sessions) {
+            if (session.active && session.tx.pending() >= session.tx.payloadSize()) fullChunk = true;
+        }
+        if (!fullChunk) vTaskDelay(pdMS_TO_TICKS(TX_COALESCE_MS));
+
+        int64_t started = esp_timer_get_time();
+        size_t sent = 0;
+        for (Session& session : sessions) {
+            if (!session.active) continue;
+            SessionNotifier notifier{session};
+            sent += session.tx.drain(&notifier);
+        }
+        powerManager.noteWake(esp_timer_get_time() - started);
+        if (sent >= BULK_TX_THRESHOLD) linkManager.noteActivity();
+    }
+}
+
+// Correlación de una petición con su(s) respuesta(s): el "id" numérico que
+// mandó la app (opcional) y cuándo empezó a ejecutarse. Los comandos de una
+// conexión se ejecutan en orden, pero los que terminan más tarde
+// (wifi_config, history_sync) responden cuando acaban, detrás de los que
+// llegaron después; con el id la app no tiene que esperar a cada respuesta.
+struct CommandTag {
+    int64_t id = -1;        // -1 = la app no mandó id
+    int64_t startedUs = 0;
+
+    void apply(JsonDocument& doc) const {
+        if (id >= 0) doc["id"] = (uint32_t)id;
+        doc["exec_us"] = (uint32_t)(esp_timer_get_time() - startedUs);
+    }
+};
+
+CommandTag currentCommand; // Solo válida dentro de commandTask, como currentSession
+
+// Función para enviar una respuesta JSON a la app. El documento se serializa en
+// el anillo TX de la sesión con su '\n' final; txTask lo notifica en trozos
+// según su MTU.
+bool sendJsonResponse(Session& session, const JsonDocument& doc) {
+    bool queued;
+    {
+        DiagTimer timer(DIAG_SERIALIZE);
+        queued = session.tx.sendJson(doc);
+    }
+    if (!queued) {
+        if (session.active) LOG_W("⚠️ TX: anillo lleno, respuesta descartada.");
+        return false;
+    }
+#if LOG_LEVEL >= LOG_LEVEL_DEBUG
+    char echo[LOG_TEXT_BYTES];
+    serializeJson(doc, echo, sizeof(echo));
+    LOG_D("Respuesta enviada: %s", echo);
+#endif
+    return true;
+}
+
+// Envía un error genérico de comando (formato igual al de "Invalid JSON format.").
+// No usa el pool de documentos, así funciona también cuando está agotado.
+// `message` debe ser un texto fijo sin comillas ni barras invertidas.
+// Con `tag` lleva también "id" y "exec_us", como cualquier otra respuesta.
+void sendCommandError(Session& session, const char* message, const CommandTag* tag = nullptr) {
+    if (!session.active) return;
+    char correlation[40] = "";
+    if (tag != nullptr) {
+        uint32_t execUs = (uint32_t)(esp_timer_get_time() - tag->startedUs);
+        if (tag->id >= 0) {
+            snprintf(correlation, sizeof(correlation), ",\"id\":%u,\"exec_us\":%u", (unsigned)tag->id, (unsigned)execUs);
+        } else {
+            snprintf(correlation, sizeof(correlation), ",\"exec_us\":%u", (unsigned)execUs);
+        }
+    }
+    char frame[200];
+    int len = snprintf(frame, sizeof(frame),
+                       "{\"type\":\"command_response\",\"status\":\"error\",\"message\":\"%s\"%s}\n",
+                       message, correlation);
+    if (len <= 0 || len >= (int)sizeof(frame)) return;
+    session.tx.sendRaw((const uint8_t*)frame, len);
+    LOG_D("Respuesta enviada: %s", message);
+}
+
+
+// --- Datos de sensores y telemetría ---
+// Última lectura disponible, con el mismo contenido que `SensorData` en
+// src/lib/ble-types.ts. Se envía como JSON (por defecto) o, si la app lo pide
+// con "set_telemetry_mode", como trama binaria compacta.
+struct SensorReading {
+    float ph;
+    float doConc;  // mg/L
+    float doSat;   // %
+    float temp;    // °C
+    bool phValid;
+    bool doValid;  // do_conc, do_sat y temp vienen de la misma sonda
+    uint32_t readingsPh, readingsDo;
+    uint32_t errorsPh, errorsDo;
+    uint32_t uptimeMs;
+    float phMv;    // Potencial del electrodo llevado a 25 °C (para calibrar)
+};
+
+SensorReading latestReading = {}; // Escrita por procTask; leer con readingSnapshot()
+portMUX_TYPE readingLock = portMUX_INITIALIZER_UNLOCKED;
+int altitudeMeters = 0;
+float altitudeCorrection = 1.0f; // Factor de presión barométrica para la saturación de OD
+
+// Nivel de estado, mismos umbrales que get_status_indicator() en src/main.py
+enum StatusLevel : uint8_t { STATUS_SENSOR_ERROR, STATUS_CRITICAL, STATUS_WARNING, STATUS_NORMAL };
+
+const char* const STATUS_TEXT[] = {
+    "⚪ Sensor reading error",
+    "🔴 Critical levels detected",
+    "🟡 Warning levels detected",
+    "🟢 All systems normal",
+};
+
+StatusLevel statusLevel(const SensorReading& r) {
+    if (!r.phValid || !r.doValid) return STATUS_SENSOR_ERROR;
+    if (r.ph < 6.0f || r.ph > 9.0f || r.doConc < 4.0f || r.doSat < 60.0f) return STATUS_CRITICAL;
+    if (r.ph < 6.5f || r.ph > 8.5f || r.doConc < 6.0f || r.doSat < 80.0f) return STATUS_WARNING;
+    return STATUS_NORMAL;
+}
+
+// Trama binaria v1: 32 bytes, little-endian, frente a ~250 bytes en JSON.
+// Los valores van escalados a enteros; INT16_MIN indica "sin lectura".
+// El CRC-16/CCITT-FALSE cubre todos los bytes anteriores a él.
+// Cualquier cambio de formato debe subir TELEMETRY_FRAME_VERSION y replicarse
+// en src/lib/telemetry-frame.ts.
+struct __attribute__((packed)) TelemetryFrame {
+    uint8_t magic;          // TELEMETRY_FRAME_MAGIC
+    uint8_t version;        // TELEMETRY_FRAME_VERSION
+    uint8_t length;         // sizeof(TelemetryFrame)
+    uint8_t flags;          // bits 0-1: StatusLevel, bits 2-3: WiFi (0 desconectado, 1 conectando, 2 conectado)
+    uint32_t uptimeS;
+    int16_t phX100;
+    int16_t doConcX100;
+    int16_t doSatX10;
+    int16_t tempX100;
+    uint16_t readingsPh, readingsDo;
+    uint16_t errorsPh, errorsDo;
+    int16_t altitudeM;
+    uint16_t correctionX10000;
+    uint16_t sequence;
+    uint16_t crc;
+};
+static_assert(sizeof(TelemetryFrame) == 32, "El formato de la trama v1 es fijo");
+
+uint16_t crc16Ccitt(const uint8_t* data, size_t len) {
+    uint16_t crc = 0xFFFF;
+    while (len--) {
+        crc ^= (uint16_t)*data++ << 8;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+        }
+    }
+    return crc;
+}
+
+static int16_t scaleToInt16(float value, float scale, bool valid) {
+    if (!valid) return INT16_MIN;
+    float scaled = roundf(value * scale);
+    if (scaled > INT16_MAX) return INT16_MAX;
+    if (scaled < INT16_MIN + 1) return INT16_MIN + 1;
+    return (int16_t)scaled;
+}
+
+// bits 0-1: StatusLevel, bits 2-3: WiFi
+uint8_t telemetryFlags(const SensorReading& r) {
+    return statusLevel(r) | (wifiLinkState.load() << 2);
+}
+
+void encodeTelemetryFrame(const SensorReading& r, uint16_t sequence, TelemetryFrame& frame) {
+    frame.magic = TELEMETRY_FRAME_MAGIC;
+    frame.version = TELEMETRY_FRAME_VERSION;
+    frame.length = sizeof(TelemetryFrame);
+    frame.flags = telemetryFlags(r);
+    frame.uptimeS = r.uptimeMs / 1000;
+    frame.phX100 = scaleToInt16(r.ph, 100.0f, r.phValid);
+    frame.doConcX100 = scaleToInt16(r.doConc, 100.0f, r.doValid);
+    frame.doSatX10 = scaleToInt16(r.doSat, 10.0f, r.doValid);
+    frame.tempX100 = scaleToInt16(r.temp, 100.0f, r.doValid);
+    frame.readingsPh = (uint16_t)r.readingsPh;
+    frame.readingsDo = (uint16_t)r.readingsDo;
+    frame.errorsPh = (uint16_t)r.errorsPh;
+    frame.errorsDo = (uint16_t)r.errorsDo;
+    frame.altitudeM = (int16_t)altitudeMeters;
+    frame.correctionX10000 = (uint16_t)roundf(altitudeCorrection * 10000.0f);
+    frame.sequence = sequence;
+    frame.crc = crc16Ccitt(reinterpret_cast<const uint8_t*>(&frame), offsetof(TelemetryFrame, crc));
+}
+
+// Mismo formato que send_sensor_data() en src/main.py
+void encodeTelemetryJson(const SensorReading& r, JsonDocument& doc) {
+    if (r.phValid) doc["ph"] = r.ph; else doc["ph"] = nullptr;
+    if (r.doValid) {
+        doc["do_conc"] = r.doConc;
+        doc["do_sat"] = r.doSat;
+        doc["temp"] = r.temp;
+    } else {
+        doc["do_conc"] = nullptr;
+        doc["do_sat"] = nullptr;
+        doc["temp"] = nullptr;
+    }
+
+    char timestamp[12];
+    uint32_t uptimeS = r.uptimeMs / 1000;
+    snprintf(timestamp, sizeof(timestamp), "%02u:%02u:%02u",
+             (unsigned)(uptimeS / 3600), (unsigned)(uptimeS / 60 % 60), (unsigned)(uptimeS % 60));
+    doc["timestamp"] = timestamp;
+    doc["status"] = STATUS_TEXT[statusLevel(r)];
+    doc["readings_count"]["ph"] = r.readingsPh;
+    doc["readings_count"]["do"] = r.readingsDo;
+    doc["errors_count"]["ph"] = r.errorsPh;
+    doc["errors_count"]["do"] = r.errorsDo;
+    doc["wifi_status"] = WIFI_STATUS_TEXT[wifiLinkState.load()];
+    doc["altitude_info"]["meters"] = altitudeMeters;
+    doc["altitude_info"]["correction_factor"] = altitudeCorrection;
+}
+
+// Campos de una trama parcial, en el orden en que van sus valores
+enum TelemetryField : uint8_t {
+    FIELD_PH      = 0x01,
+    FIELD_DO_CONC = 0x02,
+    FIELD_DO_SAT  = 0x04,
+    FIELD_TEMP    = 0x08,
+    FIELD_STATUS  = 0x10, // Estado o WiFi; van siempre en `flags`
+    FIELD_VALUES  = 0x0F,
+};
+
+// Trama parcial v1, little-endian: magic, versión, longitud total, flags (como
+// en TelemetryFrame), máscara de campos, secuencia (u16, compartida con las
+// tramas completas), uptime en s (u32), un int16 escalado por campo presente
+// (INT16_MIN = sin lectura) y el CRC-16 de todo lo anterior. Entre 13 y 21
+// bytes. Replicada en src/lib/telemetry-frame.ts.
+static constexpr size_t TELEMETRY_DELTA_HEADER = 11;
+static constexpr size_t TELEMETRY_DELTA_MAX_SIZE = TELEMETRY_DELTA_HEADER + 4 * sizeof(int16_t) + sizeof(uint16_t);
+
+size_t encodeTelemetryDelta(const SensorReading& r, uint8_t fields, uint16_t sequence, uint8_t* out) {
+    uint32_t uptimeS = r.uptimeMs / 1000;
+    out[0] = TELEMETRY_DELTA_MAGIC;
+    out[1] = TELEMETRY_DELTA_VERSION;
+    out[3] = telemetryFlags(r);
+    out[4] = fields & FIELD_VALUES;
+    memcpy(out + 5, &sequence, sizeof(sequence));
+    memcpy(out + 7, &uptimeS, sizeof(uptimeS));
+    size_t len = TELEMETRY_DELTA_HEADER;
+    auto put = [&](uint8_t field, int16_t value) {
+        if (!(fields & field)) return;
+        memcpy(out + len, &value, sizeof(value));
+        len += sizeof(value);
+    };
+    put(FIELD_PH, scaleToInt16(r.ph, 100.0f, r.phValid));
+    put(FIELD_DO_CONC, scaleToInt16(r.doConc, 100.0f, r.doValid));
+    put(FIELD_DO_SAT, scaleToInt16(r.doSat, 10.0f, r.doValid));
+    put(FIELD_TEMP, scaleToInt16(r.temp, 100.0f, r.doValid));
+    out[2] = len + sizeof(uint16_t);
+    uint16_t crc = crc16Ccitt(out, len);
+    memcpy(out + len, &crc, sizeof(crc));
+    return len + sizeof(crc);
+}
+
+// JSON parcial: la app ya mezcla cada mensaje sobre la última lectura
+void encodeTelemetryJsonDelta(const SensorReading& r, uint8_t fields, JsonDocument& doc) {
+    if (fields & FIELD_PH) {
+        if (r.phValid) doc["ph"] = r.ph; else doc["ph"] = nullptr;
+    }
+    if (fields & FIELD_DO_CONC) {
+        if (r.doValid) doc["do_conc"] = r.doConc; else doc["do_conc"] = nullptr;
+    }
+    if (fields & FIELD_DO_SAT) {
+        if (r.doValid) doc["do_sat"] = r.doSat; else doc["do_sat"] = nullptr;
+    }
+    if (fields & FIELD_TEMP) {
+        if (r.doValid) doc["temp"] = r.temp; else doc["temp"] = nullptr;
+    }
+    if (fields & FIELD_STATUS) {
+        doc["status"] = STATUS_TEXT[statusLevel(r)];
+        doc["wifi_status"] = WIFI_STATUS_TEXT[wifiLinkState.load()];
+    }
+    char timestamp[12];
+    uint32_t uptimeS = r.uptimeMs / 1000;
+    snprintf(timestamp, sizeof(timestamp), "%02u:%02u:%02u",
+             (unsigned)(uptimeS / 3600), (unsigned)(uptimeS / 60 % 60), (unsigned)(uptimeS % 60));
+    doc["timestamp"] = timestamp;
+}
+
+// Último estado enviado y bandas muertas. Solo lo usa procTask, salvo
+// configure() desde commandTask (floats de 32 bits: sin lecturas a medias).
+class DeltaTelemetry {
+  public:
+    void configure(const Settings& settings) {
+        deadband[0] = settings.deadbandPh;
+        deadband[1] = settings.deadbandDoConc;
+        deadband[2] = settings.deadbandDoSat;
+        deadband[3] = settings.deadbandTemp;
+        keyframeMs = settings.keyframeS * 1000u;
+        telemetryKeyframePending = true;
+    }
+
+    bool keyframeDue(uint32_t now) const {
+        return !haveSent || keyframeMs == 0 || telemetryKeyframePending.load() || now - lastKeyframeMs >= keyframeMs;
+    }
+
+    // Campos que se han alejado del último valor enviado más que su banda
+    uint8_t changedFields(const SensorReading& r) const {
+        float values[4];
+        bool valid[4];
+        snapshot(r, values, valid);
+        uint8_t fields = 0;
+        for (int i = 0; i < 4; i++) {
+            if (valid[i] != lastValid[i] || (valid[i] && fabsf(values[i] - lastValues[i]) > deadband[i])) {
+                fields |= 1 << i;
+            }
+        }
+        if (telemetryFlags(r) != lastFlags) fields |= FIELD_STATUS;
+        return fields;
+    }
+
+    // Solo se actualizan los campos enviados: la deriva lenta de los demás se
+    // sigue acumulando hasta cruzar la banda
+    void markSent(const SensorReading& r, uint8_t fields, bool keyframe, uint32_t now) {
+        float values[4];
+        bool valid[4];
+        snapshot(r, values, valid);
+        for (int i = 0; i < 4; i++) {
+            if (!keyframe && !(fields & (1 << i))) continue;
+            lastValues[i] = values[i];
+            lastValid[i] = valid[i];
+        }
+        lastFlags = telemetryFlags(r);
+        haveSent = true;
+        if (keyframe) {
+            lastKeyframeMs = now;
+            telemetryKeyframePending = false;
+            keyframes++;
+        } else {
+            deltas++;
+        }
+    }
+
+    void noteSuppressed() { suppressed++; }
+
+    float deadbandFor(int field) const { return deadband[field]; }
+    uint32_t keyframePeriodMs() const { return keyframeMs; }
+    uint32_t keyframeCount() const { return keyframes; }
+    uint32_t deltaCount() const { return deltas; }
+    uint32_t suppressedCount() const { return suppressed; }
+
+  private:
+    static void snapshot(const SensorReading& r, float* values, bool* valid) {
+        values[0] = r.ph;     valid[0] = r.phValid;
+        values[1] = r.doConc; valid[1] = r.doValid;
+        values[2] = r.doSat;  valid[2] = r.doValid;
+        values[3] = r.temp;   valid[3] = r.doValid;
+    }
+
+    float deadband[4] = {DEADBAND_PH, DEADBAND_DO_CONC, DEADBAND_DO_SAT, DEADBAND_TEMP};
+    uint32_t keyframeMs = TELEMETRY_KEYFRAME_S * 1000u;
+    float lastValues[4] = {};
+    bool lastValid[4] = {};
+    uint8_t lastFlags = 0;
+    bool haveSent = false;
+    uint32_t lastKeyframeMs = 0;
+    uint32_t keyframes = 0, deltas = 0, suppressed = 0;
+};
+
+DeltaTelemetry deltaTelemetry;
+
+// Envía la lectura a cada sesión suscrita en el formato que eligió: completa
+// si toca trama clave y, si no, solo lo que ha cambiado. Cada formato se
+// codifica como mucho una vez, tenga una sesión o varias.
+void publishTelemetry(const SensorReading& r) {
+    static uint16_t sequence = 0;
+    auto wantsBinary = [](const Session& session) { return session.telemetryMode.load() == TELEMETRY_BINARY; };
+    auto wantsJson = [](const Session& session) { return session.telemetryMode.load() == TELEMETRY_JSON; };
+
+    bool anyBinary = false, anyJson = false;
+    uint8_t targets = 0;
+    for (Session& session : sessions) {
+        if (!session.active || !session.subscribed) continue;
+        if (wantsBinary(session)) anyBinary = true;
+        if (wantsJson(session)) anyJson = true;
+        if (wantsBinary(session) || wantsJson(session)) targets++;
+    }
+    if (!anyBinary && !anyJson) return;
+
+    uint32_t now = millis();
+    bool keyframe = deltaTelemetry.keyframeDue(now);
+    uint8_t fields = keyframe ? FIELD_VALUES | FIELD_STATUS : deltaTelemetry.changedFields(r);
+    if (fields == 0) {
+        deltaTelemetry.noteSuppressed();
+        return;
+    }
+
+    uint16_t frameSequence = sequence++;
+    uint8_t queued = 0;
+    if (anyBinary) {
+        if (keyframe) {
+            TelemetryFrame frame;
+            encodeTelemetryFrame(r, frameSequence, frame);
+            queued += sessions.broadcastRaw(reinterpret_cast<const uint8_t*>(&frame), sizeof(frame), wantsBinary);
+        } else {
+            uint8_t frame[TELEMETRY_DELTA_MAX_SIZE];
+            size_t len = encodeTelemetryDelta(r, fields, frameSequence, frame);
+            queued += sessions.broadcastRaw(frame, len, wantsBinary);
+        }
+    }
+    if (anyJson) {
+        PooledJsonDocument doc;
+        if (doc) { // Pool ocupado: las sesiones JSON pierden esta muestra, no la siguiente
+            if (keyframe) encodeTelemetryJson(r, *doc); else encodeTelemetryJsonDelta(r, fields, *doc);
+            queued += sessions.broadcastJson(*doc, wantsJson);
+        }
+    }
+
+    // La referencia de los deltas solo avanza si la trama salió hacia alguien;
+    // quien se la perdió (anillo TX lleno) la recupera con una completa
+    if (queued > 0) deltaTelemetry.markSent(r, fields, keyframe, now);
+    if (queued < targets) telemetryKeyframePending = true;
+    lastTelemetryMs = now;
+}
+
+
+// --- Detección de anomalías ---
+// Memoria O(1) por canal: media y varianza (Welford durante el calentamiento,
+// exponenciales después), último valor para el ritmo y el estado de cada
+// alerta. Los umbrales y el estado de sensor son alertas con estado: se
+// anuncian al entrar ("raised") y al volver a rango durante
+// ALERT_CLEAR_READINGS lecturas ("cleared"). Ritmo y desviación son avisos
+// puntuales ("event") limitados a uno por ALERT_COOLDOWN_MS y canal.
+
+enum AlertKind : uint8_t { ALERT_LOW, ALERT_HIGH, ALERT_SENSOR, ALERT_RATE, ALERT_DEVIATION };
+static constexpr uint8_t ALERT_LEVEL_KINDS = 3; // Los primeros, con estado
+const char* const ALERT_KIND_NAMES[] = {"low", "high", "sensor", "rate", "deviation"};
+const char* const ALERT_CHANNEL_NAMES[] = {"ph", "do_conc", "do_sat", "temp"};
+
+void mqttPublishAlert(const char* payload, size_t len); // Ver MqttPublisher
+
+// Lo usa procTask, salvo configure() y las consultas desde commandTask
+// (floats y contadores de 32 bits: sin lecturas a medias).
+class AnomalyDetector {
+  public:
+    void configure(const Settings& settings) {
+        for (int i = 0; i < ALERT_CHANNELS; i++) limits[i] = settings.alertLimits[i];
+        // Una desviación menor que la banda muerta de telemetría no es significativa
+        sigmaFloor[0] = settings.deadbandPh;
+        sigmaFloor[1] = settings.deadbandDoConc;
+        sigmaFloor[2] = settings.deadbandDoSat;
+        sigmaFloor[3] = settings.deadbandTemp;
+    }
+
+    void process(const SensorReading& r) {
+        float values[ALERT_CHANNELS];
+        bool valid[ALERT_CHANNELS];
+        values[0] = r.ph;     valid[0] = r.phValid;
+        values[1] = r.doConc; valid[1] = r.doValid;
+        values[2] = r.doSat;  valid[2] = r.doValid;
+        values[3] = r.temp;   valid[3] = r.doValid;
+
+        for (uint8_t i = 0; i < ALERT_CHANNELS; i++) {
+            Channel& c = channels[i];
+            const AlertLimits& l = limits[i];
+            // OD, saturación y temperatura vienen de la misma sonda: un solo aviso
+            if (i <= 1) level(i, ALERT_SENSOR, !valid[i], NAN, NAN, r.uptimeMs);
+            if (!valid[i]) {
+                c.haveLast = false; // El ritmo no se mide a través de un hueco
+                continue;
+            }
+
+            float x = values[i];
+            level(i, ALERT_LOW, !std::isnan(l.min) && x < l.min, x, l.min, r.uptimeMs);
+            level(i, ALERT_HIGH, !std::isnan(l.max) && x > l.max, x, l.max, r.uptimeMs);
+
+            if (c.haveLast && l.ratePerMin > 0.0f && r.uptimeMs != c.lastMs) {
+                float rate = (x - c.lastValue) * 60000.0f / (float)(r.uptimeMs - c.lastMs);
+                if (fabsf(rate) > l.ratePerMin) event(i, ALERT_RATE, x, l.ratePerMin, rate, r.uptimeMs);
+            }
+            if (c.count >= ALERT_WARMUP_READINGS && l.zLimit > 0.0f) {
+                float sigma = fmaxf(sqrtf(c.var), sigmaFloor[i]);
+                float z = sigma > 0.0f ? (x - c.mean) / sigma : 0.0f;
+                if (fabsf(z) > l.zLimit) event(i, ALERT_DEVIATION, x, l.zLimit, z, r.uptimeMs);
+            }
+
+            // La lectura entra en la media aunque sea anómala: un cambio de
+            // nivel sostenido acaba siendo lo normal y deja de avisar
+            float diff = x - c.mean;
+            if (c.count < ALERT_WARMUP_READINGS) {
+                c.count++;
+                c.mean += diff / c.count;
+                c.var += (diff * (x - c.mean) - c.var) / c.count;
+            } else {
+                float increment = ALERT_EWMA_ALPHA * diff;
+                c.mean += increment;
+                c.var = (1.0f - ALERT_EWMA_ALPHA) * (c.var + diff * increment);
+            }
+            c.lastValue = x;
+            c.lastMs = r.uptimeMs;
+            c.haveLast = true;
+        }
+    }
+
+    const AlertLimits& limitsFor(uint8_t channel) const { return limits[channel]; }
+    float meanFor(uint8_t channel) const { return channels[channel].mean; }
+    float sigmaFor(uint8_t channel) const { return sqrtf(channels[channel].var); }
+    bool warmedUp(uint8_t channel) const { return channels[channel].count >= ALERT_WARMUP_READINGS; }
+    bool isActive(uint8_t channel, AlertKind kind) const { return channels[channel].active & (1 << kind); }
+    uint32_t raisedCount() const { return raised; }
+    uint32_t clearedCount() const { return cleared; }
+    uint32_t eventCount() const { return events; }
+    uint32_t suppressedCount() const { return suppressed; }
+    uint32_t alertSequence() const { return sequence; }
+
+  private:
+    struct Channel {
+        float mean = 0.0f, var = 0.0f;
+        uint16_t count = 0;
+        float lastValue = 0.0f;
+        uint32_t lastMs = 0;
+        bool haveLast = false;
+        uint8_t active = 0;                        // Un bit por AlertKind con estado
+        uint8_t clearRun[ALERT_LEVEL_KINDS] = {};  // Lecturas seguidas en rango
+        uint32_t lastEventMs[2] = {};              // ALERT_RATE, ALERT_DEVIATION
+        bool eventSent[2] = {};
+    };
+
+    void level(uint8_t channel, AlertKind kind, bool outside, float value, float limit, uint32_t now) {
+        Channel& c = channels[channel];
+        uint8_t bit = 1 << kind;
+        if (outside) {
+            c.clearRun[kind] = 0;
+            if (c.active & bit) return;
+            c.active |= bit;
+            raised++;
+            send(channel, kind, "raised", value, limit, NAN, now);
+        } else if ((c.active & bit) && ++c.clearRun[kind] >= ALERT_CLEAR_READINGS) {
+            c.active &= ~bit;
+            c.clearRun[kind] = 0;
+            cleared++;
+            send(channel, kind, "cleared", value, limit, NAN, now);
+        }
+    }
+
+    void event(uint8_t channel, AlertKind kind, float value, float limit, float measured, uint32_t now) {
+        Channel& c = channels[channel];
+        uint8_t slot = kind - ALERT_RATE;
+        if (c.eventSent[slot] && now - c.lastEventMs[slot] < ALERT_COOLDOWN_MS) {
+            suppressed++;
+            return;
+        }
+        c.eventSent[slot] = true;
+        c.lastEventMs[slot] = now;
+        events++;
+        send(channel, kind, "event", value, limit, measured, now);
+    }
+
+    // Línea JSON compacta, sin pasar por el pool: una alerta no se pierde
+    // porque haya un documento ocupado
+    void send(uint8_t channel, AlertKind kind, const char* state, float value, float limit, float measured,
+              uint32_t now) {
+        char frame[ALERT_FRAME_MAX];
+        size_t len = 0;
+        auto append = [&](const char* format, auto... args) {
+            int written = snprintf(frame + len, sizeof(frame) - len, format, args...);
+            if (written > 0) len = std::min(len + written, sizeof(frame) - 1);
+        };
+        auto appendNumber = [&](const char* key, float number, int decimals) {
+            if (std::isnan(number)) append(",\"%s\":null", key);
+            else append(",\"%s\":%.*f", key, decimals, number);
+        };
+
+        append("{\"type\":\"alert\",\"seq\":%u,\"channel\":\"%s\",\"kind\":\"%s\",\"state\":\"%s\"",
+               (unsigned)++sequence, ALERT_CHANNEL_NAMES[channel], ALERT_KIND_NAMES[kind], state);
+        appendNumber("value", value, 2);
+        appendNumber("limit", limit, 2);
+        if (kind == ALERT_RATE) appendNumber("rate_per_min", measured, 2);
+        if (kind == ALERT_DEVIATION) {
+            appendNumber("z", measured, 1);
+            appendNumber("mean", channels[channel].mean, 2);
+        }
+        append(",\"uptime_s\":%u}", (unsigned)(now / 1000));
+
+        LOG_W("Alerta %s/%s (%s)", ALERT_CHANNEL_NAMES[channel], ALERT_KIND_NAMES[kind], state);
+        mqttPublishAlert(frame, len);
+        if (len + 1 < sizeof(frame) && deviceConnected) {
+            frame[len] = '\n';
+            sessions.broadcastRaw(reinterpret_cast<const uint8_t*>(frame), len + 1);
+        }
+    }
+
+    AlertLimits limits[ALERT_CHANNELS] = {};
+    float sigmaFloor[ALERT_CHANNELS] = {DEADBAND_PH, DEADBAND_DO_CONC, DEADBAND_DO_SAT, DEADBAND_TEMP};
+    Channel channels[ALERT_CHANNELS];
+    uint32_t sequence = 0;
+    uint32_t raised = 0, cleared = 0, events = 0, suppressed = 0;
+};
+
+AnomalyDetector anomalyDetector;
+
+// Altitud de trabajo: la presión corrige la solubilidad del OD
+void applyAltitude(int altitude) {
+    altitudeMeters = altitude;
+    altitudeCorrection = powf(1.0f - 2.25577e-5f * altitude, 5.25588f);
+}
+
+
+// --- Calibración y compensación en punto fijo ---
+// pH: el electrodo da E = pendiente(T) * (pH_iso - pH) con la pendiente de
+// Nernst proporcional a la temperatura absoluta. Se normaliza E a 25 °C con una
+// tabla y la calibración de varios puntos la convierte a pH por tramos.
+// OD: la sonda mide saturación; la concentración sale de la solubilidad del
+// oxígeno (APHA 4500-O) para la temperatura, salinidad y presión actuales.
+//
+// Las tablas se construyen en coma flotante solo al cambiar la configuración;
+// por lectura se hacen unas pocas multiplicaciones enteras en Q16.
+
+typedef int32_t q16_t;
+
+static constexpr q16_t Q16_ONE = 1 << 16;
+static constexpr float NERNST_MV_PER_K = 0.198416f;   // ln(10)·R/F en mV/K
+static constexpr float KELVIN_OFFSET = 273.15f;
+static constexpr float TEMP_MIN_C = -10.0f;           // Sensor de temperatura lineal
+static constexpr float TEMP_SPAN_C = 60.0f;
+static constexpr uint32_t FILTERED_FULL_SCALE = (uint32_t)ADC_FULL_SCALE * ADC_OVERSAMPLE;
+
+static constexpr q16_t floatToQ16(float value) {
+    return (q16_t)(value * Q16_ONE + (value >= 0 ? 0.5f : -0.5f));
+}
+static inline float q16ToFloat(q16_t value) { return (float)value / Q16_ONE; }
+static inline q16_t q16Mul(q16_t a, q16_t b) { return (q16_t)(((int64_t)a * b) >> 16); }
+
+// Cuentas sobremuestreadas -> valor lineal en Q16
+static inline q16_t countsToQ16(uint32_t counts, q16_t offset, q16_t span) {
+    return offset + (q16_t)((int64_t)counts * span / FILTERED_FULL_SCALE);
+}
+
+class Calibration {
+  public:
+    typedef PhCalPoint PhPoint;
+
+    // Toma la calibración de la configuración y genera las tablas
+    void begin(const Settings& settings) {
+        phPointCount = std::min<size_t>(settings.phPointCount, CAL_MAX_PH_POINTS);
+        memcpy(phPoints, settings.phPoints, sizeof(PhPoint) * phPointCount);
+        salinity = settings.salinityPsu;
+
+        for (int i = 0; i < LUT_SIZE; i++) {
+            double kelvin = LUT_MIN_C + i * 0.5 + KELVIN_OFFSET;
+            tempFactor[i] = floatToQ16((float)((25.0 + KELVIN_OFFSET) / kelvin));
+        }
+        rebuild();
+        LOG_I("Calibración: %u puntos de pH, salinidad %.1f PSU", (unsigned)phPointCount, salinity);
+    }
+
+    // Regenera las tablas en el búfer inactivo y lo publica de una vez. begin()
+    // corre en setup() antes de que exista BLE; después solo la llama la tarea de
+    // comandos, así que nunca hay dos escritores. procTask lee sin bloquear y
+    // repite la lectura si entretanto se publicó otra tabla (ver readTables()).
+    void rebuild() {
+        uint32_t seq = sequence.load(std::memory_order_relaxed);
+        // Tras la publicación anterior este búfer puede tenerlo aún un lector
+        std::atomic_thread_fence(std::memory_order_release);
+        Tables& t = tables[(seq + 1) & 1];
+        buildDoTable(t);
+        buildPhSegments(t);
+        sequence.store(seq + 1, std::memory_order_release);
+    }
+
+    // Añade o sustituye (±0,5 pH) un punto. Devuelve nullptr o el motivo del rechazo.
+    const char* addPhPoint(float buffer, float mv25) {
+        PhPoint candidate[CAL_MAX_PH_POINTS];
+        size_t count = 0;
+        for (size_t i = 0; i < phPointCount; i++) {
+            if (fabsf(phPoints[i].ph - buffer) >= 0.5f) candidate[count++] = phPoints[i];
+        }
+        if (count >= CAL_MAX_PH_POINTS) return "Calibration full, clear it first.";
+        candidate[count++] = {buffer, mv25};
+
+        // Ordenados por potencial; cada tramo debe tener una pendiente creíble
+        std::sort(candidate, candidate + count, [](const PhPoint& a, const PhPoint& b) { return a.mv25 < b.mv25; });
+        for (size_t i = 1; i < count; i++) {
+            float percent = slopePercent(candidate[i - 1], candidate[i]);
+            if (percent < 80.0f || percent > 110.0f) return "Electrode slope out of range (80-110%).";
+        }
+
+        memcpy(phPoints, candidate, sizeof(PhPoint) * count);
+        phPointCount = count;
+        savePhPoints();
+        rebuild();
+        return nullptr;
+    }
+
+    void clearPh() {
+        phPointCount = 0;
+        savePhPoints();
+        rebuild();
+    }
+
+    void setSalinity(float psu) {
+        salinity = psu;
+        config.update([psu](Settings& s) { s.salinityPsu = psu; });
+        rebuild();
+    }
+
+    // --- Evaluación por lectura (Q16) ---
+
+    static q16_t temperature(uint32_t counts) {
+        return countsToQ16(counts, floatToQ16(TEMP_MIN_C), floatToQ16(TEMP_SPAN_C));
+    }
+
+    // Potencial del electrodo en mV, ya normalizado a 25 °C
+    q16_t electrodeMv25(uint32_t counts, q16_t tempC) const {
+        q16_t mv = countsToQ16(counts, -floatToQ16(PH_BIAS_MV), floatToQ16(ADC_VREF_MV));
+        return q16Mul(mv, interpolate(tempFactor, tempC));
+    }
+
+    q16_t ph(q16_t mv25) const {
+        return readTables([mv25](const Tables& t) {
+            uint8_t i = 0;
+            while (i + 1 < t.segmentCount && mv25 > t.segments[i].upperMv) i++;
+            return t.segments[i].intercept + q16Mul(t.segments[i].slope, mv25);
+        });
+    }
+
+    static q16_t doSaturation(uint32_t counts) {
+        return countsToQ16(counts, 0, floatToQ16(DO_SPAN_SAT_PCT));
+    }
+
+    // mg/L = saturación (%) · solubilidad(T) / 100
+    q16_t doConcentration(q16_t saturationPct, q16_t tempC) const {
+        return q16Mul(saturationPct, doSolubility(tempC)) / 100;
+    }
+
+    q16_t doSolubility(q16_t tempC) const {
+        return readTables([tempC](const Tables& t) { return interpolate(t.doSolubility, tempC); });
+    }
+
+    size_t phPointTotal() const { return phPointCount; }
+    const PhPoint& phPoint(size_t i) const { return phPoints[i]; }
+    float salinityPsu() const { return salinity; }
+    uint32_t rebuildCount() const { return sequence.load(std::memory_order_relaxed); }
+
+    // Pendiente del electrodo respecto a la teórica a 25 °C (100% = ideal)
+    float slopePercent() const {
+        return phPointCount >= 2 ? slopePercent(phPoints[0], phPoints[phPointCount - 1]) : 100.0f;
+    }
+
+    // Potencial a pH 7 (desviación del punto isopotencial)
+    float offsetMv() const {
+        return q16ToFloat(solveMv(floatToQ16(7.0f)));
+    }
+
+  private:
+    static constexpr int LUT_MIN_C = CAL_LUT_MIN_C;
+    static constexpr int LUT_SIZE = (CAL_LUT_MAX_C - CAL_LUT_MIN_C) * 2 + 1;
+    static constexpr float NERNST_25_MV = NERNST_MV_PER_K * (25.0f + KELVIN_OFFSET);
+
+    struct PhSegment {
+        q16_t upperMv;    // El tramo se usa hasta este potencial
+        q16_t slope;      // pH por mV
+        q16_t intercept;  // pH a 0 mV
+    };
+
+    struct Tables {
+        q16_t doSolubility[LUT_SIZE];  // mg/L para la salinidad y presión actuales
+        PhSegment segments[CAL_MAX_PH_POINTS];
+        uint8_t segmentCount;
+    };
+
+    // Seqlock sobre el doble búfer: con dos rebuild() seguidos el segundo
+    // reescribe el búfer que un lector lento aún podía estar usando
+    template <typename Read>
+    q16_t readTables(Read read) const {
+        for (;;) {
+            uint32_t seq = sequence.load(std::memory_order_acquire);
+            q16_t result = read(tables[seq & 1]);
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (sequence.load(std::memory_order_relaxed) == seq) return result;
+        }
+    }
+
+    static float slopePercent(const PhPoint& a, const PhPoint& b) {
+        return (a.mv25 - b.mv25) / (b.ph - a.ph) / NERNST_25_MV * 100.0f;
+    }
+
+    // Interpolación lineal en una tabla de pasos de 0,5 °C (2^15 en Q16)
+    static q16_t interpolate(const q16_t* lut, q16_t tempC) {
+        int32_t offset = tempC - LUT_MIN_C * Q16_ONE;
+        if (offset <= 0) return lut[0];
+        int32_t index = offset >> 15;
+        if (index >= LUT_SIZE - 1) return lut[LUT_SIZE - 1];
+        int32_t fraction = offset & 0x7FFF;
+        return lut[index] + (q16_t)(((int64_t)(lut[index + 1] - lut[index]) * fraction) >> 15);
+    }
+
+    // Solubilidad del O2 en agua (APHA 4500-O, Benson y Krause) con corrección
+    // de salinidad y de presión barométrica por altitud
+    void buildDoTable(Tables& t) const {
+        double pressureAtm = altitudeCorrection;
+        for (int i = 0; i < LUT_SIZE; i++) {
+            double celsius = LUT_MIN_C + i * 0.5;
+            double kelvin = celsius + KELVIN_OFFSET;
+            double lnC = -139.34411 + 1.575701e5 / kelvin - 6.642308e7 / (kelvin * kelvin) +
+                         1.243800e10 / (kelvin * kelvin * kelvin) - 8.621949e11 / (kelvin * kelvin * kelvin * kelvin);
+            lnC -= salinity * (1.7674e-2 - 1.0754e1 / kelvin + 2.1407e3 / (kelvin * kelvin));
+            double vapour = exp(11.8571 - 3840.70 / kelvin - 216961.0 / (kelvin * kelvin));
+            double theta = 0.000975 - 1.426e-5 * celsius + 6.436e-8 * celsius * celsius;
+            double pressureFactor = pressureAtm * (1.0 - vapour / pressureAtm) * (1.0 - theta * pressureAtm) /
+                                    ((1.0 - vapour) * (1.0 - theta));
+            t.doSolubility[i] = floatToQ16((float)(exp(lnC) * pressureFactor));
+        }
+    }
+
+    // Sin puntos: electrodo ideal. Un punto: solo desplazamiento. Varios: un
+    // tramo entre cada par, extrapolando los de los extremos.
+    void buildPhSegments(Tables& t) const {
+        auto segment = [](float mvA, float phA, float slope, float upper) {
+            PhSegment s;
+            s.upperMv = floatToQ16(upper);
+            s.slope = floatToQ16(slope);
+            s.intercept = floatToQ16(phA - slope * mvA);
+            return s;
+        };
+        float limit = ADC_VREF_MV; // Mayor que cualquier potencial medible
+
+        if (phPointCount < 2) {
+            float mv = phPointCount ? phPoints[0].mv25 : 0.0f;
+            float ph = phPointCount ? phPoints[0].ph : 7.0f;
+            t.segments[0] = segment(mv, ph, -1.0f / NERNST_25_MV, limit);
+            t.segmentCount = 1;
+            return;
+        }
+
+        t.segmentCount = phPointCount - 1;
+        for (size_t i = 0; i + 1 < phPointCount; i++) {
+            const PhPoint& a = phPoints[i];
+            const PhPoint& b = phPoints[i + 1];
+            bool last = i + 2 == phPointCount;
+            t.segments[i] = segment(a.mv25, a.ph, (b.ph - a.ph) / (b.mv25 - a.mv25), last ? limit : b.mv25);
+        }
+    }
+
+    // Potencial que corresponde a un pH (para informar del desplazamiento)
+    // Solo desde la tarea de comandos, la misma que escribe: no hace falta reintentar
+    q16_t solveMv(q16_t targetPh) const {
+        const Tables& t = tables[sequence.load(std::memory_order_relaxed) & 1];
+        for (uint8_t i = 0; i < t.segmentCount; i++) {
+            q16_t mv = (q16_t)(((int64_t)(targetPh - t.segments[i].intercept) << 16) / t.segments[i].slope);
+            if (mv <= t.segments[i].upperMv || i + 1 == t.segmentCount) return mv;
+        }
+        return 0;
+    }
+
+    void savePhPoints() {
+        config.update([this](Settings& s) {
+            s.phPointCount = phPointCount;
+            memcpy(s.phPoints, phPoints, sizeof(phPoints));
+        });
+    }
+
+    PhPoint phPoints[CAL_MAX_PH_POINTS];
+    size_t phPointCount = 0;
+    float salinity = 0.0f;  // PSU
+    q16_t tempFactor[LUT_SIZE]; // 298,15 K / T, fijo
+    Tables tables[2];
+    std::atomic<uint32_t> sequence{0}; // Publicaciones; el bit bajo indica el búfer activo
+};
+
+Calibration calibration;
+
+
+// --- Pipeline de adquisición en dos núcleos ---
+
+// Resultado filtrado de una ráfaga del ADC, en cuentas sobremuestreadas
+// (x ADC_OVERSAMPLE) y todavía sin convertir a unidades físicas
+struct RawSample {
+    uint32_t sequence;
+    uint32_t timestampUs;   // Inicio de la ráfaga; esp_timer truncado, solo se usan diferencias
+    uint16_t phCounts;
+    uint16_t doCounts;
+    uint16_t tempCounts;
+    uint8_t flags;          // RAW_PH_VALID | RAW_DO_VALID
+};
+
+enum : uint8_t { RAW_PH_VALID = 0x01, RAW_DO_VALID = 0x02 };
+
+// Anillo SPSC de elementos de tamaño fijo: un productor y un consumidor, sin
+// bloqueos. Si está lleno el elemento nuevo se descarta y se cuenta.
+template <typename T, size_t Depth>
+class SpscRing {
+    static_assert((Depth & (Depth - 1)) == 0, "Depth debe ser potencia de 2");
+
+  public:
+    bool push(const T& item) {
+        uint32_t head = headIndex.load(std::memory_order_relaxed);
+        uint32_t tail = tailIndex.load(std::memory_order_acquire);
+        if (head - tail >= Depth) {
+            overflowCount.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        items[head & (Depth - 1)] = item;
+        headIndex.store(head + 1, std::memory_order_release);
+
+        uint32_t used = head + 1 - tail;
+        if (used > highWater.load(std::memory_order_relaxed)) {
+            highWater.store(used, std::memory_order_relaxed);
+        }
+        return true;
+    }
+
+    bool pop(T& item) {
+        uint32_t tail = tailIndex.load(std::memory_order_relaxed);
+        if (tail == headIndex.load(std::memory_order_acquire)) return false;
+        item = items[tail & (Depth - 1)];
+        tailIndex.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Consumidor: elemento `offset` posiciones detrás del más antiguo, sin sacarlo
+    const T* peek(uint32_t offset) const {
+        uint32_t tail = tailIndex.load(std::memory_order_relaxed);
+        if (offset >= headIndex.load(std::memory_order_acquire) - tail) return nullptr;
+        return &items[(tail + offset) & (Depth - 1)];
+    }
+
+    // Consumidor: libera los `count` elementos más antiguos ya leídos con peek()
+    void drop(uint32_t count) {
+        tailIndex.store(tailIndex.load(std::memory_order_relaxed) + count, std::memory_order_release);
+    }
+
+    uint32_t depth() const {
+        return headIndex.load(std::memory_order_acquire) - tailIndex.load(std::memory_order_acquire);
+    }
+    uint32_t capacity() const { return Depth; }
+    uint32_t highWaterMark() const { return highWater.load(std::memory_order_relaxed); }
+    uint32_t overflows() const { return overflowCount.load(std::memory_order_relaxed); }
+
+  private:
+    T items[Depth];
+    std::atomic<uint32_t> headIndex{0};
+    std::atomic<uint32_t> tailIndex{0};
+    std::atomic<uint32_t> highWater{0};
+    std::atomic<uint32_t> overflowCount{0};
+};
+
+// Tiempos de una etapa. Solo la escribe su propia tarea; los lectores pueden
+// ver un valor a medio actualizar, suficiente para diagnóstico.
+struct StageStats {
+    uint32_t count = 0;
+    uint32_t lastUs = 0;
+    uint32_t maxUs = 0;
+    uint64_t totalUs = 0;
+
+    void record(uint32_t us) {
+        count++;
+        lastUs = us;
+        totalUs += us;
+        if (us > maxUs) maxUs = us;
+    }
+
+    uint32_t avgUs() const { return count ? (uint32_t)(totalUs / count) : 0; }
+};
+
+SpscRing<RawSample, ACQ_RING_DEPTH> rawRing;
+TaskHandle_t acquisitionTaskHandle = nullptr;
+TaskHandle_t processingTaskHandle = nullptr;
+
+enum AdcChannel : uint8_t { ADC_PH, ADC_DO, ADC_TEMP, ADC_CHANNEL_COUNT };
+
+struct PipelineStats {
+    StageStats acquire;       // Captura de una ráfaga, de inicio a fin de la conversión
+    StageStats filter;        // Mediana y rechazo de atípicos de una ráfaga
+    StageStats jitter;        // Desviación del intervalo respecto a ACQ_PERIOD_MS
+    StageStats queueLatency;  // Desde la ráfaga hasta que procTask la saca del anillo
+    StageStats process;       // Acumulación de una ráfaga
+    StageStats publish;       // Conversión y envío de una lectura completa
+    uint32_t captureErrors = 0;
+    uint32_t conversions[ADC_CHANNEL_COUNT] = {};
+    uint32_t rejected[ADC_CHANNEL_COUNT] = {};
+} pipelineStats;
+
+static constexpr uint32_t SAMPLES_PER_READING = SENSOR_PERIOD_MS / ACQ_PERIOD_MS;
+static_assert(SAMPLES_PER_READING > 0, "SENSOR_PERIOD_MS debe ser >= ACQ_PERIOD_MS");
+// Ráfagas por lectura; menos en un despertar del ciclo de trabajo. Se fija
+// antes de arrancar las tareas.
+uint32_t samplesPerReading = SAMPLES_PER_READING;
+
+// Cuentas del ADC que daría un valor físico (solo para la simulación)
+static uint16_t toCounts(float value, float offset, float span) {
+    float counts = (value - offset) / span * ADC_FULL_SCALE;
+    return (uint16_t)constrain(counts, 0.0f, (float)ADC_FULL_SCALE);
+}
+
+// Captura de ráfagas: una por periodo, con todos los canales intercalados
+class AdcBurstSampler {
+  public:
+    void begin(TaskHandle_t owner) {
+        this->owner = owner;
+#if ADC_DMA_ENABLE
+        adc_continuous_handle_cfg_t handleConfig = {};
+        handleConfig.max_store_buf_size = sizeof(frame) * 2;
+        handleConfig.conv_frame_size = sizeof(frame);
+        ESP_ERROR_CHECK(adc_continuous_new_handle(&handleConfig, &handle));
+
+        static const uint8_t channels[ADC_CHANNEL_COUNT] = {PH_ADC_CHANNEL, DO_ADC_CHANNEL, TEMP_ADC_CHANNEL};
+        adc_digi_pattern_config_t pattern[ADC_CHANNEL_COUNT] = {};
+        for (int i = 0; i < ADC_CHANNEL_COUNT; i++) {
+#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 1, 0)
+            pattern[i].atten = ADC_ATTEN_DB_12;
+#else
+            pattern[i].atten = ADC_ATTEN_DB_11;
+#endif
+            pattern[i].channel = channels[i];
+            pattern[i].unit = ADC_UNIT_1;
+            pattern[i].bit_width = SOC_ADC_DIGI_MAX_BITWIDTH;
+        }
+        adc_continuous_config_t config = {};
+        config.pattern_num = ADC_CHANNEL_COUNT;
+        config.adc_pattern = pattern;
+        config.sample_freq_hz = ADC_SAMPLE_FREQ_HZ;
+        config.conv_mode = ADC_CONV_SINGLE_UNIT_1;
+        config.format = ADC_DIGI_OUTPUT_FORMAT_TYPE1;
+        ESP_ERROR_CHECK(adc_continuous_config(handle, &config));
+
+        adc_continuous_evt_cbs_t callbacks = {};
+        callbacks.on_conv_done = onConversionDone;
+        ESP_ERROR_CHECK(adc_continuous_register_event_callbacks(handle, &callbacks, this));
+#endif
+    }
+
+    // Llena samples[canal][] con una ráfaga; false si el ADC no respondió
+    bool capture() {
+        for (auto& c : counts) c = 0;
+#if ADC_DMA_ENABLE
+        // La conversión corre sola por DMA; la tarea duerme hasta el aviso
+        if (adc_continuous_start(handle) != ESP_OK) return false;
+        bool done = ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(BURST_TIMEOUT_MS)) > 0;
+        uint32_t length = 0;
+        if (done) done = adc_continuous_read(handle, frame, sizeof(frame), &length, 0) == ESP_OK;
+        adc_continuous_stop(handle);
+        uint32_t discarded;
+        while (adc_continuous_read(handle, discardFrame, sizeof(discardFrame), &discarded, 0) == ESP_OK) {
+            // Restos de la ráfaga que no pertenecen a esta trama
+        }
+        if (!done) return false;
+
+        for (uint32_t i = 0; i + SOC_ADC_DIGI_RESULT_BYTES <= length; i += SOC_ADC_DIGI_RESULT_BYTES) {
+            const adc_digi_output_data_t* result = reinterpret_cast<const adc_digi_output_data_t*>(&frame[i]);
+            int slot = channelSlot(result->type1.channel);
+            if (slot < 0 || counts[slot] >= ADC_BURST_SAMPLES) continue;
+            samples[slot][counts[slot]++] = result->type1.data;
+        }
+        return true;
+#else
+        simulate();
+        return true;
+#endif
+    }
+
+    uint16_t samples[ADC_CHANNEL_COUNT][ADC_BURST_SAMPLES];
+    size_t counts[ADC_CHANNEL_COUNT] = {};
+
+  private:
+    TaskHandle_t owner = nullptr;
+
+#if ADC_DMA_ENABLE
+    static constexpr uint32_t BURST_TIMEOUT_MS =
+        ADC_BURST_SAMPLES * ADC_CHANNEL_COUNT * 1000 / ADC_SAMPLE_FREQ_HZ + 20;
+
+    adc_continuous_handle_t handle = nullptr;
+    uint8_t frame[ADC_BURST_SAMPLES * ADC_CHANNEL_COUNT * SOC_ADC_DIGI_RESULT_BYTES];
+    uint8_t discardFrame[sizeof(frame)];
+
+    static int channelSlot(uint32_t channel) {
+        switch (channel) {
+            case PH_ADC_CHANNEL: return ADC_PH;
+            case DO_ADC_CHANNEL: return ADC_DO;
+            case TEMP_ADC_CHANNEL: return ADC_TEMP;
+            default: return -1;
+        }
+    }
+
+    static bool IRAM_ATTR onConversionDone(adc_continuous_handle_t, const adc_continuous_evt_data_t*, void* context) {
+        BaseType_t woken = pdFALSE;
+        vTaskNotifyGiveFromISR(static_cast<AdcBurstSampler*>(context)->owner, &woken);
+        return woken == pdTRUE;
+    }
+#else
+    // Sondas simuladas a partir de los rangos de read_real_sensors() en
+    // src/main.py, llevadas a cuentas del ADC con ruido, picos sueltos y algún
+    // fallo de sonda (saturada)
+    void simulate() {
+        float ph = 7.2f + 1.5f * (random(1000) / 1000.0f - 0.5f);
+        float temp = 22.5f + 5.0f * (random(1000) / 1000.0f - 0.5f);
+        float doSat = 105.0f - (temp - 20.0f) * 2.0f + 20.0f * (random(1000) / 1000.0f - 0.5f);
+        float electrodeMv = (7.0f - ph) * NERNST_MV_PER_K * (temp + KELVIN_OFFSET); // Electrodo ideal
+        uint16_t base[ADC_CHANNEL_COUNT] = {
+            toCounts(electrodeMv + PH_BIAS_MV, 0.0f, ADC_VREF_MV),
+            toCounts(doSat, 0.0f, DO_SPAN_SAT_PCT),
+            toCounts(temp, TEMP_MIN_C, TEMP_SPAN_C),
+        };
+        bool faulty[ADC_CHANNEL_COUNT] = {random(100) < 5, random(100) < 5, false};
+
+        for (int c = 0; c < ADC_CHANNEL_COUNT; c++) {
+            for (int i = 0; i < ADC_BURST_SAMPLES; i++) {
+                int32_t value = faulty[c] ? ADC_FULL_SCALE : base[c] + random(-6, 7);
+                if (!faulty[c] && random(100) < 3) value += random(2) ? random(200, 800) : -random(200, 800);
+                samples[c][i] = (uint16_t)constrain(value, 0, ADC_FULL_SCALE);
+            }
+            counts[c] = ADC_BURST_SAMPLES;
+        }
+    }
+#endif
+};
+
+AdcBurstSampler adcSampler;
+
+struct ChannelResult {
+    uint16_t value;     // Media de las muestras aceptadas, x ADC_OVERSAMPLE
+    uint16_t kept;
+    uint16_t rejected;
+    bool valid;         // Al menos la mitad de la ráfaga es aprovechable
+};
+
+// Mediana + rechazo por desviación absoluta mediana (MAD) + media del resto.
+// Las lecturas en los extremos del ADC indican sonda desconectada o en corto y
+// se descartan antes. Reordena `samples`.
+ChannelResult filterChannel(uint16_t* samples, size_t count) {
+    ChannelResult result = {};
+    size_t n = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (samples[i] > 0 && samples[i] < ADC_FULL_SCALE) samples[n++] = samples[i];
+    }
+    result.rejected = count - n;
+    if (n == 0) return result;
+
+    std::nth_element(samples, samples + n / 2, samples + n);
+    uint16_t median = samples[n / 2];
+
+    uint16_t deviations[ADC_BURST_SAMPLES];
+    for (size_t i = 0; i < n; i++) deviations[i] = abs((int)samples[i] - median);
+    std::nth_element(deviations, deviations + n / 2, deviations + n);
+    uint32_t threshold = std::max<uint32_t>(ADC_OUTLIER_MIN_COUNTS, ADC_OUTLIER_MAD_K * deviations[n / 2]);
+
+    uint32_t sum = 0;
+    for (size_t i = 0; i < n; i++) {
+        if ((uint32_t)abs((int)samples[i] - median) > threshold) continue;
+        sum += samples[i];
+        result.kept++;
+    }
+    result.rejected += n - result.kept;
+    result.value = (uint16_t)((sum * ADC_OVERSAMPLE + result.kept / 2) / result.kept);
+    result.valid = result.kept * 2 >= count;
+    return result;
+}
+
+// Copia coherente de la última lectura para otras tareas
+SensorReading readingSnapshot() {
+    portENTER_CRITICAL(&readingLock);
+    SensorReading copy = latestReading;
+    portEXIT_CRITICAL(&readingLock);
+    return copy;
+}
+
+// Núcleo 1: una ráfaga por periodo a ritmo fijo. No hace nada más que capturar,
+// filtrar y encolar, para que la radio no desplace los instantes de muestreo.
+void acquisitionTask(void*) {
+    adcSampler.begin(xTaskGetCurrentTaskHandle());
+    uint32_t sequence = 0;
+    TickType_t lastWake = xTaskGetTickCount();
+    int64_t previousUs = esp_timer_get_time();
+
+    for (;;) {
+        vTaskDelayUntil(&lastWake, pdMS_TO_TICKS(ACQ_PERIOD_MS));
+        int64_t started = esp_timer_get_time();
+        int64_t deviation = (started - previousUs) - (int64_t)ACQ_PERIOD_MS * 1000;
+        pipelineStats.jitter.record((uint32_t)(deviation < 0 ? -deviation : deviation));
+        previousUs = started;
+
+        if (!adcSampler.capture()) {
+            pipelineStats.captureErrors++;
+            continue;
+        }
+        int64_t captured = esp_timer_get_time();
+        pipelineStats.acquire.record((uint32_t)(captured - started));
+
+        ChannelResult results[ADC_CHANNEL_COUNT];
+        for (int c = 0; c < ADC_CHANNEL_COUNT; c++) {
+            results[c] = filterChannel(adcSampler.samples[c], adcSampler.counts[c]);
+            pipelineStats.conversions[c] += adcSampler.counts[c];
+            pipelineStats.rejected[c] += results[c].rejected;
+        }
+
+        RawSample sample;
+        sample.sequence = sequence++;
+        sample.timestampUs = (uint32_t)started;
+        sample.phCounts = results[ADC_PH].value;
+        sample.doCounts = results[ADC_DO].value;
+        sample.tempCounts = results[ADC_TEMP].value;
+        sample.flags = (results[ADC_PH].valid ? RAW_PH_VALID : 0) |
+                       (results[ADC_DO].valid && results[ADC_TEMP].valid ? RAW_DO_VALID : 0);
+        pipelineStats.filter.record((uint32_t)(esp_timer_get_time() - captured));
+        if (rawRing.push(sample)) xTaskNotifyGive(processingTaskHandle);
+
+        // La espera de la conversión no cuenta como tiempo de CPU
+        powerManager.noteWake((uint32_t)(esp_timer_get_time() - captured));
+    }
+}
+
+void mqttEnqueue(const SensorReading& reading); // Ver MqttPublisher
+bool dutyCycleSampling();                       // Ver DutyCycle
+void dutyCycleStore(const SensorReading& reading);
+
+// Núcleo 0: promedia las ráfagas válidas de cada ventana y publica la lectura.
+// Una ventana con más de la mitad de ráfagas rechazadas cuenta como error.
+void processingTask(void*) {
+    SensorReading reading = {};
+    q16_t tempQ16 = floatToQ16(25.0f);
+    uint32_t samples = 0, phValid = 0, doValid = 0;
+    uint32_t phSum = 0, doSum = 0, tempSum = 0;
+
+    for (;;) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        int64_t wakeUs = esp_timer_get_time();
+
+        RawSample sample;
+        while (rawRing.pop(sample)) {
+            uint32_t popped = (uint32_t)esp_timer_get_time();
+            pipelineStats.queueLatency.record(popped - sample.timestampUs);
+
+            samples++;
+            if (sample.flags & RAW_PH_VALID) {
+                phValid++;
+                phSum += sample.phCounts;
+            }
+            if (sample.flags & RAW_DO_VALID) {
+                doValid++;
+                doSum += sample.doCounts;
+                tempSum += sample.tempCounts;
+            }
+            pipelineStats.process.record((uint32_t)esp_timer_get_time() - popped);
+            if (samples < samplesPerReading) continue;
+
+            // Ventana completa: es válida si al menos la mitad de ráfagas lo son
+            int64_t started = esp_timer_get_time();
+            reading.phValid = phValid * 2 >= samples;
+            reading.doValid = doValid * 2 >= samples;
+            if (reading.doValid) {
+                tempQ16 = Calibration::temperature((tempSum + doValid / 2) / doValid);
+                q16_t saturation = Calibration::doSaturation((doSum + doValid / 2) / doValid);
+                reading.temp = q16ToFloat(tempQ16);
+                reading.doSat = q16ToFloat(saturation);
+                reading.doConc = q16ToFloat(calibration.doConcentration(saturation, tempQ16));
+                reading.readingsDo++;
+            } else {
+                reading.errorsDo++;
+            }
+            // Sin temperatura válida se compensa con la última conocida
+            if (reading.phValid) {
+                q16_t mv25 = calibration.electrodeMv25((phSum + phValid / 2) / phValid, tempQ16);
+                reading.phMv = q16ToFloat(mv25);
+                reading.ph = q16ToFloat(calibration.ph(mv25));
+                reading.readingsPh++;
+            } else {
+                reading.errorsPh++;
+            }
+            reading.uptimeMs = millis();
+
+            portENTER_CRITICAL(&readingLock);
+            latestReading = reading;
+            portEXIT_CRITICAL(&readingLock);
+            if (dutyCycleSampling()) {
+                dutyCycleStore(reading); // Despertar rápido: ni BLE ni red
+            } else {
+                if (deviceConnected) publishTelemetry(reading);
+                mqttEnqueue(reading);
+                anomalyDetector.process(reading);
+            }
+            bootTimeline.mark(BOOT_FIRST_SAMPLE);
+            pipelineStats.publish.record((uint32_t)(esp_timer_get_time() - started));
+
+            samples = phValid = doValid = 0;
+            phSum = doSum = tempSum = 0;
+        }
+        powerManager.noteWake(esp_timer_get_time() - wakeUs);
+    }
+}
+
+
+// --- Histórico de muestras en flash ---
+// Registro circular de tamaño fijo sobre una partición de datos propia. Se
+// escribe siempre en orden, así que cada sector se borra una vez por vuelta
+// (desgaste repartido por igual). Las secuencias son consecutivas y su posición
+// se calcula directamente: leer "desde X" no requiere buscar. Si se corta la
+// luz a mitad de escritura, al arrancar se salta el resto de ese sector y sus
+// números de secuencia quedan sin registro válido.
+//
+// Cada registro se envía tal cual por BLE durante "history_sync"; cualquier
+// cambio debe replicarse en src/lib/telemetry-frame.ts.
+struct __attribute__((packed)) HistoryRecord {
+    uint8_t magic;          // HISTORY_RECORD_MAGIC (0xFF = hueco borrado)
+    uint8_t version;        // HISTORY_RECORD_VERSION
+    uint8_t length;         // sizeof(HistoryRecord)
+    uint8_t flags;          // bits 0-1: StatusLevel
+    uint32_t sequence;
+    uint32_t uptimeS;
+    uint16_t bootCount;
+    int16_t phX100;
+    int16_t doConcX100;
+    int16_t doSatX10;
+    int16_t tempX100;
+    int16_t altitudeM;
+    uint16_t correctionX10000;
+    uint8_t reserved[4];
+    uint16_t crc;           // CRC-16/CCITT-FALSE de los bytes anteriores
+};
+static_assert(sizeof(HistoryRecord) == 32, "El formato del registro v1 es fijo");
+static_assert(SPI_FLASH_SEC_SIZE % sizeof(HistoryRecord) == 0, "Un sector debe contener registros enteros");
+
+class HistoryStore {
+  public:
+    static constexpr uint32_t RECORDS_PER_SECTOR = SPI_FLASH_SEC_SIZE / sizeof(HistoryRecord);
+
+    // Busca la partición y reconstruye el estado leyendo la cabecera de cada sector
+    bool begin() {
+        mutex = createMutex(&mutexBuffer);
+        partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA,
+                                             (esp_partition_subtype_t)HISTORY_PARTITION_SUBTYPE,
+                                             HISTORY_PARTITION_LABEL);
+        if (partition == nullptr) {
+            LOG_W("⚠️ Histórico: no hay partición \"history\", desactivado.");
+            return false;
+        }
+        slots = (partition->size / SPI_FLASH_SEC_SIZE) * RECORDS_PER_SECTOR;
+        scan();
+        LOG_I("Histórico: %u registros (%u..%u), arranque #%u",
+              (unsigned)count(), (unsigned)oldestSeq, (unsigned)(nextSeq - 1), (unsigned)bootCount);
+        return true;
+    }
+
+    bool available() const { return partition != nullptr; }
+
+    bool append(const SensorReading& r) {
+        if (!available()) return false;
+        xSemaphoreTake(mutex, portMAX_DELAY);
+
+        // Al entrar en un sector nuevo se borra; si estaba ocupado por los
+        // registros más antiguos, estos se pierden
+        if (headSlot % RECORDS_PER_SECTOR == 0) {
+            if (esp_partition_erase_range(partition, slotOffset(headSlot), SPI_FLASH_SEC_SIZE) != ESP_OK) {
+                writeErrors++;
+                xSemaphoreGive(mutex);
+                return false;
+            }
+            erases++;
+            if (count() + RECORDS_PER_SECTOR > slots) {
+                oldestSeq += RECORDS_PER_SECTOR;
+                oldestSlot = (headSlot + RECORDS_PER_SECTOR) % slots;
+            }
+        }
+
+        HistoryRecord record;
+        encode(r, nextSeq, record);
+        bool ok = esp_partition_write(partition, slotOffset(headSlot), &record, sizeof(record)) == ESP_OK;
+        if (ok) {
+            if (count() == 0) oldestSlot = headSlot;
+            nextSeq++;
+            headSlot = (headSlot + 1) % slots;
+            appends++;
+        } else {
+            writeErrors++; // Se reintenta en el mismo hueco la próxima vez
+        }
+        xSemaphoreGive(mutex);
+        return ok;
+    }
+
+    // Lee un registro por secuencia; false si ya no existe o está dañado
+    bool read(uint32_t sequence, HistoryRecord& record) {
+        if (!available()) return false;
+        xSemaphoreTake(mutex, portMAX_DELAY);
+        bool ok = false;
+        if (sequence - oldestSeq < count()) {
+            uint32_t slot = (oldestSlot + (sequence - oldestSeq)) % slots;
+            ok = esp_partition_read(partition, slotOffset(slot), &record, sizeof(record)) == ESP_OK &&
+                 isValid(record) && record.sequence == sequence;
+        }
+        xSemaphoreGive(mutex);
+        return ok;
+    }
+
+    uint32_t count() const { return nextSeq - oldestSeq; }
+    uint32_t oldestSequence() const { return oldestSeq; }
+    uint32_t nextSequence() const { return nextSeq; }
+    uint32_t capacity() const { return slots; }
+    uint32_t partitionSize() const { return partition ? partition->size : 0; }
+    uint32_t appendCount() const { return appends; }
+    uint32_t eraseCount() const { return erases; }
+    uint32_t writeErrorCount() const { return writeErrors; }
+    uint16_t bootNumber() const { return bootCount; }
+
+  private:
+    size_t slotOffset(uint32_t slot) const { return slot * sizeof(HistoryRecord); }
+
+    static bool isValid(const HistoryRecord& record) {
+        return record.magic == HISTORY_RECORD_MAGIC && record.version == HISTORY_RECORD_VERSION &&
+               record.crc == crc16Ccitt(reinterpret_cast<const uint8_t*>(&record), offsetof(HistoryRecord, crc));
+    }
+
+    static bool isErased(const HistoryRecord& record) {
+        const uint8_t* bytes = reinterpret_cast<const uint8_t*>(&record);
+        for (size_t i = 0; i < sizeof(record); i++) {
+            if (bytes[i] != 0xFF) return false;
+        }
+        return true;
+    }
+
+    void encode(const SensorReading& r, uint32_t sequence, HistoryRecord& record) const {
+        memset(&record, 0, sizeof(record));
+        record.magic = HISTORY_RECORD_MAGIC;
+        record.version = HISTORY_RECORD_VERSION;
+        record.length = sizeof(HistoryRecord);
+        record.flags = statusLevel(r);
+        record.sequence = sequence;
+        record.uptimeS = r.uptimeMs / 1000;
+        record.bootCount = bootCount;
+        record.phX100 = scaleToInt16(r.ph, 100.0f, r.phValid);
+        record.doConcX100 = scaleToInt16(r.doConc, 100.0f, r.doValid);
+        record.doSatX10 = scaleToInt16(r.doSat, 10.0f, r.doValid);
+        record.tempX100 = scaleToInt16(r.temp, 100.0f, r.doValid);
+        record.altitudeM = (int16_t)altitudeMeters;
+        record.correctionX10000 = (uint16_t)roundf(altitudeCorrection * 10000.0f);
+        record.crc = crc16Ccitt(reinterpret_cast<const uint8_t*>(&record), offsetof(HistoryRecord, crc));
+    }
+
+    void scan() {
+        uint32_t sectors = slots / RECORDS_PER_SECTOR;
+        bool found = false;
+        uint32_t headSector = 0;
+        uint32_t newestFirstSeq = 0;
+        HistoryRecord record;
+
+        // 1. Primer registro de cada sector: el de menor secuencia es el más
+        //    antiguo y el de mayor, el sector donde se está escribiendo
+        for (uint32_t sector = 0; sector < sectors; sector++) {
+            esp_partition_read(partition, sector * SPI_FLASH_SEC_SIZE, &record, sizeof(record));
+            if (!isValid(record)) continue;
+            if (!found || record.sequence < oldestSeq) {
+                oldestSeq = record.sequence;
+                oldestSlot = sector * RECORDS_PER_SECTOR;
+            }
+            if (!found || record.sequence > newestFirstSeq) {
+                newestFirstSeq = record.sequence;
+                headSector = sector;
+            }
+            found = true;
+        }
+
+        if (!found) {
+            // Registro vacío: se empieza por el sector 0
+            oldestSeq = nextSeq = 0;
+            oldestSlot = headSlot = 0;
+            bootCount = 0;
+            return;
+        }
+
+        // 2. Dentro del sector de cabeza, avanzar hasta el primer hueco
+        uint32_t used = 0;
+        uint16_t lastBoot = 0;
+        while (used < RECORDS_PER_SECTOR) {
+            esp_partition_read(partition, slotOffset(headSector * RECORDS_PER_SECTOR + used), &record, sizeof(record));
+            if (!isValid(record) || record.sequence != newestFirstSeq + used) break;
+            lastBoot = record.bootCount;
+            used++;
+        }
+
+        // Un hueco que no está borrado es una escritura interrumpida: se da el
+        // sector por lleno y se consumen sus secuencias para no romper el orden
+        if (used < RECORDS_PER_SECTOR && !isErased(record)) used = RECORDS_PER_SECTOR;
+
+        nextSeq = newestFirstSeq + used;
+        headSlot = (headSector * RECORDS_PER_SECTOR + used) % slots;
+        bootCount = lastBoot + 1;
+    }
+
+    const esp_partition_t* partition = nullptr;
+    SemaphoreHandle_t mutex = nullptr;
+    StaticSemaphore_t mutexBuffer;
+    uint32_t slots = 0;
+    uint32_t headSlot = 0;   // Próximo hueco a escribir
+    uint32_t oldestSlot = 0;
+    uint32_t nextSeq = 0;
+    uint32_t oldestSeq = 0;
+    uint16_t bootCount = 0;
+    uint32_t appends = 0;
+    uint32_t erases = 0;
+    uint32_t writeErrors = 0;
+};
+
+HistoryStore historyStore;
+
+// Envío masivo del histórico. Lo ejecuta la tarea de comandos entre comando y
+// comando: mete registros en el anillo TX mientras haya hueco y, cuando se
+// llena, espera a que txTask la avise al liberar espacio. Los registros viajan
+// en binario, uno tras otro, sin un JSON por registro.
+class HistorySync {
+  public:
+    // Prepara el envío a `session` de las secuencias posteriores a `since`
+    // (todas si < 0)
+    void start(Session& session, int64_t since, TaskHandle_t pumpTask, const CommandTag& tag) {
+        target = &session;
+        this->tag = tag;
+        targetConnId = session.connId;
+        uint32_t oldest = historyStore.oldestSequence();
+        next = (since < 0 || since + 1 < oldest) ? oldest : (uint32_t)(since + 1);
+        end = historyStore.nextSequence();
+        if (next > end) next = end;
+        first = next;
+        sent = skipped = 0;
+        startedUs = esp_timer_get_time();
+        active = true;
+        target->tx.setSpaceWaiter(pumpTask);
+        xTaskNotifyGive(pumpTask);
+    }
+
+    void abort() {
+        if (target != nullptr) target->tx.setSpaceWaiter(nullptr);
+        active = false;
+        target = nullptr;
+    }
+
+    bool isActive() const { return active; }
+    bool targets(const Session& session) const { return active && target == &session; }
+    uint32_t firstSequence() const { return first; }
+    uint32_t endSequence() const { return end; }
+
+    // Devuelve true si queda trabajo y hay hueco para seguir sin esperar
+    bool pump() {
+        if (!active) return false;
+        if (!target->active || target->connId != targetConnId) {
+            abort(); // Su central se ha desconectado
+            return false;
+        }
+
+        HistoryRecord record;
+        for (int i = 0; i < HISTORY_SYNC_BATCH && next < end; i++) {
+            if (target->tx.freeSpace() < sizeof(record)) return false; // Esperar a txTask
+            if (historyStore.read(next, record)) {
+                target->tx.sendRaw(reinterpret_cast<const uint8_t*>(&record), sizeof(record));
+                sent++;
+            } else {
+                skipped++;
+            }
+            next++;
+        }
+        if (next < end) return true;
+
+        if (sendSummary()) abort(); // Si no cabe, se reintenta al liberarse espacio
+        return false;
+    }
+
+  private:
+    bool sendSummary() {
+        PooledJsonDocument doc;
+        if (!doc) return false;
+        uint32_t elapsedUs = (uint32_t)(esp_timer_get_time() - startedUs);
+        (*doc)["type"] = "history_sync_response";
+        (*doc)["status"] = "success";
+        (*doc)["first"] = first;
+        (*doc)["last"] = end ? end - 1 : 0;
+        (*doc)["sent"] = sent;
+        (*doc)["skipped"] = skipped;
+        (*doc)["duration_ms"] = elapsedUs / 1000;
+        (*doc)["throughput_bps"] = elapsedUs ? (uint32_t)(sent * sizeof(HistoryRecord) * 1000000ULL / elapsedUs) : 0;
+        tag.apply(*doc);
+        return target->tx.sendJson(*doc);
+    }
+
+    bool active = false;
+    Session* target = nullptr;
+    CommandTag tag; // Para el "id" del resumen final
+    uint16_t targetConnId = 0;
+    uint32_t first = 0, next = 0, end = 0;
+    uint32_t sent = 0, skipped = 0;
+    int64_t startedUs = 0;
+};
+
+HistorySync historySync;
+
+
+// --- Actualización OTA en streaming ---
+// Solo la usa commandTask. El borrado va sector a sector con cada escritura
+// (OTA_WITH_SEQUENTIAL_WRITES), así ningún comando se bloquea segundos
+// borrando la partición entera. El estado vive en RAM: sobrevive a una
+// desconexión, no a un reinicio.
+static_assert(4 * ((OTA_CHUNK_MAX + 2) / 3) + 64 <= MAX_COMMAND_LENGTH, "Un trozo OTA debe caber en una línea");
+
+class OtaUpdater {
+  public:
+    enum State : uint8_t { OTA_IDLE, OTA_RECEIVING, OTA_READY };
+
+    // Empieza una imagen o, si es la misma que estaba a medias, la continúa.
+    // Devuelve nullptr o el texto del error.
+    const char* begin(uint32_t size, const uint8_t* sha256, bool& resumed) {
+        resumed = false;
+        if (state == OTA_RECEIVING && size == imageSize && memcmp(sha256, expected, sizeof(expected)) == 0) {
+            resumed = true;
+            resumes++;
+            return nullptr;
+        }
+        abort();
+
+        const esp_partition_t* next = esp_ota_get_next_update_partition(nullptr);
+        if (next == nullptr) return "No OTA partition available.";
+        if (size == 0 || size > next->size) return "Image does not fit in the OTA partition.";
+        if (esp_ota_begin(next, OTA_WITH_SEQUENTIAL_WRITES, &handle) != ESP_OK) return "esp_ota_begin failed.";
+
+        partition = next;
+        imageSize = size;
+        memcpy(expected, sha256, sizeof(expected));
+        written = 0;
+        mbedtls_sha256_init(&hash);
+        mbedtls_sha256_starts(&hash, 0);
+        startedMs = millis();
+        state = OTA_RECEIVING;
+        LOG_I("OTA: %u bytes hacia %s.", (unsigned)size, partition->label);
+        return nullptr;
+    }
+
+    // Solo se acepta el trozo que sigue a lo escrito: uno repetido o
+    // adelantado se rechaza y la app continúa desde offset()
+    const char* write(uint32_t offset, const uint8_t* data, size_t len) {
+        if (state != OTA_RECEIVING) return "No OTA in progress.";
+        if (offset != written) return "Unexpected offset.";
+        if (len > imageSize - written) return "Chunk past end of image.";
+        if (esp_ota_write(handle, data, len) != ESP_OK) {
+            abort();
+            return "Flash write failed.";
+        }
+        mbedtls_sha256_update(&hash, data, len);
+        written += len;
+        return nullptr;
+    }
+
+    // Comprueba tamaño y SHA-256, valida la imagen y la deja como arranque
+    const char* finish() {
+        if (state != OTA_RECEIVING) return "No OTA in progress.";
+        if (written != imageSize) return "Image incomplete.";
+
+        uint8_t digest[32];
+        mbedtls_sha256_finish(&hash, digest);
+        mbedtls_sha256_free(&hash);
+        state = OTA_IDLE;
+        if (memcmp(digest, expected, sizeof(digest)) != 0) {
+            esp_ota_abort(handle);
+            return "SHA-256 mismatch.";
+        }
+        if (esp_ota_end(handle) != ESP_OK) return "Image validation failed.";
+        if (esp_ota_set_boot_partition(partition) != ESP_OK) return "Could not set boot partition.";
+        state = OTA_READY;
+        durationMs = millis() - startedMs;
+        LOG_I("OTA: imagen verificada en %u ms.", (unsigned)durationMs);
+        return nullptr;
+    }
+
+    void abort() {
+        if (state == OTA_RECEIVING) {
+            esp_ota_abort(handle);
+            mbedtls_sha256_free(&hash);
+        }
+        state = OTA_IDLE;
+    }
+
+    State currentState() const { return state; }
+    uint32_t offset() const { return written; }
+    uint32_t size() const { return imageSize; }
+    uint32_t resumeCount() const { return resumes; }
+    uint32_t lastDurationMs() const { return durationMs; }
+    const char* partitionLabel() const { return partition ? partition->label : ""; }
+
+  private:
+    State state = OTA_IDLE;
+    esp_ota_handle_t handle = 0;
+    const esp_partition_t* partition = nullptr;
+    mbedtls_sha256_context hash;
+    uint8_t expected[32] = {};
+    uint32_t imageSize = 0, written = 0;
+    uint32_t startedMs = 0, durationMs = 0;
+    uint32_t resumes = 0;
+};
+
+OtaUpdater otaUpdater;
+
+// Lo programa "ota_end"; los ajustes pendientes se guardan antes de reiniciar
+void otaRebootJob() {
+    config.flush();
+    esp_restart();
+}
+
+// --- Publicación MQTT ---
+// esp-mqtt (incluido en el core) lleva la conexión en su propia tarea; la tarea
+// "mqtt" de aquí solo decide qué publicar y cuándo. Cada lote se publica con
+// QoS 1 y las lecturas no salen de la cola hasta que llega su PUBACK: si se
+// pierde la conexión a mitad, el lote se repite entero (al menos una vez).
+
+// Registro del histórico con el formato JSON de la telemetría
+static void historyRecordToJson(const HistoryRecord& record, JsonDocument& doc) {
+    auto scaled = [&doc](const char* key, int16_t value, float scale) {
+        if (value == INT16_MIN) doc[key] = nullptr; else doc[key] = value / scale;
+    };
+    scaled("ph", record.phX100, 100.0f);
+    scaled("do_conc", record.doConcX100, 100.0f);
+    scaled("do_sat", record.doSatX10, 10.0f);
+    scaled("temp", record.tempX100, 100.0f);
+
+    char timestamp[12];
+    snprintf(timestamp, sizeof(timestamp), "%02u:%02u:%02u", (unsigned)(record.uptimeS / 3600),
+             (unsigned)(record.uptimeS / 60 % 60), (unsigned)(record.uptimeS % 60));
+    doc["timestamp"] = timestamp;
+    doc["status"] = STATUS_TEXT[record.flags & 0x03];
+    doc["altitude_info"]["meters"] = record.altitudeM;
+    doc["altitude_info"]["correction_factor"] = record.correctionX10000 / 10000.0f;
+    doc["sequence"] = record.sequence;
+    doc["boot"] = record.bootCount;
+    doc["source"] = "history";
+}
+
+class MqttPublisher {
+  public:
+    void begin() {
+        snprintf(clientId, sizeof(clientId), "aquadata-esp32-%012llx", (unsigned long long)ESP.getEfuseMac());
+        esp_mqtt_client_config_t config = {};
+#if ESP_IDF_VERSION_MAJOR >= 5
+        config.broker.address.uri = MQTT_BROKER_URI;
+        config.credentials.client_id = clientId;
+        config.session.keepalive = MQTT_KEEPALIVE_S;
+        config.buffer.out_size = MQTT_PAYLOAD_SIZE + 64;
+#else
+        config.uri = MQTT_BROKER_URI;
+        config.client_id = clientId;
+        config.keepalive = MQTT_KEEPALIVE_S;
+        config.out_buffer_size = MQTT_PAYLOAD_SIZE + 64;
+#endif
+        client = esp_mqtt_client_init(&config);
+        esp_mqtt_client_register_event(client, MQTT_EVENT_ANY, onEvent, this);
+        SPAWN_TASK(taskEntry, "mqtt", MQTT_TASK_STACK, this, MQTT_TASK_PRIORITY, &task, MQTT_TASK_CORE, HEAP_ALLOWED);
+    }
+
+    // La cola solo se llena si hay una red configurada
+    void setEnabled(bool enabled) {
+        this->enabled = enabled;
+        wake();
+    }
+
+    // Productor (procTask): guarda la lectura para el próximo lote
+    void enqueue(const SensorReading& reading) {
+        if (!enabled) return;
+        outbox.push(reading); // Si está llena se cuenta en outbox.overflows()
+        uint32_t depth = outbox.depth();
+        if (depth == MQTT_BATCH_READINGS || (!connected && depth > MQTT_SPILL_THRESHOLD)) wake();
+    }
+
+    void wake() {
+        if (task) xTaskNotifyGive(task);
+    }
+
+    // Antes de begin(): publicar también lo guardado en el histórico desde
+    // `sequence` (el lote del ciclo de trabajo)
+    void replayFrom(uint32_t sequence) {
+        if (replayNext == replayEnd) replayNext = sequence;
+        replayPending = true;
+    }
+
+    // Nada pendiente de salir: ni lecturas, ni histórico, ni alertas sin PUBACK
+    bool idle() const {
+        if (!enabled) return true;
+        return outbox.depth() == 0 && !replayPending && replayNext == replayEnd &&
+               inflightId < 0 && pendingAlertCount() == 0;
+    }
+
+    // Alertas encoladas cuyo PUBACK aún puede llegar (las caducadas no cuentan)
+    uint32_t pendingAlertCount() const {
+        uint32_t now = millis(), count = 0;
+        for (const PendingAlert& slot : pendingAlerts) {
+            if (slot.msgId.load() >= 0 && now - slot.sinceMs.load() < MQTT_ACK_TIMEOUT_MS) count++;
+        }
+        return count;
+    }
+
+    // Cualquier tarea: la alerta va a la bandeja de esp-mqtt, que la envía en
+    // cuanto puede sin esperar al próximo lote (ni bloquear a quien la llama)
+    void publishAlert(const char* json, size_t len) {
+        if (!enabled) return;
+        int id = esp_mqtt_client_enqueue(client, MQTT_ALERT_TOPIC, json, len, MQTT_QOS, 0, true);
+        if (id < 0) {
+            alertErrors++;
+            return;
+        }
+        trackAlert(id);
+        alerts++;
+    }
+
+    // Benchmark: QoS 0 directo a la bandeja de esp-mqtt, sin pasar por los
+    // lotes. false si no hay conexión o la bandeja ya va cargada.
+    bool publishBench(const uint8_t* frame, size_t len) {
+        if (!connected) return false;
+#if ESP_IDF_VERSION_MAJOR >= 5
+        if (esp_mqtt_client_get_outbox_size(client) > MQTT_PAYLOAD_SIZE) return false;
+#endif
+        return esp_mqtt_client_enqueue(client, MQTT_BENCH_TOPIC, (const char*)frame, len, 0, 0, true) >= 0;
+    }
+
+    bool isConnected() const { return connected; }
+    uint32_t outboxDepth() const { return outbox.depth(); }
+    uint32_t outboxCapacity() const { return outbox.capacity(); }
+    uint32_t outboxOverflows() const { return outbox.overflows(); }
+    uint32_t backlog() const { return replayEnd - replayNext; }
+    bool backlogPending() const { return replayPending; }
+    uint32_t batchCount() const { return batches; }
+    uint32_t publishedCount() const { return published; }
+    uint32_t spilledCount() const { return spilled; }
+    uint32_t droppedCount() const { return dropped; }
+    uint32_t connectCount() const { return connects; }
+    uint32_t ackTimeoutCount() const { return ackTimeouts; }
+    uint32_t publishErrorCount() const { return publishErrors; }
+    uint32_t lastBatchBytes() const { return lastBytes; }
+    uint32_t alertCount() const { return alerts; }
+    uint32_t alertErrorCount() const { return alertErrors; }
+    uint32_t alertUntrackedCount() const { return alertsUntracked; }
+
+  private:
+    enum Source : uint8_t { FROM_OUTBOX, FROM_HISTORY };
+
+    static void taskEntry(void* context) {
+        static_cast<MqttPublisher*>(context)->run();
+    }
+
+    // Se ejecuta en la tarea de esp-mqtt: solo anota y despierta a la nuestra
+    static void onEvent(void* context, esp_event_base_t, int32_t id, void* data) {
+        MqttPublisher* self = static_cast<MqttPublisher*>(context);
+        esp_mqtt_event_handle_t event = static_cast<esp_mqtt_event_handle_t>(data);
+        switch (id) {
+            case MQTT_EVENT_CONNECTED:
+                self->connected = true;
+                self->connects++;
+                break;
+            case MQTT_EVENT_DISCONNECTED:
+                self->connected = false;
+                break;
+            case MQTT_EVENT_PUBLISHED:
+                // El PUBACK de una alerta no confirma el lote en vuelo
+                for (PendingAlert& slot : self->pendingAlerts) {
+                    int expected = event->msg_id;
+                    if (slot.msgId.compare_exchange_strong(expected, -1)) return;
+                }
+                self->ackedId.store(event->msg_id);
+                break;
+            default:
+                return;
+        }
+        self->wake();
+    }
+
+    // Ocupa un hueco libre o caducado. Si todos esperan todavía su PUBACK se
+    // sustituye el más antiguo: es el que antes habría caducado de todos modos.
+    void trackAlert(int id) {
+        uint32_t now = millis();
+        PendingAlert* oldest = &pendingAlerts[0];
+        for (PendingAlert& slot : pendingAlerts) {
+            int current = slot.msgId.load();
+            if (current < 0 || now - slot.sinceMs.load() >= MQTT_ACK_TIMEOUT_MS) {
+                slot.sinceMs.store(now);
+                if (slot.msgId.compare_exchange_strong(current, id)) return;
+                continue; // Otra tarea o su PUBACK se adelantó
+            }
+            if (now - slot.sinceMs.load() > now - oldest->sinceMs.load()) oldest = &slot;
+        }
+        oldest->sinceMs.store(now);
+        oldest->msgId.store(id);
+        alertsUntracked++;
+    }
+
+    void run() {
+        uint32_t waitMs = MQTT_BATCH_INTERVAL_MS;
+        for (;;) {
+            ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(waitMs));
+            int64_t started = esp_timer_get_time();
+            waitMs = step();
+            powerManager.noteWake(esp_timer_get_time() - started);
+        }
+    }
+
+    // Devuelve los ms hasta la próxima revisión
+    uint32_t step() {
+        if (!clientStarted && wifiLinkState.load() == WIFI_LINK_CONNECTED) {
+            esp_mqtt_client_start(client); // Reconecta solo a partir de aquí
+            clientStarted = true;
+        }
+        if (!connected) {
+            wasConnected = false;
+            spill();
+            return MQTT_BATCH_INTERVAL_MS;
+        }
+        if (!wasConnected) {
+            wasConnected = true;
+            inflightId = -1; // Lo que no se confirmó se repite
+            if (replayPending) {
+                replayEnd = historyStore.nextSequence();
+                replayPending = false;
+            }
+        }
+
+        for (;;) {
+            if (inflightId >= 0) {
+                uint32_t waited = millis() - inflightSinceMs;
+                if (ackedId.load() != inflightId) {
+                    if (waited < MQTT_ACK_TIMEOUT_MS) return MQTT_ACK_TIMEOUT_MS - waited;
+                    ackTimeouts++;
+                    inflightId = -1; // Reintentar el mismo lote
+                    continue;
+                }
+                complete();
+            }
+
+            bool sent;
+            if (replayNext != replayEnd) {
+                sent = publishHistory();
+            } else {
+                const SensorReading* oldest = outbox.peek(0);
+                if (oldest == nullptr) return MQTT_BATCH_INTERVAL_MS;
+                uint32_t age = millis() - oldest->uptimeMs;
+                if (outbox.depth() < MQTT_BATCH_READINGS && age < MQTT_BATCH_INTERVAL_MS) {
+                    return MQTT_BATCH_INTERVAL_MS - age;
+                }
+                sent = publishOutbox();
+            }
+            if (!sent) return MQTT_BATCH_INTERVAL_MS;
+        }
+    }
+
+    // Añade una línea JSON al lote; false si ya no cabe
+    bool appendLine(const JsonDocument& doc) {
+        size_t length = measureJson(doc);
+        if (payloadLen + length + 1 > sizeof(payload)) return false;
+        serializeJson(doc, payload + payloadLen, sizeof(payload) - payloadLen);
+        payloadLen += length;
+        payload[payloadLen++] = '\n';
+        return true;
+    }
+
+    bool publishOutbox() {
+        payloadLen = 0;
+        uint32_t count = 0;
+        while (const SensorReading* reading = outbox.peek(count)) {
+            PooledJsonDocument doc;
+            if (!doc) break;
+            encodeTelemetryJson(*reading, *doc);
+            if (!appendLine(*doc)) break;
+            count++;
+        }
+        return count > 0 && publish(FROM_OUTBOX, count);
+    }
+
+    bool publishHistory() {
+        payloadLen = 0;
+        uint32_t sequence = replayNext;
+        uint32_t count = 0;
+        HistoryRecord record;
+        while (sequence != replayEnd) {
+            if (historyStore.read(sequence, record)) {
+                PooledJsonDocument doc;
+                if (!doc) break;
+                historyRecordToJson(record, *doc);
+                if (!appendLine(*doc)) break;
+                count++;
+            }
+            sequence++; // Los registros ya sobrescritos se saltan
+        }
+        inflightReplayEnd = sequence;
+        if (count == 0) {
+            replayNext = sequence;
+            return sequence != replayEnd || outbox.depth() > 0;
+        }
+        return publish(FROM_HISTORY, count);
+    }
+
+    bool publish(Source source, uint32_t count) {
+        int id = esp_mqtt_client_publish(client, MQTT_TOPIC, payload, payloadLen, MQTT_QOS, 0);
+        if (id < 0) {
+            publishErrors++;
+            return false;
+        }
+        inflightId = id;
+        inflightSource = source;
+        inflightCount = count;
+        inflightSinceMs = millis();
+        lastBytes = payloadLen;
+        if (MQTT_QOS == 0) ackedId.store(id); // Sin PUBACK que esperar
+        return true;
+    }
+
+    void complete() {
+        if (inflightSource == FROM_OUTBOX) {
+            outbox.drop(inflightCount);
+        } else {
+            replayNext = inflightReplayEnd;
+        }
+        published += inflightCount;
+        batches++;
+        inflightId = -1;
+    }
+
+    // Sin conexión: lo que excede el umbral pasa al histórico para no perderlo
+    void spill() {
+        inflightId = -1;
+        while (outbox.depth() > MQTT_SPILL_THRESHOLD) {
+            const SensorReading* oldest = outbox.peek(0);
+            if (!replayPending) {
+                // Si quedaba un tramo a medias se amplía; si no, empieza aquí
+                if (replayNext == replayEnd) replayNext = historyStore.nextSequence();
+                replayPending = true;
+            }
+            if (historyStore.append(*oldest)) spilled++; else dropped++;
+            outbox.drop(1);
+        }
+    }
+
+    SpscRing<SensorReading, MQTT_OUTBOX_DEPTH> outbox;
+    esp_mqtt_client_handle_t client = nullptr;
+    TaskHandle_t task = nullptr;
+    char clientId[32];
+    char payload[MQTT_PAYLOAD_SIZE];
+    size_t payloadLen = 0;
+
+    volatile bool enabled = false;
+    volatile bool connected = false;
+    bool clientStarted = false;
+    bool wasConnected = false;
+
+    // Lote en vuelo
+    int inflightId = -1;
+    std::atomic<int> ackedId{-1};
+    Source inflightSource = FROM_OUTBOX;
+    uint32_t inflightCount = 0;
+    uint32_t inflightSinceMs = 0;
+    uint32_t inflightReplayEnd = 0;
+
+    // Tramo del histórico pendiente de publicar
+    bool replayPending = false;
+    uint32_t replayNext = 0, replayEnd = 0;
+
+    uint32_t batches = 0, published = 0, spilled = 0, dropped = 0;
+    uint32_t connects = 0, ackTimeouts = 0, publishErrors = 0, lastBytes = 0;
+    // msg_id de las alertas QoS 1 esperando PUBACK (-1 = hueco libre)
+    struct PendingAlert {
+        std::atomic<int> msgId{-1};
+        std::atomic<uint32_t> sinceMs{0};
+    };
+    PendingAlert pendingAlerts[MQTT_PENDING_ALERTS];
+    uint32_t alerts = 0, alertErrors = 0, alertsUntracked = 0;
+};
+
+MqttPublisher mqttPublisher;
+
+void mqttEnqueue(const SensorReading& reading) {
+    mqttPublisher.enqueue(reading);
+}
+
+void mqttPublishAlert(const char* payload, size_t len) {
+    mqttPublisher.publishAlert(payload, len);
+}
+
+// --- Ciclo de trabajo con deep sleep ---
+// El lote vive en RTC_NOINIT: sobrevive al deep sleep y a esp_restart(), y tras
+// un corte de alimentación el número mágico no coincide y se empieza de cero.
+// Como millis() vuelve a 0 en cada despertar, las lecturas del lote llevan el
+// reloj del ciclo (tiempo despierto más dormido), así el ritmo de cambio y las
+// marcas del histórico salen con el espaciado real.
+void dutyCycleJob();
+
+class DutyCycle {
+  public:
+    // Se llama con la configuración ya cargada. Devuelve true si este es un
+    // despertar rápido: solo una lectura y a dormir.
+    bool begin(const Settings& settings) {
+        if (state.magic != MAGIC || state.count > DUTY_BATCH_MAX) {
+            memset(&state, 0, sizeof(state));
+            state.magic = MAGIC;
+        }
+        period = std::max<uint32_t>(settings.dutyPeriodS, 1);
+        batch = std::min<uint8_t>(settings.dutyBatch, DUTY_BATCH_MAX);
+        for (int i = 0; i < ALERT_CHANNELS; i++) limits[i] = settings.alertLimits[i];
+
+        bool timerWake = esp_sleep_get_wakeup_cause() == ESP_SLEEP_WAKEUP_TIMER;
+        quick = settings.powerMode == POWER_DUTY_CYCLE && timerWake && !state.fullWakePending;
+        state.fullWakePending = false;
+        wakesAtBoot = state.quickWakes;
+        if (!quick) state.quickWakes = 0;
+        return quick;
+    }
+
+    bool sampling() const { return quick; }
+
+    // procTask, solo en un despertar rápido
+    void store(SensorReading reading) {
+        reading.uptimeMs = clockMs();
+        uint8_t outside = outsideLimits(reading);
+        // Un canal que ya despertó la red no vuelve a hacerlo hasta volver al rango
+        bool alert = (outside & ~state.outsideMask) != 0;
+        state.outsideMask = outside;
+        if (state.count < DUTY_BATCH_MAX) state.samples[state.count++] = reading;
+        if (alert || state.count >= batch) {
+            state.fullWakePending = true;
+            escalate = alert ? ESCALATE_ALERT : ESCALATE_BATCH;
+        }
+        done = true;
+    }
+
+    // Arranque completo, con el histórico ya abierto: pasa el lote al
+    // histórico y pide a MQTT que lo publique desde ahí
+    uint8_t flush() {
+        uint8_t count = state.count;
+        if (count == 0) return 0;
+        uint32_t first = historyStore.nextSequence();
+        for (uint8_t i = 0; i < count; i++) historyStore.append(state.samples[i]);
+        mqttPublisher.replayFrom(first);
+        state.count = 0;
+        flushed += count;
+        LOG_I("Ciclo de trabajo: %u lecturas del lote al histórico.", (unsigned)count);
+        return count;
+    }
+
+    // Apaga la radio y duerme hasta la próxima lectura, en fase con el periodo
+    void sleep() {
+        uint32_t awakeMs = millis();
+        uint32_t periodMs = period * 1000;
+        uint32_t sleepMs = periodMs - awakeMs % periodMs;
+        state.clockMs += awakeMs + sleepMs;
+        if (quick) state.quickWakes++;
+        if (!quick) {
+            WiFi.mode(WIFI_OFF);
+            btStop();
+        }
+        esp_sleep_enable_timer_wakeup((uint64_t)sleepMs * 1000);
+        esp_deep_sleep_start();
+    }
+
+    // Reinicia en un arranque completo (el lote y el aviso siguen en RTC)
+    void restartFull() {
+        state.clockMs += millis();
+        LOG_I("Ciclo de trabajo: arranque completo (%s).", escalate == ESCALATE_ALERT ? "alerta" : "lote lleno");
+        esp_restart();
+    }
+
+    bool sampleDone() const { return done; }
+    bool escalating() const { return escalate != ESCALATE_NONE; }
+    uint32_t clockMs() const { return state.clockMs + millis(); }
+    uint8_t pending() const { return state.count; }
+    uint32_t quickWakes() const { return quick ? state.quickWakes : wakesAtBoot; }
+    uint32_t flushedCount() const { return flushed; }
+    uint32_t periodS() const { return period; }
+    uint8_t batchSize() const { return batch; }
+
+  private:
+    static constexpr uint32_t MAGIC = 0x44555459; // "DUTY"
+    enum Escalation : uint8_t { ESCALATE_NONE, ESCALATE_BATCH, ESCALATE_ALERT };
+
+    struct State {
+        uint32_t magic;
+        uint32_t clockMs;       // Reloj del ciclo al empezar este despertar
+        uint32_t quickWakes;    // Desde el último arranque completo
+        uint8_t count;
+        uint8_t outsideMask;    // Canales fuera de límites en la última lectura
+        bool fullWakePending;   // Reinicio pedido por un despertar rápido
+        SensorReading samples[DUTY_BATCH_MAX];
+    };
+
+    // Mismos límites que AnomalyDetector, sin su estado: la media móvil no
+    // sobrevive al deep sleep, pero el umbral y el ritmo frente a la lectura
+    // anterior del lote sí se pueden juzgar
+    uint8_t outsideLimits(const SensorReading& r) const {
+        const float values[ALERT_CHANNELS] = {r.ph, r.doConc, r.doSat, r.temp};
+        const bool valid[ALERT_CHANNELS] = {r.phValid, r.doValid, r.doValid, r.doValid};
+        const SensorReading* last = state.count > 0 ? &state.samples[state.count - 1] : nullptr;
+        const bool lastValid[ALERT_CHANNELS] = {last && last->phValid, last && last->doValid,
+                                                last && last->doValid, last && last->doValid};
+        const float lastValues[ALERT_CHANNELS] = {last ? last->ph : 0.0f, last ? last->doConc : 0.0f,
+                                                  last ? last->doSat : 0.0f, last ? last->temp : 0.0f};
+        uint8_t mask = 0;
+        for (uint8_t i = 0; i < ALERT_CHANNELS; i++) {
+            if (!valid[i]) continue;
+            const AlertLimits& l = limits[i];
+            float x = values[i];
+            bool outside = (!std::isnan(l.min) && x < l.min) || (!std::isnan(l.max) && x > l.max);
+            if (lastValid[i] && l.ratePerMin > 0.0f && r.uptimeMs != last->uptimeMs) {
+                float rate = (x - lastValues[i]) * 60000.0f / (float)(r.uptimeMs - last->uptimeMs);
+                outside = outside || fabsf(rate) > l.ratePerMin;
+            }
+            if (outside) mask |= 1 << i;
+        }
+        return mask;
+    }
+
+    static State state;
+    AlertLimits limits[ALERT_CHANNELS] = {};
+    uint32_t period = DUTY_PERIOD_S;
+    uint8_t batch = DUTY_BATCH_SIZE;
+    bool quick = false;
+    volatile bool done = false;
+    volatile Escalation escalate = ESCALATE_NONE;
+    uint32_t wakesAtBoot = 0;
+    uint32_t flushed = 0;
+};
+
+RTC_NOINIT_ATTR DutyCycle::State DutyCycle::state;
+DutyCycle dutyCycle;
+
+bool dutyCycleSampling() {
+    return dutyCycle.sampling();
+}
+
+void dutyCycleStore(const SensorReading& reading) {
+    dutyCycle.store(reading);
+    scheduler.rearmOneShot("duty", 0, dutyCycleJob, 2);
+}
+
+// --- Benchmark de extremo a extremo ---
+// Generador de tramas sintéticas a ritmo fijo, en el trabajo "bench" de loop().
+// Cada pasada emite las tramas que ya tocan según el tiempo transcurrido; si el
+// anillo TX (o la bandeja MQTT) está lleno, la trama se reintenta en la pasada
+// siguiente con la misma secuencia, así que la app solo ve como pérdida lo que
+// se pierde después de encolar. El resumen final va siempre por BLE.
+//
+// Trama binaria v1 (ver src/lib/benchmark.ts), little-endian:
+//   0xA9, versión, longitud, flags, secuencia (u32), esp_timer en µs (u32),
+//   relleno, CRC-16/CCITT de todo lo anterior
+// En JSON: {"type":"bench","seq":N,"t_us":T,"pad":"xxx"} rellenado hasta `size`.
+void benchmarkJob();
+
+class BenchmarkRunner {
+  public:
+    enum Encoding : uint8_t { BENCH_JSON, BENCH_BINARY };
+    enum Transport : uint8_t { BENCH_BLE, BENCH_MQTT };
+
+    // commandTask. Devuelve nullptr o el texto del error.
+    const char* start(Session& session, Encoding encoding, Transport transport, uint32_t rateHz,
+                      uint32_t size, uint32_t durationS, const CommandTag& tag) {
+        if (running.load()) return "Benchmark already running.";
+        if (transport == BENCH_MQTT && !mqttPublisher.isConnected()) return "MQTT not connected.";
+        target = &session;
+        targetConnId = session.connId;
+        this->encoding = encoding;
+        this->transport = transport;
+        this->rateHz = rateHz;
+        this->size = size;
+        durationMs = durationS * 1000;
+        this->tag = tag;
+        sent = stalls = bytes = 0;
+        notificationsAtStart = session.tx.statistics().notifications;
+        startedMs = millis();
+        stopRequested.store(false);
+        running.store(true);
+        jobId = scheduler.addPeriodic("bench", BENCH_TICK_MS, benchmarkJob, 1);
+        if (jobId < 0) {
+            running.store(false);
+            return "No scheduler slot left.";
+        }
+        return nullptr;
+    }
+
+    // commandTask: la próxima pasada cierra con el resumen
+    void stop() { stopRequested.store(true); }
+
+    // loop()
+    void tick() {
+        if (!running.load()) return;
+        if (!target->active || target->connId != targetConnId) {
+            finish(false); // Su central se ha desconectado: nadie espera el resumen
+            return;
+        }
+
+        // Tramas que ya tocan: la 0 al empezar y así hasta `total`
+        uint32_t elapsed = millis() - startedMs;
+        bool stopping = stopRequested.load();
+        uint32_t total = (uint32_t)((uint64_t)durationMs * rateHz / 1000);
+        uint32_t due = stopping ? sent : (uint32_t)std::min<uint64_t>((uint64_t)elapsed * rateHz / 1000 + 1, total);
+        while (sent < due) {
+            if (!emit(sent, sent + 1 == total)) {
+                stalls++; // Anillo lleno: se reintenta en la próxima pasada
+                break;
+            }
+            sent++;
+        }
+        if (stopping || sent >= total || elapsed >= durationMs + BENCH_DRAIN_MS) finish(true);
+    }
+
+    bool isRunning() const { return running.load(); }
+
+  private:
+    bool emit(uint32_t sequence, bool last) {
+        uint8_t frame[BENCH_JSON_MAX_SIZE];
+        uint32_t nowUs = (uint32_t)esp_timer_get_time();
+        size_t len;
+        if (encoding == BENCH_BINARY) {
+            len = size;
+            frame[0] = BENCH_FRAME_MAGIC;
+            frame[1] = BENCH_FRAME_VERSION;
+            frame[2] = (uint8_t)len;
+            frame[3] = last ? 0x01 : 0x00;
+            memcpy(frame + 4, &sequence, sizeof(sequence));
+            memcpy(frame + 8, &nowUs, sizeof(nowUs));
+            memset(frame + 12, (uint8_t)sequence, len - 14);
+            uint16_t crc = crc16Ccitt(frame, len - 2);
+            memcpy(frame + len - 2, &crc, sizeof(crc));
+        } else {
+            // La línea sin relleno mide menos que BENCH_JSON_MIN_SIZE: siempre cabe
+            int base = snprintf((char*)frame, sizeof(frame), "{\"type\":\"bench\",\"seq\":%u,\"t_us\":%u,\"pad\":\"",
+                                (unsigned)sequence, (unsigned)nowUs);
+            size_t pad = size - base - 3; // Comillas, llave y '\n'
+            memset(frame + base, 'x', pad);
+            memcpy(frame + base + pad, "\"}\n", 3);
+            len = size;
+        }
+
+        bool queued = transport == BENCH_MQTT
+            ? mqttPublisher.publishBench(frame, len)
+            : target->tx.sendRaw(frame, len);
+        if (queued) bytes += len;
+        return queued;
+    }
+
+    void finish(bool report) {
+        scheduler.cancel(jobId);
+        running.store(false);
+        stopRequested.store(false);
+        if (!report) return;
+
+        PooledJsonDocument doc;
+        if (!doc) return;
+        (*doc)["type"] = "benchmark_response";
+        (*doc)["status"] = "success";
+        (*doc)["encoding"] = encoding == BENCH_BINARY ? "binary" : "json";
+        (*doc)["transport"] = transport == BENCH_MQTT ? "mqtt" : "ble";
+        (*doc)["rate_hz"] = rateHz;
+        (*doc)["size"] = size;
+        (*doc)["sent"] = sent;
+        (*doc)["bytes"] = bytes;
+        (*doc)["stalls"] = stalls;
+        (*doc)["duration_ms"] = millis() - startedMs;
+        (*doc)["mtu"] = target->tx.currentMtu();
+        (*doc)["conn_profile"] = linkManager.connName();
+        (*doc)["notifications"] = target->tx.statistics().notifications - notificationsAtStart;
+        tag.apply(*doc);
+        target->tx.sendJson(*doc);
+    }
+
+    std::atomic<bool> running{false};
+    std::atomic<bool> stopRequested{false};
+    Session* target = nullptr;
+    uint16_t targetConnId = 0;
+    Encoding encoding = BENCH_JSON;
+    Transport transport = BENCH_BLE;
+    uint32_t rateHz = 0, size = 0, durationMs = 0;
+    CommandTag tag; // Para el "id" del resumen final
+    int jobId = -1;
+    uint32_t startedMs = 0;
+    uint32_t sent = 0, stalls = 0, bytes = 0;
+    uint32_t notificationsAtStart = 0;
+};
+
+BenchmarkRunner benchmarkRunner;
+
+// --- Gestor de conexión WiFi ---
+// Nada bloquea fuera de la tarea "wifi": los handlers y los eventos del sistema
+// solo encolan. Cada cambio de estado se notifica a la app por BLE como
+// {"type":"wifi_status","wifi_status":...}, que use-ble.ts mezcla en la lectura.
+class WifiManager {
+  public:
+    enum State : uint8_t { WIFI_IDLE, WIFI_ASSOCIATING, WIFI_ONLINE, WIFI_BACKOFF, WIFI_FAILED };
+
+    void begin() {
+        instance = this;
+#if STATIC_ALLOCATION
+        static uint8_t queueStorage[WIFI_QUEUE_DEPTH * sizeof(Event)];
+        static StaticQueue_t queueBuffer;
+        queue = xQueueCreateStatic(WIFI_QUEUE_DEPTH, sizeof(Event), queueStorage, &queueBuffer);
+#else
+        queue = xQueueCreate(WIFI_QUEUE_DEPTH, sizeof(Event));
+#endif
+        WiFi.persistent(false); // Las credenciales ya se guardan en ConfigStore
+        WiFi.setAutoReconnect(false); // Los reintentos los lleva esta máquina
+        WiFi.onEvent(onSystemEvent);
+        SPAWN_TASK(taskEntry, "wifi", WIFI_TASK_STACK, this, WIFI_TASK_PRIORITY, &task, WIFI_TASK_CORE, HEAP_ALLOWED);
+    }
+
+    // Conectar con las credenciales guardadas en la configuración. Desde la app
+    // conectar; `tag` identifica el wifi_config que espera el resultado
+    void configure(bool fromApp, const CommandTag& tag = CommandTag()) {
+        post(Event{fromApp ? EV_PROVISION : EV_CONFIGURE, 0, 0, {}, tag});
+    }
+    void disconnect() { post(Event{EV_DISCONNECT, 0, 0, {}, {}}); }
+
+    State currentState() const { return state; }
+    uint32_t attemptCount() const { return attempts; }
+    uint32_t connectCount() const { return connects; }
+    uint32_t fastConnectCount() const { return fastConnects; }
+    uint32_t lastConnectMs() const { return lastConnectDurationMs; }
+    uint8_t lastReason() const { return lastDisconnectReason; }
+    uint32_t retryInMs() const {
+        return state == WIFI_BACKOFF ? (uint32_t)(deadlineMs - millis()) : 0;
+    }
+
+  private:
+    enum EventType : uint8_t { EV_CONFIGURE, EV_PROVISION, EV_DISCONNECT, EV_ASSOCIATED, EV_GOT_IP, EV_LOST };
+
+    struct Event {
+        EventType type;
+        uint8_t reason;
+        uint8_t channel;
+        uint8_t bssid[6];
+        CommandTag tag;  // Solo EV_PROVISION
+    };
+
+    void post(const Event& event) {
+        if (queue == nullptr || xQueueSend(queue, &event, 0) != pdTRUE) droppedEvents++;
+    }
+
+    // Tarea del sistema de eventos de Arduino: solo traduce y encola
+    static void onSystemEvent(arduino_event_id_t id, arduino_event_info_t info) {
+        Event event = {EV_LOST, 0, 0, {}, {}};
+        switch (id) {
+            case ARDUINO_EVENT_WIFI_STA_CONNECTED:
+                event.type = EV_ASSOCIATED;
+                event.channel = info.wifi_sta_connected.channel;
+                memcpy(event.bssid, info.wifi_sta_connected.bssid, sizeof(event.bssid));
+                break;
+            case ARDUINO_EVENT_WIFI_STA_GOT_IP:
+                event.type = EV_GOT_IP;
+                break;
+            case ARDUINO_EVENT_WIFI_STA_DISCONNECTED:
+                event.reason = info.wifi_sta_disconnected.reason;
+                break;
+            case ARDUINO_EVENT_WIFI_STA_LOST_IP:
+                break;
+            default:
+                return;
+        }
+        if (instance != nullptr) instance->post(event);
+    }
+
+    static void taskEntry(void* context) {
+        static_cast<WifiManager*>(context)->run();
+    }
+
+    void run() {
+        for (;;) {
+            TickType_t wait = portMAX_DELAY;
+            if (deadlineMs != 0) {
+                int32_t remaining = (int32_t)(deadlineMs - millis());
+                wait = remaining > 0 ? pdMS_TO_TICKS(remaining) : 0;
+            }
+            Event event;
+            if (xQueueReceive(queue, &event, wait) == pdTRUE) {
+                handle(event);
+            } else {
+                onDeadline();
+            }
+        }
+    }
+
+    void handle(const Event& event) {
+        switch (event.type) {
+            case EV_CONFIGURE:
+            case EV_PROVISION: {
+                Settings settings = config.get();
+                if (settings.wifiSsid[0] == '\0') return;
+                memcpy(ssid, settings.wifiSsid, sizeof(ssid));
+                memcpy(password, settings.wifiPassword, sizeof(password));
+                memcpy(cachedBssid, settings.wifiBssid, sizeof(cachedBssid));
+                cachedChannel = settings.wifiChannel;
+                // Un wifi_config anterior sin resultado no se queda esperando
+                if (provisioning) sendConfigResult("error", "Superseded by a newer wifi_config.");
+                provisioning = event.type == EV_PROVISION;
+                provisionTag = event.tag;
+                sequenceAttempts = 0;
+                authFailures = 0;
+                backoffMs = WIFI_BACKOFF_MIN_MS;
+                mqttPublisher.setEnabled(true);
+                WiFi.mode(WIFI_STA);
+                connect();
+                break;
+            }
+            case EV_DISCONNECT:
+                enter(WIFI_IDLE);
+                WiFi.disconnect();
+                break;
+            case EV_ASSOCIATED:
+                if (state != WIFI_ASSOCIATING) return;
+                memcpy(associatedBssid, event.bssid, sizeof(associatedBssid));
+                associatedChannel = event.channel;
+                break;
+            case EV_GOT_IP:
+                if (state != WIFI_ASSOCIATING) return;
+                onOnline();
+                break;
+            case EV_LOST:
+                lastDisconnectReason = event.reason;
+                if (state == WIFI_ONLINE) {
+                    // Caída con la red conocida: reintento inmediato, rápido
+                    LOG_W("⚠️ WiFi desconectado (motivo %u), reintentando...", (unsigned)event.reason);
+                    sequenceAttempts = 0;
+                    backoffMs = WIFI_BACKOFF_MIN_MS;
+                    connect();
+                } else if (state == WIFI_ASSOCIATING && event.reason != WIFI_REASON_ASSOC_LEAVE) {
+                    // ASSOC_LEAVE es la desconexión que provoca el propio WiFi.begin()
+                    attemptFailed(event.reason);
+                }
+                break;
+        }
+    }
+
+    void onDeadline() {
+        deadlineMs = 0;
+        if (state == WIFI_ASSOCIATING) {
+            WiFi.disconnect(); // Su evento llega ya en WIFI_BACKOFF y se ignora
+            attemptFailed(0);
+        } else if (state == WIFI_BACKOFF) {
+            connect();
+        }
+    }
+
+    void connect() {
+        // Con BSSID y canal conocidos se salta el escaneo de todos los canales
+        fastAttempt = cachedChannel != 0;
+        if (fastAttempt) {
+            WiFi.begin(ssid, password, cachedChannel, cachedBssid);
+        } else {
+            WiFi.begin(ssid, password);
+        }
+        attempts++;
+        sequenceAttempts++;
+        attemptStartedMs = millis();
+        enter(WIFI_ASSOCIATING);
+        deadlineMs = attemptStartedMs + WIFI_CONNECT_TIMEOUT_MS;
+    }
+
+    void onOnline() {
+        lastConnectDurationMs = millis() - attemptStartedMs;
+        connects++;
+        if (fastAttempt) fastConnects++;
+        backoffMs = WIFI_BACKOFF_MIN_MS;
+        sequenceAttempts = 0;
+        authFailures = 0;
 
-// Clase para manejar los eventos de conexión/desconexión del servidor BLE
-class MyServerCallbacks: public BLEServerCallbacks {
-    void onConnect(BLEServer* pServer) {
-      deviceConnected = true;
-      Serial.println("Device Connected");
+        // Guardar el punto de acceso para la próxima reconexión (solo si cambió)
+        if (associatedChannel != cachedChannel || memcmp(associatedBssid, cachedBssid, sizeof(cachedBssid)) != 0) {
+            memcpy(cachedBssid, associatedBssid, sizeof(cachedBssid));
+            cachedChannel = associatedChannel;
+            config.update([this](Settings& s) {
+                memcpy(s.wifiBssid, cachedBssid, sizeof(s.wifiBssid));
+                s.wifiChannel = cachedChannel;
+            });
+        }
+
+        enter(WIFI_ONLINE);
+        LOG_I("✅ WiFi conectado en %u ms%s.", (unsigned)lastConnectDurationMs, fastAttempt ? " (sin escaneo)" : "");
+        if (provisioning) {
+            char message[72];
+            snprintf(message, sizeof(message), "Successfully connected to %s", ssid);
+            sendConfigResult("success", message);
+        }
+        mqttPublisher.wake();
+    }
+
+    void attemptFailed(uint8_t reason) {
+        if (fastAttempt) {
+            // El punto de acceso guardado ya no sirve: siguiente intento con escaneo
+            cachedChannel = 0;
+            if (reason != WIFI_REASON_AUTH_FAIL) {
+                connect();
+                return;
+            }
+        }
+
+        bool authError = reason == WIFI_REASON_AUTH_FAIL || reason == WIFI_REASON_AUTH_EXPIRE ||
+                         reason == WIFI_REASON_4WAY_HANDSHAKE_TIMEOUT || reason == WIFI_REASON_HANDSHAKE_TIMEOUT;
+        authFailures = authError ? authFailures + 1 : 0;
+        if (authFailures >= WIFI_AUTH_FAIL_LIMIT) {
+            // Contraseña casi seguro incorrecta: no insistir hasta recibir otra
+            WiFi.disconnect();
+            enter(WIFI_FAILED);
+            char message[80];
+            snprintf(message, sizeof(message), "Failed to connect to %s. Check credentials.", ssid);
+            if (provisioning) sendConfigResult("error", message);
+            return;
+        }
+
+        if (provisioning && sequenceAttempts >= WIFI_PROVISION_ATTEMPTS) {
+            char message[80];
+            snprintf(message, sizeof(message), "Failed to connect to %s. Still retrying.", ssid);
+            sendConfigResult("error", message);
+        }
+
+        // Espera exponencial con algo de dispersión
+        uint32_t delayMs = backoffMs + random(backoffMs / 4 + 1);
+        backoffMs = std::min<uint32_t>(backoffMs * 2, WIFI_BACKOFF_MAX_MS);
+        deadlineMs = millis() + delayMs;
+        enter(WIFI_BACKOFF);
     }
 
-    void onDisconnect(BLEServer* pServer) {
-      deviceConnected = false;
-      Serial.println("Device Disconnected");
-      // Reiniciar la publicidad para que se pueda volver a conectar
-      pServer->getAdvertising()->start();
+    void enter(State next) {
+        if (next != WIFI_ASSOCIATING && next != WIFI_BACKOFF) deadlineMs = 0;
+        if (next == state && next != WIFI_ASSOCIATING) return;
+        state = next;
+        wifiLinkState = next == WIFI_ONLINE ? WIFI_LINK_CONNECTED
+                      : (next == WIFI_ASSOCIATING || next == WIFI_BACKOFF) ? WIFI_LINK_CONNECTING
+                      : WIFI_LINK_DISCONNECTED;
+        sendStatus();
     }
+
+    void sendStatus() {
+        PooledJsonDocument doc;
+        if (!doc) return;
+        (*doc)["type"] = "wifi_status";
+        (*doc)["wifi_status"] = WIFI_STATUS_TEXT[wifiLinkState.load()];
+        (*doc)["ssid"] = (const char*)ssid;
+        if (state == WIFI_ONLINE) {
+            (*doc)["connect_ms"] = lastConnectDurationMs;
+            (*doc)["rssi"] = WiFi.RSSI();
+        } else {
+            (*doc)["attempt"] = attempts;
+            (*doc)["reason"] = lastDisconnectReason;
+        }
+        if (state == WIFI_BACKOFF) (*doc)["retry_in_ms"] = retryInMs();
+        if (state == WIFI_FAILED) (*doc)["failed"] = true;
+        sessions.broadcastJson(*doc);
+    }
+
+    // Resultado diferido de "wifi_config" (solo uno por configuración)
+    void sendConfigResult(const char* status, const char* message) {
+        provisioning = false;
+        PooledJsonDocument doc;
+        if (!doc) return;
+        (*doc)["type"] = "wifi_config_response";
+        (*doc)["status"] = status;
+        (*doc)["message"] = message;
+        provisionTag.apply(*doc);
+        sessions.broadcastJson(*doc);
+    }
+
+    static WifiManager* instance;
+    QueueHandle_t queue = nullptr;
+    TaskHandle_t task = nullptr;
+    volatile State state = WIFI_IDLE;
+    char ssid[33] = "";
+    char password[65] = "";
+    uint8_t cachedBssid[6] = {};
+    uint8_t cachedChannel = 0;
+    uint8_t associatedBssid[6] = {};
+    uint8_t associatedChannel = 0;
+    bool fastAttempt = false;
+    bool provisioning = false;
+    CommandTag provisionTag;
+    uint32_t deadlineMs = 0;   // 0 = sin plazo pendiente
+    uint32_t attemptStartedMs = 0;
+    uint32_t backoffMs = WIFI_BACKOFF_MIN_MS;
+    uint32_t sequenceAttempts = 0;
+    uint32_t authFailures = 0;
+    uint8_t lastDisconnectReason = 0;
+    uint32_t attempts = 0, connects = 0, fastConnects = 0, droppedEvents = 0;
+    uint32_t lastConnectDurationMs = 0;
 };
 
-// Función para enviar una respuesta JSON a la app
-void sendJsonResponse(const JsonDocument& doc) {
-    if (deviceConnected) {
-        String jsonString;
-        serializeJson(doc, jsonString);
-        jsonString += "\n"; // Asegurarse de que termina con un salto de línea
-        pTxCharacteristic->setValue((uint8_t*)jsonString.c_str(), jsonString.length());
-        pTxCharacteristic->notify();
-        Serial.print("Respuesta enviada: ");
-        Serial.println(jsonString);
+WifiManager* WifiManager::instance = nullptr;
+WifiManager wifiManagerInstance;
+
+// --- Handlers de comandos ---
+// Cada handler rellena `response`; processCommand() se encarga de enviarla.
+
+COMMAND_HANDLER("wifi_config", handleWifiConfig) {
+    const char* ssid = request["ssid"] | "";
+    const char* password = request["password"] | "";
+    response["type"] = "wifi_config_response";
+    if (ssid[0] == '\0' || strlen(ssid) >= sizeof(Settings::wifiSsid) ||
+        strlen(password) >= sizeof(Settings::wifiPassword)) {
+        response["status"] = "error";
+        response["message"] = "Invalid SSID or password length.";
+        return;
     }
+    if (!bootTimeline.reached(BOOT_NETWORK)) {
+        // La tarea "wifi" aún no existe: el resultado diferido nunca llegaría
+        response["status"] = "error";
+        response["message"] = "Device is still starting, try again.";
+        return;
+    }
+    LOG_I("Configurando WiFi para SSID: %s", ssid);
+
+    config.update([ssid, password](Settings& s) {
+        if (strcmp(s.wifiSsid, ssid) != 0) {
+            memset(s.wifiBssid, 0, sizeof(s.wifiBssid)); // Otra red: olvidar el punto de acceso
+            s.wifiChannel = 0;
+        }
+        strlcpy(s.wifiSsid, ssid, sizeof(s.wifiSsid));
+        strlcpy(s.wifiPassword, password, sizeof(s.wifiPassword));
+    });
+
+    // La conexión sigue en la tarea "wifi"; el resultado llega en otro
+    // wifi_config_response y el progreso en mensajes "wifi_status"
+    wifiManagerInstance.configure(true, currentCommand);
+
+    char message[64];
+    snprintf(message, sizeof(message), "Attempting to connect to %s...", ssid);
+    response["status"] = "info";
+    response["message"] = message;
 }
 
+COMMAND_HANDLER("wifi_disconnect", handleWifiDisconnect) {
+    response["type"] = "wifi_disconnect_response";
+    if (!bootTimeline.reached(BOOT_NETWORK)) {
+        response["status"] = "error";
+        response["message"] = "Device is still starting, try again.";
+        return;
+    }
+    wifiManagerInstance.disconnect();
+    response["status"] = "success";
+    response["message"] = "WiFi disconnected.";
+}
 
-// Clase para manejar las escrituras en la característica RX
-class MyCallbacks: public BLECharacteristicCallbacks {
-    void onWrite(BLECharacteristic *pCharacteristic) {
-        std::string value = pCharacteristic->getValue();
-        rxBuffer += String(value.c_str());
-
-        // Procesar solo cuando se recibe un salto de línea
-        if (rxBuffer.endsWith("\n")) {
-            rxBuffer.trim(); // Limpiar espacios en blanco
-            Serial.print("Comando JSON recibido: ");
-            Serial.println(rxBuffer);
-
-            JsonDocument doc;
-            DeserializationError error = deserializeJson(doc, rxBuffer);
-            
-            rxBuffer = ""; // Limpiar buffer después de procesar
-
-            JsonDocument responseDoc;
-            if (error) {
-                Serial.print("deserializeJson() failed: ");
-                Serial.println(error.c_str());
-                responseDoc["type"] = "command_response";
-                responseDoc["status"] = "error";
-                responseDoc["message"] = "Invalid JSON format.";
-                sendJsonResponse(responseDoc);
-                return;
+COMMAND_HANDLER("get_wifi_status", handleGetWifiStatus) {
+    static const char* const STATE_NAMES[] = {"idle", "associating", "online", "backoff", "failed"};
+    response["type"] = "wifi_status_response";
+    response["status"] = "success";
+    response["wifi_status"] = WIFI_STATUS_TEXT[wifiLinkState.load()];
+    response["state"] = STATE_NAMES[wifiManagerInstance.currentState()];
+    response["ssid"] = (const char*)config.get().wifiSsid;
+    if (wifiLinkState.load() == WIFI_LINK_CONNECTED) response["rssi"] = WiFi.RSSI();
+    response["attempts"] = wifiManagerInstance.attemptCount();
+    response["connects"] = wifiManagerInstance.connectCount();
+    response["fast_connects"] = wifiManagerInstance.fastConnectCount();
+    response["last_connect_ms"] = wifiManagerInstance.lastConnectMs();
+    response["last_reason"] = wifiManagerInstance.lastReason();
+    response["retry_in_ms"] = wifiManagerInstance.retryInMs();
+}
+
+COMMAND_HANDLER("set_altitude", handleSetAltitude) {
+    response["type"] = "altitude_set_response";
+    if (request.containsKey("value") && request["value"].is<int>()) {
+        int altitude = request["value"].as<int>();
+        LOG_I("Ajustando altitud a: %d metros.", altitude);
+
+        // Solo RAM; la escritura en flash se agrupa con los cambios siguientes
+        applyAltitude(altitude);
+        config.update([altitude](Settings& s) { s.altitudeM = altitude; });
+        calibration.rebuild(); // La solubilidad del OD depende de la presión
+        telemetryKeyframePending = true; // altitude_info solo va en las completas
+
+        char message[48];
+        snprintf(message, sizeof(message), "Altitud actualizada a %dm.", altitude);
+        response["status"] = "success";
+        response["message"] = message; // char[] no constante: ArduinoJson lo copia
+    } else {
+        response["status"] = "error";
+        response["message"] = "Valor de altitud no válido o no proporcionado.";
+    }
+}
+
+// {"type":"set_salinity","value":35.0} en PSU (0 = agua dulce)
+COMMAND_HANDLER("set_salinity", handleSetSalinity) {
+    response["type"] = "salinity_set_response";
+    float value = request["value"] | -1.0f;
+    if (value < 0.0f || value > 45.0f) {
+        response["status"] = "error";
+        response["message"] = "Salinity must be between 0 and 45 PSU.";
+        return;
+    }
+    calibration.setSalinity(value);
+    response["status"] = "success";
+    response["salinity"] = value;
+}
+
+static void calibrationToJson(JsonDocument& response) {
+    JsonArray points = response["points"].to<JsonArray>();
+    for (size_t i = 0; i < calibration.phPointTotal(); i++) {
+        JsonObject point = points.add<JsonObject>();
+        point["ph"] = calibration.phPoint(i).ph;
+        point["mv"] = calibration.phPoint(i).mv25;
+    }
+    response["slope_percent"] = calibration.slopePercent();
+    response["offset_mv"] = calibration.offsetMv();
+}
+
+// {"type":"calibrate_ph","buffer":7.0} toma el potencial actual como ese
+// tampón; {"type":"calibrate_ph","clear":true} vuelve al electrodo ideal.
+COMMAND_HANDLER("calibrate_ph", handleCalibratePh) {
+    response["type"] = "ph_calibration_response";
+    if (request["clear"] | false) {
+        calibration.clearPh();
+    } else {
+        float buffer = request["buffer"] | 0.0f;
+        SensorReading reading = readingSnapshot();
+        const char* error = nullptr;
+        if (buffer < 1.0f || buffer > 13.0f) {
+            error = "Buffer pH must be between 1 and 13.";
+        } else if (!reading.phValid || reading.readingsPh == 0) {
+            error = "No valid pH reading to calibrate against.";
+        } else {
+            error = calibration.addPhPoint(buffer, reading.phMv);
+        }
+        if (error) {
+            response["status"] = "error";
+            response["message"] = error;
+            return;
+        }
+    }
+    response["status"] = "success";
+    calibrationToJson(response);
+}
+
+COMMAND_HANDLER("get_calibration", handleGetCalibration) {
+    response["type"] = "calibration_response";
+    response["status"] = "success";
+    calibrationToJson(response);
+    SensorReading reading = readingSnapshot();
+    response["salinity"] = calibration.salinityPsu();
+    response["pressure_atm"] = altitudeCorrection;
+    response["do_solubility_mg_l"] = q16ToFloat(calibration.doSolubility(floatToQ16(reading.doValid ? reading.temp : 25.0f)));
+    response["rebuilds"] = calibration.rebuildCount();
+}
+
+// {"type":"set_telemetry_mode","mode":"binary"|"json"|"alerts"}
+COMMAND_HANDLER("set_telemetry_mode", handleSetTelemetryMode) {
+    const char* mode = request["mode"] | "";
+    response["type"] = "telemetry_mode_response";
+    if (strcmp(mode, "binary") == 0) {
+        currentSession->telemetryMode = TELEMETRY_BINARY;
+    } else if (strcmp(mode, "json") == 0) {
+        currentSession->telemetryMode = TELEMETRY_JSON;
+    } else if (strcmp(mode, "alerts") == 0) {
+        currentSession->telemetryMode = TELEMETRY_ALERTS_ONLY; // Sin telemetría, solo "alert"
+    } else {
+        response["status"] = "error";
+        response["message"] = "Unknown telemetry mode.";
+        return;
+    }
+    telemetryKeyframePending = true; // Empezar el formato nuevo con una lectura completa
+    response["status"] = "success";
+    response["mode"] = mode;
+    response["frame_version"] = TELEMETRY_FRAME_VERSION;
+    response["frame_size"] = sizeof(TelemetryFrame);
+}
+
+// {"type":"set_rx_flow","enabled":true}: a partir de aquí la sesión recibe
+// "rx_credit" y puede escribir en RX sin respuesta dentro de su ventana
+COMMAND_HANDLER("set_rx_flow", handleSetRxFlow) {
+    currentSession->rxFlow = request["enabled"] | true;
+    response["type"] = "rx_flow_response";
+    response["status"] = "success";
+    response["enabled"] = currentSession->rxFlow.load();
+    response["window"] = RX_CREDIT_WINDOW;
+    response["max_line"] = MAX_COMMAND_LENGTH;
+    response["mtu"] = currentSession->tx.currentMtu(); // Cada escritura sin respuesta cabe en MTU - 3
+    // Esta línea aún no cuenta: sale de la cola al terminar el handler
+    response["acked"] = currentSession->rxAcked();
+    // Lo descartado antes ya se avisó como error; a partir de aquí va en rx_credit
+    currentSession->rxDropReported = currentSession->rxDropped.load();
+    response["dropped"] = currentSession->rxDropReported;
+}
+
+static void telemetryDeadbandToJson(JsonDocument& response) {
+    JsonObject deadband = response["deadband"].to<JsonObject>();
+    deadband["ph"] = deltaTelemetry.deadbandFor(0);
+    deadband["do_conc"] = deltaTelemetry.deadbandFor(1);
+    deadband["do_sat"] = deltaTelemetry.deadbandFor(2);
+    deadband["temp"] = deltaTelemetry.deadbandFor(3);
+    response["keyframe_s"] = deltaTelemetry.keyframePeriodMs() / 1000;
+    response["keyframes"] = deltaTelemetry.keyframeCount();
+    response["deltas"] = deltaTelemetry.deltaCount();
+    response["suppressed"] = deltaTelemetry.suppressedCount();
+}
+
+// {"type":"set_telemetry_deadband","ph":0.02,"do_conc":0.05,"do_sat":0.5,
+//  "temp":0.1,"keyframe_s":60}; todos opcionales, 0 = enviar cualquier cambio
+COMMAND_HANDLER("set_telemetry_deadband", handleSetTelemetryDeadband) {
+    response["type"] = "telemetry_deadband_response";
+    Settings settings = config.get();
+    float* targets[] = {&settings.deadbandPh, &settings.deadbandDoConc, &settings.deadbandDoSat, &settings.deadbandTemp};
+    static const char* const keys[] = {"ph", "do_conc", "do_sat", "temp"};
+    for (int i = 0; i < 4; i++) {
+        if (request[keys[i]].isNull()) continue;
+        float value = request[keys[i]] | -1.0f;
+        if (value < 0.0f || value > 100.0f) {
+            response["status"] = "error";
+            response["message"] = "Invalid deadband.";
+            return;
+        }
+        *targets[i] = value;
+    }
+    if (!request["keyframe_s"].isNull()) {
+        int keyframeS = request["keyframe_s"] | -1;
+        if (keyframeS < 0 || keyframeS > 3600) {
+            response["status"] = "error";
+            response["message"] = "keyframe_s must be between 0 and 3600.";
+            return;
+        }
+        settings.keyframeS = keyframeS;
+    }
+
+    config.update([&settings](Settings& s) {
+        s.deadbandPh = settings.deadbandPh;
+        s.deadbandDoConc = settings.deadbandDoConc;
+        s.deadbandDoSat = settings.deadbandDoSat;
+        s.deadbandTemp = settings.deadbandTemp;
+        s.keyframeS = settings.keyframeS;
+    });
+    deltaTelemetry.configure(settings);
+    response["status"] = "success";
+    telemetryDeadbandToJson(response);
+}
+
+COMMAND_HANDLER("get_telemetry_stats", handleGetTelemetryStats) {
+    response["type"] = "telemetry_stats_response";
+    response["status"] = "success";
+    telemetryDeadbandToJson(response);
+}
+
+static void alertConfigToJson(JsonDocument& response) {
+    JsonObject channels = response["channels"].to<JsonObject>();
+    for (uint8_t i = 0; i < ALERT_CHANNELS; i++) {
+        const AlertLimits& l = anomalyDetector.limitsFor(i);
+        JsonObject channel = channels[ALERT_CHANNEL_NAMES[i]].to<JsonObject>();
+        if (std::isnan(l.min)) channel["min"] = "off"; else channel["min"] = l.min;
+        if (std::isnan(l.max)) channel["max"] = "off"; else channel["max"] = l.max;
+        channel["rate_per_min"] = l.ratePerMin;
+        channel["z"] = l.zLimit;
+        channel["mean"] = anomalyDetector.meanFor(i);
+        channel["sigma"] = anomalyDetector.sigmaFor(i);
+        channel["warmed_up"] = anomalyDetector.warmedUp(i);
+        JsonArray active = channel["active"].to<JsonArray>();
+        for (uint8_t kind = 0; kind < ALERT_LEVEL_KINDS; kind++) {
+            if (anomalyDetector.isActive(i, (AlertKind)kind)) active.add(ALERT_KIND_NAMES[kind]);
+        }
+    }
+    response["raised"] = anomalyDetector.raisedCount();
+    response["cleared"] = anomalyDetector.clearedCount();
+    response["events"] = anomalyDetector.eventCount();
+    response["suppressed"] = anomalyDetector.suppressedCount();
+    response["last_seq"] = anomalyDetector.alertSequence();
+}
+
+// {"type":"set_alert_config","channel":"ph","min":6.0,"max":9.0,
+//  "rate_per_min":1.0,"z":4.0}; todos opcionales salvo el canal.
+// "min"/"max" a "off" desactivan el umbral; rate_per_min o z a 0, su aviso.
+COMMAND_HANDLER("set_alert_config", handleSetAlertConfig) {
+    response["type"] = "alert_config_response";
+    const char* name = request["channel"] | "";
+    int channel = -1;
+    for (int i = 0; i < ALERT_CHANNELS; i++) {
+        if (strcmp(name, ALERT_CHANNEL_NAMES[i]) == 0) channel = i;
+    }
+    if (channel < 0) {
+        response["status"] = "error";
+        response["message"] = "Unknown alert channel.";
+        return;
+    }
+
+    Settings settings = config.get();
+    AlertLimits limits = settings.alertLimits[channel];
+    float* thresholds[] = {&limits.min, &limits.max};
+    static const char* const thresholdKeys[] = {"min", "max"};
+    for (int i = 0; i < 2; i++) {
+        JsonVariantConst value = request[thresholdKeys[i]];
+        if (value.isNull()) continue;
+        if (value.is<const char*>() && strcmp(value.as<const char*>(), "off") == 0) {
+            *thresholds[i] = NAN;
+        } else if (value.is<float>()) {
+            *thresholds[i] = value.as<float>();
+        } else {
+            response["status"] = "error";
+            response["message"] = "min and max must be numbers or \"off\".";
+            return;
+        }
+    }
+    float* factors[] = {&limits.ratePerMin, &limits.zLimit};
+    static const char* const factorKeys[] = {"rate_per_min", "z"};
+    for (int i = 0; i < 2; i++) {
+        if (request[factorKeys[i]].isNull()) continue;
+        float value = request[factorKeys[i]] | -1.0f;
+        if (value < 0.0f || value > 1000.0f) {
+            response["status"] = "error";
+            response["message"] = "rate_per_min and z must be between 0 and 1000.";
+            return;
+        }
+        *factors[i] = value;
+    }
+    if (!std::isnan(limits.min) && !std::isnan(limits.max) && limits.min >= limits.max) {
+        response["status"] = "error";
+        response["message"] = "min must be below max.";
+        return;
+    }
+
+    settings.alertLimits[channel] = limits;
+    config.update([channel, &limits](Settings& s) { s.alertLimits[channel] = limits; });
+    anomalyDetector.configure(settings);
+    response["status"] = "success";
+    alertConfigToJson(response);
+}
+
+// Límites, línea base y alertas activas de cada canal
+COMMAND_HANDLER("get_alerts", handleGetAlerts) {
+    response["type"] = "alerts_response";
+    response["status"] = "success";
+    alertConfigToJson(response);
+}
+
+// {"type":"history_sync","since":1234} envía en binario los registros con
+// secuencia mayor que `since` (todos si se omite) y termina con un
+// "history_sync_response".
+COMMAND_HANDLER("history_sync", handleHistorySync) {
+    response["type"] = "history_sync_response";
+    if (!historyStore.available()) {
+        response["status"] = "error";
+        response["message"] = "History storage not available.";
+        return;
+    }
+    if (historySync.isActive()) {
+        response["status"] = "error";
+        response["message"] = "History sync already in progress.";
+        return;
+    }
+
+    int64_t since = request["since"].is<unsigned int>() ? (int64_t)request["since"].as<unsigned int>() : -1;
+    historySync.start(*currentSession, since, xTaskGetCurrentTaskHandle(), currentCommand);
+    response["status"] = "started";
+    response["first"] = historySync.firstSequence();
+    response["count"] = historySync.endSequence() - historySync.firstSequence();
+}
+
+// {"type":"start_benchmark","encoding":"json"|"binary","transport":"ble"|"mqtt",
+//  "rate_hz":50,"size":100,"duration_s":10}
+// Responde "started" y, al terminar, otro "benchmark_response" con el resumen.
+// Los campos que faltan toman los valores del ejemplo.
+COMMAND_HANDLER("start_benchmark", handleStartBenchmark) {
+    response["type"] = "benchmark_response";
+    const char* encodingName = request["encoding"] | "json";
+    const char* transportName = request["transport"] | "ble";
+    bool binary = strcmp(encodingName, "binary") == 0;
+    bool mqtt = strcmp(transportName, "mqtt") == 0;
+    uint32_t rateHz = request["rate_hz"] | 50;
+    uint32_t durationS = request["duration_s"] | 10;
+    uint32_t size = request["size"] | (binary ? 32 : 100);
+    uint32_t minSize = binary ? BENCH_BINARY_MIN_SIZE : BENCH_JSON_MIN_SIZE;
+    uint32_t maxSize = binary ? BENCH_BINARY_MAX_SIZE : BENCH_JSON_MAX_SIZE;
+
+    const char* error = nullptr;
+    if ((!binary && strcmp(encodingName, "json") != 0) || (!mqtt && strcmp(transportName, "ble") != 0)) {
+        error = "Unknown encoding or transport.";
+    } else if (rateHz < 1 || rateHz > BENCH_MAX_RATE_HZ || durationS < 1 || durationS > BENCH_MAX_DURATION_S) {
+        error = "rate_hz must be between 1 and 1000 and duration_s between 1 and 600.";
+    } else if (size < minSize || size > maxSize) {
+        error = binary ? "size must be between 14 and 244 for binary frames." : "size must be between 64 and 512 for JSON frames.";
+    } else {
+        error = benchmarkRunner.start(*currentSession,
+                                      binary ? BenchmarkRunner::BENCH_BINARY : BenchmarkRunner::BENCH_JSON,
+                                      mqtt ? BenchmarkRunner::BENCH_MQTT : BenchmarkRunner::BENCH_BLE,
+                                      rateHz, size, durationS, currentCommand);
+    }
+    if (error) {
+        response["status"] = "error";
+        response["message"] = error;
+        return;
+    }
+    response["status"] = "started";
+    response["frames"] = durationS * rateHz;
+    response["device_us"] = esp_timer_get_time();
+}
+
+// Corta el benchmark en curso; su resumen llega como siempre
+COMMAND_HANDLER("stop_benchmark", handleStopBenchmark) {
+    response["type"] = "stop_benchmark_response";
+    if (!benchmarkRunner.isRunning()) {
+        response["status"] = "error";
+        response["message"] = "No benchmark running.";
+        return;
+    }
+    benchmarkRunner.stop();
+    response["status"] = "success";
+}
+
+// Hora del dispositivo para estimar el desfase de relojes: la app se queda con
+// la muestra de menor ida y vuelta y asume que la respuesta salió a mitad
+COMMAND_HANDLER("bench_sync", handleBenchSync) {
+    response["type"] = "bench_sync_response";
+    response["status"] = "success";
+    response["device_us"] = esp_timer_get_time();
+}
+
+static bool parseSha256Hex(const char* hex, uint8_t* digest) {
+    if (hex == nullptr || strlen(hex) != 64) return false;
+    for (int i = 0; i < 32; i++) {
+        uint8_t byte = 0;
+        for (int j = 0; j < 2; j++) {
+            char c = hex[i * 2 + j];
+            uint8_t nibble;
+            if (c >= '0' && c <= '9') nibble = c - '0';
+            else if (c >= 'a' && c <= 'f') nibble = c - 'a' + 10;
+            else if (c >= 'A' && c <= 'F') nibble = c - 'A' + 10;
+            else return false;
+            byte = (byte << 4) | nibble;
+        }
+        digest[i] = byte;
+    }
+    return true;
+}
+
+static void otaStatusToJson(JsonDocument& response) {
+    static const char* const STATE_NAMES[] = {"idle", "receiving", "ready"};
+    response["state"] = STATE_NAMES[otaUpdater.currentState()];
+    response["offset"] = otaUpdater.offset();
+    response["size"] = otaUpdater.size();
+    response["partition"] = otaUpdater.partitionLabel();
+    response["chunk_max"] = OTA_CHUNK_MAX;
+}
+
+// {"type":"ota_begin","size":1234567,"sha256":"<64 hex>"}. Con la misma imagen
+// que estaba a medias responde "resumed" y el offset desde el que seguir.
+COMMAND_HANDLER("ota_begin", handleOtaBegin) {
+    response["type"] = "ota_begin_response";
+    uint8_t digest[32];
+    uint32_t size = request["size"] | 0u;
+    if (!parseSha256Hex(request["sha256"], digest)) {
+        response["status"] = "error";
+        response["message"] = "sha256 must be 64 hex characters.";
+        return;
+    }
+    bool resumed;
+    const char* error = otaUpdater.begin(size, digest, resumed);
+    response["status"] = error ? "error" : "success";
+    if (error) response["message"] = error;
+    response["resumed"] = resumed;
+    response["window"] = RX_CREDIT_WINDOW;
+    otaStatusToJson(response);
+}
+
+// {"type":"ota_data","offset":0,"data":"<base64>"}. Sin "id", si todo va bien
+// no hay respuesta: el avance se sigue con los rx_credit y el offset de
+// "ota_status". Un error siempre responde con el offset esperado.
+COMMAND_HANDLER("ota_data", handleOtaData) {
+    static uint8_t chunk[OTA_CHUNK_MAX];
+    const char* data = request["data"] | "";
+    size_t decoded = 0;
+    const char* error = nullptr;
+    if (mbedtls_base64_decode(chunk, sizeof(chunk), &decoded, (const uint8_t*)data, strlen(data)) != 0 ||
+        decoded == 0) {
+        error = "Invalid OTA chunk.";
+    } else {
+        error = otaUpdater.write(request["offset"] | UINT32_MAX, chunk, decoded);
+    }
+    if (error == nullptr && currentCommand.id < 0) return;
+
+    response["type"] = "ota_data_response";
+    response["status"] = error ? "error" : "success";
+    if (error) response["message"] = error;
+    response["offset"] = otaUpdater.offset();
+}
+
+// Verifica la imagen completa, la marca para el próximo arranque y reinicia
+COMMAND_HANDLER("ota_end", handleOtaEnd) {
+    response["type"] = "ota_end_response";
+    const char* error = otaUpdater.finish();
+    if (error) {
+        response["status"] = "error";
+        response["message"] = error;
+        otaStatusToJson(response);
+        return;
+    }
+    response["status"] = "success";
+    response["message"] = "Firmware verified, rebooting.";
+    response["duration_ms"] = otaUpdater.lastDurationMs();
+    scheduler.rearmOneShot("ota_reboot", OTA_REBOOT_DELAY_MS, otaRebootJob);
+}
+
+COMMAND_HANDLER("ota_abort", handleOtaAbort) {
+    otaUpdater.abort();
+    response["type"] = "ota_abort_response";
+    response["status"] = "success";
+    otaStatusToJson(response);
+}
+
+COMMAND_HANDLER("ota_status", handleOtaStatus) {
+    response["type"] = "ota_status_response";
+    response["status"] = "success";
+    otaStatusToJson(response);
+    response["resumes"] = otaUpdater.resumeCount();
+    const esp_partition_t* running = esp_ota_get_running_partition();
+    response["running"] = running ? running->label : "";
+}
+
+COMMAND_HANDLER("get_history_info", handleGetHistoryInfo) {
+    response["type"] = "history_info_response";
+    response["status"] = historyStore.available() ? "success" : "error";
+    response["partition_size"] = historyStore.partitionSize();
+    response["capacity"] = historyStore.capacity();
+    response["count"] = historyStore.count();
+    response["oldest"] = historyStore.oldestSequence();
+    response["next"] = historyStore.nextSequence();
+    response["boot"] = historyStore.bootNumber();
+    response["period_s"] = HISTORY_PERIOD_MS / 1000;
+    response["appends"] = historyStore.appendCount();
+    response["erases"] = historyStore.eraseCount();
+    response["write_errors"] = historyStore.writeErrorCount();
+}
+
+COMMAND_HANDLER("get_queue_stats", handleGetQueueStats) {
+    response["type"] = "queue_stats_response";
+    response["status"] = "success";
+    response["depth"] = commandQueue.depth();
+    response["capacity"] = commandQueue.capacity();
+    response["high_water"] = commandQueue.highWaterMark();
+    response["enqueued"] = commandQueue.enqueued();
+    response["overflows"] = commandQueue.overflows();
+    uint32_t tooLong = 0;
+    for (Session& session : sessions) tooLong += session.framer.overflowCount.load();
+    response["too_long"] = tooLong;
+}
+
+COMMAND_HANDLER("get_pool_stats", handleGetPoolStats) {
+    response["type"] = "pool_stats_response";
+    response["status"] = "success";
+    response["capacity"] = jsonPool.capacity();
+    response["in_use"] = jsonPool.inUseCount();
+    response["high_water"] = jsonPool.highWaterMark();
+    response["exhausted"] = jsonPool.exhausted();
+    response["arena_size"] = jsonPool.arenaSize();
+    response["arena_peak"] = jsonPool.peakArenaBytes();
+}
+
+static void stageToJson(JsonObject entry, const StageStats& stage) {
+    entry["count"] = stage.count;
+    entry["last_us"] = stage.lastUs;
+    entry["avg_us"] = stage.avgUs();
+    entry["max_us"] = stage.maxUs;
+}
+
+COMMAND_HANDLER("get_pipeline_stats", handleGetPipelineStats) {
+    response["type"] = "pipeline_stats_response";
+    response["status"] = "success";
+    response["period_ms"] = ACQ_PERIOD_MS;
+    response["samples_per_reading"] = samplesPerReading;
+
+    JsonObject ring = response["ring"].to<JsonObject>();
+    ring["depth"] = rawRing.depth();
+    ring["capacity"] = rawRing.capacity();
+    ring["high_water"] = rawRing.highWaterMark();
+    ring["overflows"] = rawRing.overflows();
+
+    JsonObject adc = response["adc"].to<JsonObject>();
+    adc["mode"] = ADC_DMA_ENABLE ? "dma" : "simulated";
+    adc["burst_samples"] = ADC_BURST_SAMPLES;
+    adc["sample_freq_hz"] = ADC_SAMPLE_FREQ_HZ;
+    adc["capture_errors"] = pipelineStats.captureErrors;
+    static const char* const channelNames[ADC_CHANNEL_COUNT] = {"ph", "do", "temp"};
+    JsonObject conversions = adc["conversions"].to<JsonObject>();
+    JsonObject rejected = adc["rejected"].to<JsonObject>();
+    for (int c = 0; c < ADC_CHANNEL_COUNT; c++) {
+        conversions[channelNames[c]] = pipelineStats.conversions[c];
+        rejected[channelNames[c]] = pipelineStats.rejected[c];
+    }
+
+    JsonObject stages = response["stages"].to<JsonObject>();
+    stageToJson(stages["acquire"].to<JsonObject>(), pipelineStats.acquire);
+    stageToJson(stages["filter"].to<JsonObject>(), pipelineStats.filter);
+    stageToJson(stages["jitter"].to<JsonObject>(), pipelineStats.jitter);
+    stageToJson(stages["queue"].to<JsonObject>(), pipelineStats.queueLatency);
+    stageToJson(stages["process"].to<JsonObject>(), pipelineStats.process);
+    stageToJson(stages["publish"].to<JsonObject>(), pipelineStats.publish);
+}
+
+COMMAND_HANDLER("get_scheduler_stats", handleGetSchedulerStats) {
+    response["type"] = "scheduler_stats_response";
+    response["status"] = "success";
+    response["next_deadline_ms"] = scheduler.msUntilNextDeadline();
+    JsonArray jobs = response["jobs"].to<JsonArray>();
+    for (int i = 0; i < MAX_SCHEDULED_JOBS; i++) {
+        const auto& job = scheduler.job(i);
+        if (job.name == nullptr) continue;
+        JsonObject entry = jobs.add<JsonObject>();
+        entry["name"] = job.name;
+        entry["active"] = job.active;
+        entry["period_ms"] = job.periodMs;
+        entry["priority"] = job.priority;
+        entry["runs"] = job.runs;
+        entry["overruns"] = job.overruns;
+        entry["max_late_ms"] = job.maxLateMs;
+        entry["avg_us"] = job.runs ? (uint32_t)(job.totalUs / job.runs) : 0;
+        entry["max_us"] = job.maxUs;
+    }
+}
+
+// {"type":"set_power_mode","mode":"low_power"|"performance"|"duty_cycle","period_s":300,"batch":12}
+// period_s y batch solo cuentan con "duty_cycle" y son opcionales. El primer
+// deep sleep llega cuando la app se desconecta.
+COMMAND_HANDLER("set_power_mode", handleSetPowerMode) {
+    const char* mode = request["mode"] | "";
+    response["type"] = "power_mode_response";
+    PowerMode newMode;
+    if (strcmp(mode, "low_power") == 0) {
+        newMode = POWER_LOW;
+    } else if (strcmp(mode, "performance") == 0) {
+        newMode = POWER_PERFORMANCE;
+    } else if (strcmp(mode, "duty_cycle") == 0) {
+        newMode = POWER_DUTY_CYCLE;
+    } else {
+        response["status"] = "error";
+        response["message"] = "Unknown power mode.";
+        return;
+    }
+
+    Settings current = config.get();
+    uint32_t periodS = request["period_s"] | current.dutyPeriodS;
+    uint32_t batch = request["batch"] | (uint32_t)current.dutyBatch;
+    if (newMode == POWER_DUTY_CYCLE && (periodS < 10 || periodS > 86400 || batch < 1 || batch > DUTY_BATCH_MAX)) {
+        response["status"] = "error";
+        response["message"] = "period_s must be between 10 and 86400 and batch between 1 and 32.";
+        return;
+    }
+
+    // El deep sleep del ciclo de trabajo no necesita esp_pm: aunque falle el DFS
+    // el modo se guarda y se arma, y el fallo va como aviso
+    esp_err_t err = powerManager.apply(newMode);
+    bool accepted = err == ESP_OK || newMode == POWER_DUTY_CYCLE;
+    if (accepted) {
+        config.update([newMode, periodS, batch](Settings& s) {
+            s.powerMode = newMode;
+            if (newMode == POWER_DUTY_CYCLE) {
+                s.dutyPeriodS = periodS;
+                s.dutyBatch = (uint8_t)batch;
             }
+        });
+        if (newMode == POWER_DUTY_CYCLE) scheduler.rearmOneShot("duty", DUTY_CHECK_MS, dutyCycleJob, 2);
+    }
+    response["status"] = accepted ? "success" : "error";
+    response["mode"] = mode;
+    if (newMode == POWER_DUTY_CYCLE) {
+        response["period_s"] = periodS;
+        response["batch"] = batch;
+    }
+    if (err != ESP_OK) {
+        response[accepted ? "warning" : "message"] = "Power management not available in this build.";
+        response["pm_error"] = err;
+    }
+}
 
-            String type = doc["type"];
-            if (type == "wifi_config") {
-                String ssid = doc["ssid"];
-                String password = doc["password"];
-                Serial.print("Configurando WiFi para SSID: ");
-                Serial.println(ssid);
-                
-                // Aquí iría tu lógica para conectar al WiFi
-                // WiFi.begin(ssid.c_str(), password.c_str());
-                
-                // Enviar respuesta de éxito (simulada)
-                responseDoc["type"] = "wifi_config_response";
-                responseDoc["status"] = "success";
-                responseDoc["message"] = "WiFi credentials received and being processed.";
-                sendJsonResponse(responseDoc);
-
-            } else if (type == "set_altitude") {
-                if (doc.containsKey("value") && doc["value"].is<int>()) {
-                    int altitude = doc["value"].as<int>();
-                    Serial.print("Ajustando altitud a: ");
-                    Serial.print(altitude);
-                    Serial.println(" metros.");
-
-                    // Aquí iría tu lógica para guardar o usar el valor de altitud
-                    // Por ejemplo: preferences.putInt("altitude", altitude);
-
-                    responseDoc["type"] = "altitude_set_response";
-                    responseDoc["status"] = "success";
-                    responseDoc["message"] = "Altitud actualizada a " + String(altitude) + "m.";
-                } else {
-                    responseDoc["type"] = "altitude_set_response";
-                    responseDoc["status"] = "error";
-                    responseDoc["message"] = "Valor de altitud no válido o no proporcionado.";
-                }
-                sendJsonResponse(responseDoc);
-                
-            } else {
-                responseDoc["type"] = "command_response";
-                responseDoc["status"] = "error";
-                responseDoc["message"] = "Unknown command type.";
-                sendJsonResponse(responseDoc);
+COMMAND_HANDLER("get_mqtt_stats", handleGetMqttStats) {
+    response["type"] = "mqtt_stats_response";
+    response["status"] = "success";
+    response["wifi_status"] = WIFI_STATUS_TEXT[wifiLinkState.load()];
+    response["connected"] = mqttPublisher.isConnected();
+    response["connects"] = mqttPublisher.connectCount();
+    response["outbox"] = mqttPublisher.outboxDepth();
+    response["outbox_capacity"] = mqttPublisher.outboxCapacity();
+    response["outbox_overflows"] = mqttPublisher.outboxOverflows();
+    response["backlog"] = mqttPublisher.backlog();
+    response["backlog_pending"] = mqttPublisher.backlogPending();
+    response["batches"] = mqttPublisher.batchCount();
+    response["published"] = mqttPublisher.publishedCount();
+    response["last_batch_bytes"] = mqttPublisher.lastBatchBytes();
+    response["spilled"] = mqttPublisher.spilledCount();
+    response["dropped"] = mqttPublisher.droppedCount();
+    response["ack_timeouts"] = mqttPublisher.ackTimeoutCount();
+    response["publish_errors"] = mqttPublisher.publishErrorCount();
+    response["alerts"] = mqttPublisher.alertCount();
+    response["alert_errors"] = mqttPublisher.alertErrorCount();
+    response["alerts_pending"] = mqttPublisher.pendingAlertCount();
+    response["alerts_untracked"] = mqttPublisher.alertUntrackedCount();
+}
+
+COMMAND_HANDLER("get_config", handleGetConfig) {
+    Settings settings = config.get();
+    response["type"] = "config_response";
+    response["status"] = "success";
+    response["altitude"] = settings.altitudeM;
+    response["salinity"] = settings.salinityPsu;
+    response["power_mode"] = POWER_MODE_NAMES[settings.powerMode];
+    response["ph_points"] = settings.phPointCount;
+    response["wifi_ssid"] = (const char*)settings.wifiSsid; // La contraseña nunca sale del equipo
+    JsonObject store = response["store"].to<JsonObject>();
+    store["loaded"] = config.loadedFromFlash();
+    store["dirty"] = config.isDirty();
+    store["updates"] = config.updateCount();
+    store["writes"] = config.writeCount();
+    store["skipped"] = config.skippedCount();
+    store["write_errors"] = config.writeErrorCount();
+}
+
+COMMAND_HANDLER("get_memory_stats", handleGetMemoryStats) {
+    response["type"] = "memory_stats_response";
+    response["status"] = "success";
+    response["static_allocation"] = (bool)STATIC_ALLOCATION;
+    response["heap_guard"] = HEAP_GUARD == HEAP_GUARD_TRAP ? "trap" : HEAP_GUARD == HEAP_GUARD_COUNT ? "count" : "off";
+#if HEAP_GUARD != HEAP_GUARD_OFF && CONFIG_HEAP_USE_HOOKS
+    response["hooks"] = true;
+#else
+    response["hooks"] = false; // Sin CONFIG_HEAP_USE_HOOKS los contadores quedan a 0
+#endif
+    response["sealed"] = taskRegistry.isSealed();
+    response["sealed_at_ms"] = taskRegistry.sealedAt();
+    response["other_allocs"] = taskRegistry.otherAllocCount();
+
+    JsonObject heap = response["heap"].to<JsonObject>();
+    heap["free"] = ESP.getFreeHeap();
+    heap["min_free"] = ESP.getMinFreeHeap();
+    heap["max_alloc"] = ESP.getMaxAllocHeap(); // Mayor bloque libre: mide la fragmentación
+
+    // uxTaskGetStackHighWaterMark() da bytes en ESP-IDF
+    JsonArray tasks = response["tasks"].to<JsonArray>();
+    for (uint8_t i = 0; i < taskRegistry.size(); i++) {
+        const TaskRegistry::Entry& task = taskRegistry.at(i);
+        uint32_t freeMin = uxTaskGetStackHighWaterMark(task.handle);
+        JsonObject entry = tasks.add<JsonObject>();
+        entry["name"] = task.name;
+        entry["stack"] = task.stackBytes;
+        entry["free_min"] = freeMin;
+        entry["low"] = freeMin < STACK_LOW_WATER_BYTES;
+        entry["allocs"] = task.allocs.load(std::memory_order_relaxed);
+        entry["alloc_bytes"] = task.allocBytes.load(std::memory_order_relaxed);
+    }
+}
+
+COMMAND_HANDLER("get_power_stats", handleGetPowerStats) {
+    uint64_t windowUs = powerManager.windowMicros();
+    response["type"] = "power_stats_response";
+    response["status"] = "success";
+    response["mode"] = POWER_MODE_NAMES[powerManager.currentMode()];
+    response["pm_error"] = powerManager.configureError();
+    response["cpu_mhz"] = getCpuFrequencyMhz();
+    response["window_s"] = (uint32_t)(windowUs / 1000000);
+    response["busy_ms"] = (uint32_t)(powerManager.busyMicros() / 1000);
+    response["duty_cycle_pct"] = windowUs ? 100.0f * powerManager.busyMicros() / windowUs : 0.0f;
+    response["wakeups_per_min"] = windowUs ? powerManager.wakeupCount() * 60000000.0f / windowUs : 0.0f;
+
+    JsonObject duty = response["duty"].to<JsonObject>();
+    duty["period_s"] = dutyCycle.periodS();
+    duty["batch"] = dutyCycle.batchSize();
+    duty["pending"] = dutyCycle.pending();
+    duty["quick_wakes"] = dutyCycle.quickWakes();
+    duty["flushed"] = dutyCycle.flushedCount();
+    duty["clock_s"] = dutyCycle.clockMs() / 1000;
+}
+
+// {"type":"set_link_profile","conn":"auto"|"bulk"|"idle","adv":"auto"|"fast"|"slow","fast_adv_window_s":30}
+// Todos los campos son opcionales. El perfil de publicidad se aplica en la
+// próxima desconexión.
+COMMAND_HANDLER("set_link_profile", handleSetLinkProfile) {
+    response["type"] = "link_profile_response";
+
+    const char* conn = request["conn"] | "";
+    const char* adv = request["adv"] | "";
+    const ConnProfile* connProfile = findConnProfile(conn);
+    const AdvProfile* advProfile = findAdvProfile(adv);
+    bool connValid = !*conn || !strcmp(conn, "auto") || connProfile;
+    bool advValid = !*adv || !strcmp(adv, "auto") || advProfile;
+    if (!connValid || !advValid) {
+        response["status"] = "error";
+        response["message"] = "Unknown link profile.";
+        return;
+    }
+
+    if (*conn) linkManager.setConnPolicy(connProfile);
+    if (*adv) linkManager.setAdvPolicy(advProfile);
+    if (request["fast_adv_window_s"].is<unsigned int>()) {
+        linkManager.setFastWindow(request["fast_adv_window_s"].as<unsigned int>() * 1000);
+    }
+
+    response["status"] = "success";
+    response["conn"] = linkManager.connAuto() ? "auto" : linkManager.connName();
+    response["adv"] = linkManager.advAuto() ? "auto" : "fixed";
+    response["fast_adv_window_s"] = linkManager.fastWindow() / 1000;
+}
+
+COMMAND_HANDLER("get_link_stats", handleGetLinkStats) {
+    response["type"] = "link_stats_response";
+    response["status"] = "success";
+    response["conn_profile"] = linkManager.connName();
+    response["conn_policy"] = linkManager.connAuto() ? "auto" : "fixed";
+    response["adv_policy"] = linkManager.advAuto() ? "auto" : "fixed";
+    response["conn_interval_ms"] = connIntervalUnits * 1.25f;
+    response["conn_updates"] = linkManager.updateRequests();
+    response["last_reconnect_ms"] = linkManager.reconnectMs();
+    response["fast_adv_window_s"] = linkManager.fastWindow() / 1000;
+    response["max_centrals"] = MAX_CENTRALS;
+    JsonArray centrals = response["centrals"].to<JsonArray>();
+    for (Session& session : sessions) {
+        if (!session.active) continue;
+        JsonObject central = centrals.add<JsonObject>();
+        central["conn_id"] = session.connId;
+        central["mtu"] = session.tx.currentMtu();
+        central["subscribed"] = (bool)session.subscribed;
+        central["telemetry"] = TELEMETRY_MODE_NAMES[session.telemetryMode.load()];
+        central["connected_s"] = (millis() - session.connectedAtMs) / 1000;
+        central["self"] = &session == currentSession;
+    }
+}
+
+// Estadísticas TX de la conexión que lo pide
+COMMAND_HANDLER("get_tx_stats", handleGetTxStats) {
+    TxScheduler<TX_RING_SIZE>& tx = currentSession->tx;
+    const auto& stats = tx.statistics();
+    response["type"] = "tx_stats_response";
+    response["status"] = "success";
+    response["conn_id"] = currentSession->connId;
+    response["mtu"] = tx.currentMtu();
+    response["payload_size"] = tx.payloadSize();
+    response["conn_interval_ms"] = connIntervalUnits * 1.25f;
+    response["frames"] = stats.frames;
+    response["dropped"] = stats.dropped;
+    response["notifications"] = stats.notifications;
+    response["bytes"] = stats.bytes;
+    response["bytes_per_notify"] = stats.notifications ? (float)stats.bytes / stats.notifications : 0.0f;
+    response["coalesced"] = stats.coalesced;
+    response["split"] = stats.split;
+    response["notify_errors"] = stats.notifyErrors;
+    response["throughput_bps"] = stats.activeUs ? (uint32_t)(stats.bytes * 1000000ULL / stats.activeUs) : 0;
+    response["pending"] = tx.pending();
+}
+
+// {"type":"get_diagnostics","reset":false}: histogramas por etapa (cubeta i =
+// [2^i, 2^(i+1)) us) y contadores de tráfico, colas y memoria. Con "reset" se
+// ponen a cero después de responder.
+COMMAND_HANDLER("get_diagnostics", handleGetDiagnostics) {
+    response["type"] = "diagnostics_response";
+    response["status"] = "success";
+    response["uptime_ms"] = millis();
+    response["window_ms"] = millis() - diagnostics.sinceMs;
+
+    JsonObject stages = response["stages"].to<JsonObject>();
+    for (int i = 0; i < DIAG_STAGE_COUNT; i++) {
+        const LatencyHistogram& histogram = diagnostics.stages[i];
+        JsonObject stage = stages[DIAG_STAGE_NAMES[i]].to<JsonObject>();
+        stage["count"] = histogram.count;
+        stage["avg_us"] = histogram.count ? (uint32_t)(histogram.totalUs / histogram.count) : 0;
+        stage["p50_us"] = histogram.percentileUs(50);
+        stage["p99_us"] = histogram.percentileUs(99);
+        stage["max_us"] = histogram.maxUs;
+        // Solo hasta la última cubeta con muestras, para acotar la respuesta
+        int last = DIAG_HISTOGRAM_BUCKETS - 1;
+        while (last >= 0 && histogram.buckets[last] == 0) last--;
+        JsonArray buckets = stage["buckets"].to<JsonArray>();
+        for (int b = 0; b <= last; b++) buckets.add(histogram.buckets[b]);
+    }
+
+    // TX: suma de las conexiones actuales (cada sesión empieza de cero)
+    uint32_t txBytes = 0, notifications = 0, notifyErrors = 0, txDropped = 0, tooLong = 0;
+    for (Session& session : sessions) {
+        tooLong += session.framer.overflowCount.load();
+        if (!session.active) continue;
+        const auto& tx = session.tx.statistics();
+        txBytes += tx.bytes;
+        notifications += tx.notifications;
+        notifyErrors += tx.notifyErrors;
+        txDropped += tx.dropped;
+    }
+    JsonObject ble = response["ble"].to<JsonObject>();
+    ble["centrals"] = sessions.count();
+    ble["rx_writes"] = diagnostics.rxWrites;
+    ble["rx_bytes"] = diagnostics.rxBytes;
+    ble["tx_bytes"] = txBytes;
+    ble["notifications"] = notifications;
+    ble["notify_errors"] = notifyErrors;
+    ble["tx_dropped"] = txDropped;
+    ble["mtu"] = currentSession->tx.currentMtu();
+
+    JsonObject commands = response["commands"].to<JsonObject>();
+    commands["processed"] = diagnostics.commands;
+    commands["parse_errors"] = diagnostics.parseErrors;
+    commands["unknown"] = diagnostics.unknownCommands;
+    commands["queue_overflows"] = commandQueue.overflows();
+    commands["too_long"] = tooLong;
+    commands["registration_errors"] = commandRegistry.registrationErrors();
+
+    JsonObject heap = response["heap"].to<JsonObject>();
+    heap["free"] = ESP.getFreeHeap();
+    heap["min_free"] = ESP.getMinFreeHeap();
+    heap["max_alloc"] = ESP.getMaxAllocHeap();
+
+    JsonObject log = response["log"].to<JsonObject>();
+    log["written"] = logger.written();
+    log["dropped"] = logger.dropped();
+    log["suppressed"] = logger.suppressed();
+
+    // Hitos del arranque en µs desde el reset; null si aún no se alcanzaron
+    JsonObject boot = response["boot"].to<JsonObject>();
+    for (uint8_t i = 0; i < BOOT_PHASE_COUNT; i++) {
+        uint64_t atUs = bootTimeline.atUs((BootPhase)i);
+        if (atUs) boot[BOOT_PHASE_NAMES[i]] = atUs; else boot[BOOT_PHASE_NAMES[i]] = nullptr;
+    }
+    boot["wake_cause"] = (int)esp_sleep_get_wakeup_cause();
+
+    if (request["reset"] | false) {
+        // La respuesta ya está construida; los contadores acumulados de TX y
+        // de las colas son de sus propios módulos y no se tocan
+        for (auto& histogram : diagnostics.stages) histogram.reset();
+        diagnostics.rxWrites = diagnostics.rxBytes = diagnostics.commands = 0;
+        diagnostics.parseErrors = diagnostics.unknownCommands = 0;
+        diagnostics.sinceMs = millis();
+    }
+}
+
+
+// Parsea y despacha un comando sobre documentos ya reservados. Devuelve nullptr
+// si `response` queda lista para enviar o el texto del error de comando. No
+// toca el BLE, el pool ni el log: solo la tabla de handlers y ArduinoJson.
+// Con `tag`, guarda en él el "id" de la petición antes de llamar al handler.
+const char* dispatchCommand(const char* line, size_t len, JsonDocument& request, JsonDocument& response,
+                            CommandTag* tag = nullptr) {
+    DeserializationError error;
+    {
+        DiagTimer timer(DIAG_PARSE);
+        error = deserializeJson(request, line, len);
+    }
+
+    if (error == DeserializationError::NoMemory) return "Command too large.";
+    if (error) {
+        diagnostics.parseErrors++;
+        LOG_W("deserializeJson() failed: %s", error.c_str());
+        return "Invalid JSON format.";
+    }
+
+    JsonVariantConst id = request["id"];
+    if (!id.isNull() && !id.is<uint32_t>()) return "id must be an unsigned integer.";
+    if (tag != nullptr && !id.isNull()) tag->id = id.as<uint32_t>();
+
+    const char* type = request["type"];
+    CommandHandler handler = type ? commandRegistry.find(type) : nullptr;
+    if (handler == nullptr) {
+        diagnostics.unknownCommands++;
+        return "Unknown command type.";
+    }
+
+    diagnostics.commands++;
+    {
+        DiagTimer timer(DIAG_HANDLER);
+        handler(request, response);
+    }
+    if (response.overflowed()) return "Response too large.";
+    return nullptr;
+}
+
+// Procesa un comando JSON completo entregado por el framer de `session`.
+// Toda respuesta inmediata lleva "exec_us" y "queue_us" (espera en la cola) y,
+// si la petición traía "id", el mismo "id".
+void processCommand(Session& session, const char* line, size_t len, int64_t receivedUs) {
+#if LOG_LEVEL >= LOG_LEVEL_DEBUG
+    char echo[LOG_TEXT_BYTES];
+    size_t echoLen = std::min(len, sizeof(echo) - 1);
+    memcpy(echo, line, echoLen);
+    echo[echoLen] = '\0';
+    LOG_D("Comando JSON recibido: %s", echo);
+#endif
+
+    linkManager.noteActivity();
+    currentCommand = CommandTag();
+    currentCommand.startedUs = esp_timer_get_time();
+
+    PooledJsonDocument doc;
+    PooledJsonDocument responseDoc;
+    if (!doc || !responseDoc) {
+        sendCommandError(session, "Device busy, try again.", &currentCommand);
+        return;
+    }
+
+    // El id se lee antes de despachar para que el handler pueda guardarlo
+    // si responde más tarde
+    const char* error = dispatchCommand(line, len, *doc, *responseDoc, &currentCommand);
+    if (error != nullptr) {
+        sendCommandError(session, error, &currentCommand);
+        return;
+    }
+    if (responseDoc->isNull()) return; // El handler no tenía nada que decir (ota_data)
+    currentCommand.apply(*responseDoc);
+    (*responseDoc)["queue_us"] = (uint32_t)(currentCommand.startedUs - receivedUs);
+    sendJsonResponse(session, *responseDoc);
+}
+
+// Anuncia cuántas líneas de la sesión ya salieron de la cola y cuántas se
+// descartaron, con el número de las descartadas desde el último aviso para que
+// la app las reenvíe. Es acumulado: si un aviso no cabe en el anillo TX, el
+// siguiente lo incluye. Sin espacio se reintenta cuando txTask lo libere,
+// porque la app puede estar esperándolo.
+void sendRxCredit(Session& session) {
+    uint32_t acked = session.rxAcked();
+    uint32_t dropped = session.rxDropped.load(std::memory_order_acquire);
+    if (acked == session.rxAdvertised && dropped == session.rxDropReported) return;
+    char frame[96 + RX_DROP_LOG * 11];
+    int len = snprintf(frame, sizeof(frame), "{\"type\":\"rx_credit\",\"acked\":%u,\"dropped\":%u,\"window\":%u",
+                       (unsigned)acked, (unsigned)dropped, (unsigned)RX_CREDIT_WINDOW);
+    // Si se descartaron más de las que recuerda la sesión (o el callback RX las
+    // pisó mientras se leían) solo va el total y la app no puede reenviarlas
+    uint32_t first = session.rxDropReported;
+    size_t listStart = len;
+    if (dropped - first <= RX_DROP_LOG) {
+        len += snprintf(frame + len, sizeof(frame) - len, ",\"resend\":[");
+        for (uint32_t i = first; i != dropped; i++) {
+            len += snprintf(frame + len, sizeof(frame) - len, i == first ? "%u" : ",%u",
+                            (unsigned)session.rxDropSeq[i % RX_DROP_LOG]);
+        }
+        len += snprintf(frame + len, sizeof(frame) - len, "]");
+        if (session.rxDropped.load(std::memory_order_acquire) - first > RX_DROP_LOG) len = listStart;
+    }
+    len += snprintf(frame + len, sizeof(frame) - len, "}\n");
+    if (session.tx.sendRaw((const uint8_t*)frame, len)) {
+        session.rxAdvertised = acked;
+        session.rxDropReported = dropped;
+        if (!historySync.targets(session)) session.tx.setSpaceWaiter(nullptr);
+    } else {
+        session.tx.setSpaceWaiter(commandTaskHandle);
+    }
+}
+
+// Tarea que vacía la cola de comandos. Se despierta con una notificación del
+// callback RX y procesa todo lo pendiente antes de volver a dormir.
+void commandTask(void* param) {
+    uint32_t reportedOverflows = 0;
+    uint32_t reportedTooLong[MAX_CENTRALS] = {};
+
+    for (;;) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        int64_t started = esp_timer_get_time();
+
+        // Avisar a la app de los comandos perdidos desde la última vez. Con
+        // control de flujo los descartes van en el siguiente rx_credit.
+        uint32_t overflows = commandQueue.overflows();
+        if (overflows != reportedOverflows) {
+            reportedOverflows = overflows;
+            LOG_W("⚠️ RX: cola de comandos llena, comando descartado.");
+        }
+        for (uint8_t i = 0; i < MAX_CENTRALS; i++) {
+            Session& session = sessions.at(i);
+            uint32_t dropped = session.rxDropped.load();
+            if (!session.rxFlow.load() && dropped != session.rxDropReported) {
+                session.rxDropReported = dropped;
+                LOG_W("⚠️ RX: ventana de la sesión o cola llena, comando descartado.");
+                sendCommandError(session, "Command queue full, command dropped.");
+            }
+            uint32_t tooLong = session.framer.overflowCount.load();
+            if (tooLong != reportedTooLong[i]) {
+                reportedTooLong[i] = tooLong;
+                LOG_W("⚠️ RX: comando demasiado largo, descartado.");
+                sendCommandError(session, "Command too long.");
+            }
+        }
+
+        while (const auto* slot = commandQueue.front()) {
+            Session& session = sessions.at(slot->session);
+            // Un comando de una conexión ya cerrada no se responde a la siguiente
+            bool current = session.active && session.connId == slot->connId;
+            if (current) {
+                DiagTimer timer(DIAG_COMMAND);
+                currentSession = &session;
+                processCommand(session, slot->data, slot->len, slot->receivedUs);
             }
+            commandQueue.pop();
+            // Después de pop(): hasta aquí la línea ocupa la ventana de la sesión
+            if (current) session.rxConsumed++;
+        }
+
+        // Devolver créditos a quien los pidió, uno por lote de comandos
+        for (Session& session : sessions) {
+            if (session.active && session.rxFlow.load()) sendRxCredit(session);
+        }
+
+        // Envío masivo del histórico, intercalado con los comandos
+        if (historySync.pump()) xTaskNotifyGive(xTaskGetCurrentTaskHandle());
+        powerManager.noteWake(esp_timer_get_time() - started);
+    }
+}
+
+
+// Clase para manejar las escrituras en la característica RX
+class MyCallbacks: public BLECharacteristicCallbacks {
+    void onWrite(BLECharacteristic *pCharacteristic, esp_ble_gatts_cb_param_t* param) {
+        // conn_id es el primer campo tanto de `write` como de `exec_write`
+        // (escrituras largas), así que vale en los dos casos
+        Session* session = sessions.find(param->write.conn_id);
+        if (session == nullptr) return;
+
+        // Leer directamente el buffer de la característica, sin copiarlo a un String.
+        // Un mismo bloque puede traer varios comandos o solo parte de uno.
+        // Aquí solo se encola: este código corre en la tarea de Bluedroid.
+        size_t length = pCharacteristic->getLength();
+        diagnostics.rxWrites++;
+        diagnostics.rxBytes += length;
+        {
+            DiagTimer timer(DIAG_RX_FRAME);
+            uint8_t index = sessions.indexOf(*session);
+            uint16_t connId = session->connId;
+            session->framer.feed(pCharacteristic->getData(), length, [session, index, connId](const char* line, size_t len) {
+                // Cada sesión como mucho RX_CREDIT_WINDOW líneas en la cola común
+                uint32_t seq = session->rxNextSeq();
+                bool queued = session->rxInQueue() < RX_CREDIT_WINDOW && commandQueue.push(line, len, index, connId);
+                if (!queued) session->rxDrop(seq); // Antes de contarla: "dropped" nunca va por detrás
+                session->rxReceived++;
+            });
         }
+
+        // Despertar a la tarea aunque no haya líneas nuevas, para que informe
+        // de posibles descartes
+        xTaskNotifyGive(commandTaskHandle);
     }
 };
 
 
+// --- Trabajos periódicos de loop() ---
+
+// Enviar un "keep-alive" o un estado cada KEEP_ALIVE_PERIOD_MS
+void keepAliveJob() {
+  if (!deviceConnected) return;
+  // Si acaba de salir telemetría la app ya sabe que seguimos aquí
+  if (millis() - lastTelemetryMs.load() < KEEP_ALIVE_PERIOD_MS) return;
+  static const char statusMessage[] = "{\"type\":\"status_update\",\"message\":\"AQUADATA device is alive.\"}\n";
+  sessions.broadcastRaw((const uint8_t*)statusMessage, sizeof(statusMessage) - 1);
+  LOG_D("Sent keep-alive message.");
+}
+
+// Guardar la última lectura en el histórico de flash
+void historyJob() {
+  historyStore.append(readingSnapshot());
+}
+
+// Ciclo de trabajo. Tras un despertar rápido: dormir, o reiniciar en un
+// arranque completo si el lote se llenó o hubo alerta (vencido el plazo sin
+// lectura también se duerme). Despierto del todo: dormir en cuanto no haya
+// app conectada, OTA ni nada pendiente en MQTT.
+void dutyCycleJob() {
+  if (dutyCycle.sampling()) {
+    if (dutyCycle.escalating()) dutyCycle.restartFull();
+    dutyCycle.sleep();
+    return;
+  }
+  if (config.get().powerMode != POWER_DUTY_CYCLE) return;
+
+  uint32_t awake = millis();
+  bool busy = !bootTimeline.reached(BOOT_READY) || awake < DUTY_AWAKE_MIN_MS || deviceConnected ||
+              otaUpdater.currentState() != OtaUpdater::OTA_IDLE ||
+              (!mqttPublisher.idle() && awake < DUTY_AWAKE_MAX_MS);
+  if (busy) {
+    scheduler.rearmOneShot("duty", DUTY_CHECK_MS, dutyCycleJob, 2);
+    return;
+  }
+  config.flush();
+  LOG_I("Ciclo de trabajo: a dormir tras %u ms despierto.", (unsigned)awake);
+  dutyCycle.sleep();
+}
+
+// Tramas del benchmark que ya tocan (ver BenchmarkRunner)
+void benchmarkJob() {
+  benchmarkRunner.tick();
+}
+
+// Pipeline de adquisición: primero el consumidor y después el productor, para
+// que ya tenga a quién avisar. La calibración ya está lista desde setup().
+void startSensors(const Settings& settings) {
+  // procTask llama a esp-mqtt para las alertas; acqTask no sale del ADC
+  SPAWN_TASK(processingTask, "proc", PROC_TASK_STACK, nullptr, PROC_TASK_PRIORITY,
+             &processingTaskHandle, PROC_TASK_CORE, HEAP_ALLOWED);
+  SPAWN_TASK(acquisitionTask, "acq", ACQ_TASK_STACK, nullptr, ACQ_TASK_PRIORITY,
+             &acquisitionTaskHandle, ACQ_TASK_CORE, HEAP_FORBIDDEN);
+}
+
+
+// Etapas que no hacen falta para que la app vea el dispositivo. Una por
+// pasada de loop(), para que entre medias se atiendan los demás trabajos
+// (p. ej. "link" tras la primera conexión).
+void bootStageJob() {
+  static uint8_t stage = 0;
+  switch (stage++) {
+    case 0:
+      // Histórico circular en flash
+      if (historyStore.begin()) {
+        scheduler.addPeriodic("history", HISTORY_PERIOD_MS, historyJob, 1, HISTORY_PERIOD_MS);
+        dutyCycle.flush(); // Lecturas de los despertares rápidos, antes que las nuevas
+      }
+      bootTimeline.mark(BOOT_HISTORY);
+      break;
+    case 1:
+      startSensors(config.get());
+      bootTimeline.mark(BOOT_SENSORS);
+      break;
+    case 2:
+      // Red: WiFi con las credenciales guardadas y publicación MQTT
+      mqttPublisher.begin();
+      wifiManagerInstance.begin();
+      wifiManagerInstance.configure(false);
+      bootTimeline.mark(BOOT_NETWORK);
+      break;
+    default:
+      // Si esta imagen llegó por OTA y el bootloader admite rollback, hasta
+      // aquí no se da por buena: si no arranca, vuelve a la anterior
+      esp_ota_mark_app_valid_cancel_rollback();
+      bootTimeline.mark(BOOT_READY);
+      taskRegistry.seal(); // A partir de aquí las reservas de las tareas propias se cuentan
+      if (config.get().powerMode == POWER_DUTY_CYCLE) {
+        scheduler.rearmOneShot("duty", DUTY_CHECK_MS, dutyCycleJob, 2);
+      }
+      LOG_I("Arranque completo en %u ms (publicidad a los %u ms).",
+            (unsigned)(bootTimeline.atUs(BOOT_READY) / 1000), (unsigned)(bootTimeline.atUs(BOOT_ADVERTISING) / 1000));
+      return;
+  }
+  scheduler.rearmOneShot("boot", BOOT_STAGE_GAP_MS, bootStageJob, 2);
+}
+
+
 void setup() {
+  bootTimeline.mark(BOOT_SETUP);
   Serial.begin(115200);
-  Serial.println("Starting BLE setup...");
+  logger.begin(); // Lo registrado antes de este punto ya está en el anillo
+  LOG_I("Starting BLE setup...");
+  // Un handler que no entró en la tabla solo se vería como "Unknown command type."
+  if (commandRegistry.registrationErrors() > 0) {
+    LOG_E("❌ %u handlers sin registrar (el primero, \"%s\"): nombre repetido o tabla llena.",
+          (unsigned)commandRegistry.registrationErrors(), commandRegistry.firstRegistrationError());
+  }
+  if (commandRegistry.size() * 2 > MAX_COMMAND_HANDLERS) {
+    LOG_W("⚠️ %u handlers en una tabla de %u: subir MAX_COMMAND_HANDLERS.",
+          (unsigned)commandRegistry.size(), (unsigned)MAX_COMMAND_HANDLERS);
+  }
+
+  // 0. Arrancar las tareas de TX y de comandos antes de que pueda llegar ninguna escritura
+  taskRegistry.add(xTaskGetCurrentTaskHandle(), "loop", getArduinoLoopTaskStackSize(), TaskRegistry::HEAP_ALLOWED);
+  SPAWN_TASK(txTask, "tx", TX_TASK_STACK, nullptr, TX_TASK_PRIORITY, &txTaskHandle, TX_TASK_CORE, HEAP_ALLOWED);
+  sessions.start(txTaskHandle);
+  SPAWN_TASK(commandTask, "cmd", COMMAND_TASK_STACK, nullptr, COMMAND_TASK_PRIORITY,
+             &commandTaskHandle, COMMAND_TASK_CORE, HEAP_ALLOWED);
 
-  // 1. Inicializar dispositivo BLE
+  // 1. Cargar la configuración e inicializar dispositivo BLE
+  config.begin();
+  Settings settings = config.get();
+  applyAltitude(settings.altitudeM);
+  deltaTelemetry.configure(settings);
+  anomalyDetector.configure(settings);
+  calibration.begin(settings); // Antes que BLE: set_altitude y compañía la regeneran
+  bootTimeline.mark(BOOT_CONFIG);
+  powerManager.begin((PowerMode)settings.powerMode);
+
+  // 1b. Despertar del ciclo de trabajo: una lectura corta, sin BLE ni WiFi,
+  //     y dutyCycleJob() decide si dormir o reiniciar en un arranque completo
+  if (dutyCycle.begin(settings)) {
+    scheduler.begin(xTaskGetCurrentTaskHandle());
+    samplesPerReading = DUTY_SAMPLES_PER_READING;
+    startSensors(settings);
+    scheduler.addOneShot("duty", DUTY_SAMPLE_TIMEOUT_MS, dutyCycleJob, 2);
+    return;
+  }
   BLEDevice::init(BLE_DEVICE_NAME);
+  powerManager.onBluetoothReady();
+  bootTimeline.mark(BOOT_BLE);
 
   // 2. Crear el servidor BLE
   BLEServer *pServer = BLEDevice::createServer();
-  pServer->setCallbacks(new MyServerCallbacks());
+  // Los callbacks y el descriptor viven lo mismo que el servidor: estáticos
+  static MyServerCallbacks serverCallbacks;
+  pServer->setCallbacks(&serverCallbacks);
 
   // 3. Crear el servicio BLE UART
   BLEService *pService = pServer->createService(SERVICE_UUID);
@@ -166,42 +6214,53 @@ void setup() {
   
   // !! SOLUCIÓN AL ERROR "GATT NOT SUPPORTED" !!
   // Añadir el descriptor 2902 es crucial para que las notificaciones funcionen
-  pTxCharacteristic->addDescriptor(new BLE2902());
+  static BLE2902 txCccd;
+  pTxCharacteristic->addDescriptor(&txCccd);
 
   // 5. Crear la característica de Recepción (RX)
   BLECharacteristic *pRxCharacteristic = pService->createCharacteristic(
                                              CHARACTERISTIC_UUID_RX,
-                                             BLECharacteristic::PROPERTY_WRITE
+                                             BLECharacteristic::PROPERTY_WRITE |
+                                             BLECharacteristic::PROPERTY_WRITE_NR
                                            );
-  pRxCharacteristic->setCallbacks(new MyCallbacks());
+  static MyCallbacks rxCallbacks;
+  pRxCharacteristic->setCallbacks(&rxCallbacks);
 
-  // 6. Iniciar el servicio
+  // 6. Iniciar el servicio. Con los handles ya asignados se notifica a cada
+  //    conexión por separado y se siguen sus suscripciones.
   pService->start();
+  gattsInterface = pServer->getGattsIf();
+  txValueHandle = pTxCharacteristic->getHandle();
+  txCccdHandle = txCccd.getHandle();
+  BLEDevice::setCustomGattsHandler(gattsEventHandler);
 
   // 7. Iniciar la publicidad (Advertising)
   BLEAdvertising *pAdvertising = BLEDevice::getAdvertising();
   pAdvertising->addServiceUUID(SERVICE_UUID); // Anunciar el servicio
   pAdvertising->setScanResponse(true);
-  pAdvertising->setMinPreferred(0x06);
-  pAdvertising->setMinPreferred(0x12);
-  BLEDevice::startAdvertising();
+  // Parámetros de conexión preferidos que se anuncian: del perfil rápido al de reposo
+  pAdvertising->setMinPreferred(CONN_BULK.minInterval);
+  pAdvertising->setMaxPreferred(CONN_IDLE.maxInterval);
+  linkManager.begin(pServer);
+  BLEDevice::setCustomGapHandler(gapEventHandler);
+  linkManager.startAdvertising();
+  bootTimeline.mark(BOOT_ADVERTISING);
   
-  Serial.println("✅ BLE Server started and advertising. Ready to connect.");
+  LOG_I("✅ BLE Server started and advertising. Ready to connect.");
+
+  // 8. Trabajos periódicos (setup() y loop() corren en la misma tarea) y el
+  //    resto del arranque, ya con la publicidad en marcha: histórico, sondas
+  //    y red, en bootStageJob()
+  scheduler.begin(xTaskGetCurrentTaskHandle());
+  scheduler.addPeriodic("keep_alive", KEEP_ALIVE_PERIOD_MS, keepAliveJob, 1, KEEP_ALIVE_PERIOD_MS);
+  scheduler.addOneShot("boot", 0, bootStageJob, 2);
 }
 
 void loop() {
-  // El código principal se maneja a través de callbacks, 
-  // pero puedes poner lógica adicional aquí si es necesario.
-  
-  // Ejemplo: enviar un "keep-alive" o un estado cada 10 segundos
-  static unsigned long lastMessageTime = 0;
-  if (deviceConnected && (millis() - lastMessageTime > 10000)) {
-    String statusMessage = "{\"type\":\"status_update\",\"message\":\"AQUADATA device is alive.\"}\n";
-    pTxCharacteristic->setValue((uint8_t*)statusMessage.c_str(), statusMessage.length());
-    pTxCharacteristic->notify();
-    lastMessageTime = millis();
-    Serial.println("Sent keep-alive message.");
-  }
-  
-  delay(100); 
+  // El código principal se maneja a través de callbacks y de los trabajos del
+  // planificador; entre plazos la tarea de loop() queda bloqueada.
+  int64_t started = esp_timer_get_time();
+  uint32_t waitMs = scheduler.runDue();
+  powerManager.noteWake(esp_timer_get_time() - started);
+  ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(waitMs));
 }
@@ -4,7 +4,7 @@ import { useState, useEffect, useCallback, useRef } from 'react';
 import { BleClient, type BleDevice as CapacitorBleDevice } from '@capacitor-community/bluetooth-le';
 import { Capacitor } from '@capacitor/core';
 import { useToast } from '@/hooks/use-toast';
-import type { BleDevice, SensorData, ConnectionState } from '@/lib/ble-types';
+import type { BleDevice, SensorData, ConnectionState, Diagnostics, DeviceAlert, CommandResponse } from '@/lib/ble-types';
 import {
   UART_SERVICE_UUID,
   UART_TX_CHARACTERISTIC_UUID,
@@ -12,8 +12,54 @@ import {
   CONNECTION_TIMEOUT_MS,
   CHUNK_SIZE,
   CHUNK_DELAY_MS,
-  SCAN_DURATION_MS
+  SCAN_DURATION_MS,
+  USE_BINARY_TELEMETRY,
+  REQUEST_TIMEOUT_MS,
+  MAX_PIPELINED_COMMANDS,
+  USE_RX_FLOW_CONTROL,
+  RX_CREDIT_TIMEOUT_MS,
+  OTA_CHUNK_SIZE,
+  BENCH_CLOCK_SYNC_SAMPLES,
+  BENCH_DRAIN_MS
 } from '@/lib/ble-types';
+import {
+  TELEMETRY_FRAME_MAGIC,
+  TELEMETRY_FRAME_SIZE,
+  decodeTelemetryFrame,
+  TELEMETRY_DELTA_MAGIC,
+  TELEMETRY_DELTA_MIN_SIZE,
+  decodeTelemetryDelta,
+  HISTORY_RECORD_MAGIC,
+  HISTORY_RECORD_SIZE,
+  decodeHistoryRecord,
+  type HistoryRecord,
+} from '@/lib/telemetry-frame';
+import {
+  BENCH_FRAME_MAGIC,
+  BENCH_FRAME_MIN_SIZE,
+  decodeBenchFrame,
+  parseBenchLine,
+  BenchmarkCollector,
+  type BenchmarkOptions,
+  type BenchmarkDeviceSummary,
+  type BenchmarkReport,
+} from '@/lib/benchmark';
+
+const MAX_ALERTS = 20;
+
+// Ventana de créditos RX que anunció el dispositivo en "rx_flow_response"
+interface RxFlow {
+  window: number;
+  mtu: number;
+  acked: number;
+  dropped: number;
+}
+
+interface PendingRequest {
+  resolve: (response: CommandResponse) => void;
+  reject: (error: Error) => void;
+  timer: ReturnType<typeof setTimeout>;
+}
 
 export function useBle() {
   const { toast } = useToast();
@@ -21,15 +67,39 @@ export function useBle() {
   const [devices, setDevices] = useState<BleDevice[]>([]);
   const [connectedDevice, setConnectedDevice] = useState<BleDevice | null>(null);
   const [lastSensorData, setLastSensorData] = useState<SensorData | null>(null);
+  const [history, setHistory] = useState<HistoryRecord[]>([]);
+  const [isSyncingHistory, setIsSyncingHistory] = useState(false);
+  const [diagnostics, setDiagnostics] = useState<Diagnostics | null>(null);
+  const [alerts, setAlerts] = useState<DeviceAlert[]>([]);
 
   const connectedDeviceRef = useRef<CapacitorBleDevice | null>(null);
-  const receivedDataBuffer = useRef('');
+  const receivedDataBuffer = useRef<Uint8Array>(new Uint8Array(0));
   const connectionTimeoutRef = useRef<NodeJS.Timeout | null>(null);
   const scanTimeoutRef = useRef<NodeJS.Timeout | null>(null);
   const isConnectingRef = useRef(false);
   const isMountedRef = useRef(true);
   const expectDisconnectRef = useRef(false);
   const lastConnectedDeviceIdRef = useRef<string | null>(null);
+  // Última secuencia del histórico recibida, para pedir solo lo nuevo
+  const lastHistorySequenceRef = useRef<number | null>(null);
+  // Peticiones con "id" esperando su respuesta; pueden llegar en otro orden
+  const nextRequestIdRef = useRef(1);
+  const pendingRequestsRef = useRef(new Map<number, PendingRequest>());
+  // Control de flujo RX: null = escrituras con respuesta. Las líneas enviadas
+  // se cuentan desde la conexión, igual que "acked" en el dispositivo.
+  const rxFlowRef = useRef<RxFlow | null>(null);
+  const rxLinesSentRef = useRef(0);
+  // Con control de flujo, cada línea enviada por su número hasta saber que llegó
+  // o que hay que reenviarla ("resend" en "rx_credit")
+  const rxSentLinesRef = useRef(new Map<number, string>());
+  const rxResendRef = useRef<string[]>([]);
+  const rxLostRef = useRef(0); // Descartadas que el dispositivo ya no pudo identificar
+  const creditWaitersRef = useRef<(() => boolean)[]>([]);
+  const writeQueueRef = useRef<Promise<void>>(Promise.resolve());
+  // Primer error de "ota_data" durante una subida (los aciertos no responden)
+  const otaErrorRef = useRef<CommandResponse | null>(null);
+  // Benchmark en curso por BLE: recibe cada trama "bench" con su hora de llegada
+  const benchCollectorRef = useRef<BenchmarkCollector | null>(null);
 
   const isNative = Capacitor.isNativePlatform();
 
@@ -57,38 +127,188 @@ export function useBle() {
     };
   }, [isNative, toast]);
 
-  const handleNotifications = useCallback((value: DataView) => {
-    const decoder = new TextDecoder();
-    receivedDataBuffer.current += decoder.decode(value);
-
-    let lastNewline;
-    while ((lastNewline = receivedDataBuffer.current.indexOf('\n')) !== -1) {
-      const message = receivedDataBuffer.current.substring(0, lastNewline);
-      receivedDataBuffer.current = receivedDataBuffer.current.substring(lastNewline + 1);
+  const handleJsonMessage = useCallback((message: string) => {
+    if (!message.trim()) return;
+    try {
+      const jsonData = JSON.parse(message) as SensorData & { type?: string; status?: string; message?: string };
+      // Las tramas del benchmark llegan a cientos por segundo: ni log ni estado
+      const benchFrame = parseBenchLine(jsonData as { type?: string }, message.length + 1);
+      if (benchFrame) {
+        benchCollectorRef.current?.add(benchFrame, performance.now());
+        return;
+      }
+      console.log('Mensaje recibido:', message)
+
+      // "info" y "started" son respuestas intermedias: la definitiva llega después
+      const requestId = (jsonData as { id?: unknown }).id;
+      const pending = typeof requestId === 'number' ? pendingRequestsRef.current.get(requestId) : undefined;
+      if (pending && jsonData.status !== 'info' && jsonData.status !== 'started') {
+        clearTimeout(pending.timer);
+        pendingRequestsRef.current.delete(requestId as number);
+        pending.resolve(jsonData as unknown as CommandResponse);
+      }
 
-      if (message.trim()) {
-        try {
-          console.log('Mensaje recibido:', message)
-          const jsonData = JSON.parse(message) as SensorData & { type?: string; status?: string; message?: string };
-          
-          if (jsonData.type && jsonData.type.includes('_response')) {
-            toast({
-              title: 'Respuesta del Dispositivo',
-              description: jsonData.message || 'Comando procesado.',
-              variant: jsonData.status === 'success' ? 'default' : 'destructive',
-            });
-          } else {
-            if (isMountedRef.current) {
-              setLastSensorData(prev => ({ ...(prev || {}), ...jsonData }));
+      if (jsonData.type === 'rx_credit' || jsonData.type === 'rx_flow_response') {
+        const credit = jsonData as unknown as Partial<RxFlow> & { enabled?: boolean; resend?: number[] };
+        if (jsonData.type === 'rx_flow_response') {
+          rxFlowRef.current = jsonData.status === 'success' && credit.enabled
+            ? { window: credit.window ?? 1, mtu: credit.mtu ?? 23, acked: credit.acked ?? 0, dropped: credit.dropped ?? 0 }
+            : null;
+        } else if (rxFlowRef.current && credit.acked !== undefined) {
+          const flow = rxFlowRef.current;
+          const dropped = credit.dropped ?? flow.dropped;
+          if (dropped > flow.dropped) {
+            // Sin "resend" el dispositivo descartó más líneas de las que recuerda
+            const resend = credit.resend ?? [];
+            rxLostRef.current += Math.max(0, dropped - flow.dropped - resend.length);
+            for (const seq of resend) {
+              const line = rxSentLinesRef.current.get(seq);
+              if (line !== undefined) rxResendRef.current.push(line);
+              else rxLostRef.current++;
             }
           }
-        } catch (parseError) {
-          console.warn('Error parseando JSON:', parseError, 'Mensaje:', `"${message}"`);
+          flow.acked = Math.max(flow.acked, credit.acked);
+          flow.dropped = Math.max(flow.dropped, dropped);
+          // Las anteriores a acked + dropped ya llegaron o están en "resend"
+          for (const seq of rxSentLinesRef.current.keys()) {
+            if (seq < flow.acked + flow.dropped) rxSentLinesRef.current.delete(seq);
+          }
+        }
+        creditWaitersRef.current = creditWaitersRef.current.filter(waiter => !waiter());
+        return;
+      } else if (jsonData.type === 'ota_data_response') {
+        if (jsonData.status === 'error' && !otaErrorRef.current) otaErrorRef.current = jsonData as unknown as CommandResponse;
+        return;
+      } else if (jsonData.type === 'telemetry_mode_response') {
+        console.log('Modo de telemetría:', jsonData.status, (jsonData as { mode?: string }).mode);
+      } else if (jsonData.type === 'history_sync_response') {
+        // "started" llega antes de los registros y "success" al terminar
+        const summary = jsonData as { status?: string; message?: string; sent?: number; duration_ms?: number };
+        console.log('Sincronización de histórico:', summary);
+        if (summary.status === 'started') return;
+        if (isMountedRef.current) setIsSyncingHistory(false);
+        toast({
+          title: summary.status === 'success' ? '📈 Histórico sincronizado' : 'Error de Histórico',
+          description: summary.status === 'success'
+            ? `${summary.sent ?? 0} registros en ${((summary.duration_ms ?? 0) / 1000).toFixed(1)} s.`
+            : summary.message,
+          variant: summary.status === 'success' ? 'default' : 'destructive',
+        });
+      } else if (jsonData.type === 'alert') {
+        // Las genera el dispositivo: llegan aunque solo se esté suscrito a alertas
+        const alert = jsonData as unknown as DeviceAlert;
+        if (isMountedRef.current) setAlerts(prev => [alert, ...prev].slice(0, MAX_ALERTS));
+        toast({
+          title: alert.state === 'cleared' ? '✅ Alerta resuelta' : '🚨 Alerta del dispositivo',
+          description: `${alert.channel} · ${alert.kind}${alert.value !== null ? ` (${alert.value})` : ''}`,
+          variant: alert.state === 'cleared' ? 'default' : 'destructive',
+        });
+      } else if (jsonData.type === 'diagnostics_response') {
+        // Sin toast: se pide periódicamente para las gráficas
+        if (isMountedRef.current) setDiagnostics(jsonData as unknown as Diagnostics);
+      } else if (jsonData.type && jsonData.type.includes('_response')) {
+        if (pending) return; // Quien la pidió con sendRequests() la gestiona
+        toast({
+          title: 'Respuesta del Dispositivo',
+          description: jsonData.message || 'Comando procesado.',
+          variant: jsonData.status === 'error' ? 'destructive' : 'default',
+        });
+      } else {
+        if (isMountedRef.current) {
+          setLastSensorData(prev => ({ ...(prev || {}), ...jsonData }));
         }
       }
+    } catch (parseError) {
+      console.warn('Error parseando JSON:', parseError, 'Mensaje:', `"${message}"`);
     }
   }, [toast]);
 
+  // El flujo TX mezcla líneas JSON terminadas en '\n' y tramas binarias de
+  // telemetría que empiezan por TELEMETRY_FRAME_MAGIC (completas, de tamaño fijo)
+  // o TELEMETRY_DELTA_MAGIC (parciales, con la longitud en el byte 2), además
+  // de registros del histórico y tramas de benchmark (BENCH_FRAME_MAGIC).
+  const handleNotifications = useCallback((value: DataView) => {
+    const chunk = new Uint8Array(value.buffer, value.byteOffset, value.byteLength);
+    const pending = receivedDataBuffer.current;
+    let buffer = new Uint8Array(pending.byteLength + chunk.byteLength);
+    buffer.set(pending);
+    buffer.set(chunk, pending.byteLength);
+
+    const decoder = new TextDecoder();
+    const historyBatch: HistoryRecord[] = [];
+    while (buffer.byteLength > 0) {
+      if (buffer[0] === TELEMETRY_FRAME_MAGIC) {
+        if (buffer.byteLength < TELEMETRY_FRAME_SIZE) break;
+        const telemetry = decodeTelemetryFrame(buffer.subarray(0, TELEMETRY_FRAME_SIZE));
+        if (telemetry) {
+          if (isMountedRef.current) {
+            setLastSensorData(prev => ({ ...(prev || {}), ...telemetry }));
+          }
+          buffer = buffer.subarray(TELEMETRY_FRAME_SIZE);
+        } else {
+          console.warn('Trama de telemetría inválida, resincronizando.');
+          buffer = buffer.subarray(1);
+        }
+        continue;
+      }
+
+      if (buffer[0] === TELEMETRY_DELTA_MAGIC) {
+        // Longitud variable: hace falta la cabecera para saber cuánto esperar
+        if (buffer.byteLength < TELEMETRY_DELTA_MIN_SIZE || buffer.byteLength < buffer[2]) break;
+        const delta = decodeTelemetryDelta(buffer);
+        if (delta) {
+          if (isMountedRef.current) {
+            setLastSensorData(prev => ({ ...(prev || {}), ...delta }));
+          }
+          buffer = buffer.subarray(buffer[2]);
+        } else {
+          console.warn('Trama parcial de telemetría inválida, resincronizando.');
+          buffer = buffer.subarray(1);
+        }
+        continue;
+      }
+
+      if (buffer[0] === BENCH_FRAME_MAGIC) {
+        if (buffer.byteLength < BENCH_FRAME_MIN_SIZE || buffer.byteLength < buffer[2]) break;
+        const frame = decodeBenchFrame(buffer);
+        if (frame) {
+          benchCollectorRef.current?.add(frame, performance.now());
+          buffer = buffer.subarray(frame.size);
+        } else {
+          console.warn('Trama de benchmark inválida, resincronizando.');
+          buffer = buffer.subarray(1);
+        }
+        continue;
+      }
+
+      if (buffer[0] === HISTORY_RECORD_MAGIC) {
+        if (buffer.byteLength < HISTORY_RECORD_SIZE) break;
+        const record = decodeHistoryRecord(buffer.subarray(0, HISTORY_RECORD_SIZE));
+        if (record) {
+          historyBatch.push(record);
+          buffer = buffer.subarray(HISTORY_RECORD_SIZE);
+        } else {
+          console.warn('Registro de histórico inválido, resincronizando.');
+          buffer = buffer.subarray(1);
+        }
+        continue;
+      }
+
+      const newline = buffer.indexOf(0x0a);
+      if (newline === -1) break;
+      handleJsonMessage(decoder.decode(buffer.subarray(0, newline)));
+      buffer = buffer.subarray(newline + 1);
+    }
+
+    receivedDataBuffer.current = buffer.slice();
+
+    // Los registros del histórico llegan a ráfagas: un único setState por notificación
+    if (historyBatch.length > 0) {
+      lastHistorySequenceRef.current = historyBatch[historyBatch.length - 1].sequence;
+      if (isMountedRef.current) setHistory(prev => [...prev, ...historyBatch]);
+    }
+  }, [handleJsonMessage]);
+
   const disconnect = useCallback(async (isExpected = false) => {
     const deviceId = connectedDeviceRef.current?.deviceId;
     if (!deviceId) return;
@@ -108,6 +328,15 @@ export function useBle() {
     }
 
     connectedDeviceRef.current = null;
+    pendingRequestsRef.current.forEach(({ reject, timer }) => {
+      clearTimeout(timer);
+      reject(new Error('Disconnected'));
+    });
+    pendingRequestsRef.current.clear();
+    rxFlowRef.current = null;
+    rxSentLinesRef.current.clear();
+    rxResendRef.current = [];
+    creditWaitersRef.current = creditWaitersRef.current.filter(waiter => !waiter());
     if (isMountedRef.current) {
       setConnectedDevice(null);
       setConnectionState('disconnected');
@@ -147,6 +376,12 @@ export function useBle() {
         await BleClient.requestMtu(device.deviceId, CHUNK_SIZE);
       } catch (e) { console.warn("MTU request failed", e); }
 
+      receivedDataBuffer.current = new Uint8Array(0);
+      rxFlowRef.current = null;
+      rxLinesSentRef.current = 0;
+      rxSentLinesRef.current.clear();
+      rxResendRef.current = [];
+      rxLostRef.current = 0;
       await BleClient.startNotifications(
         device.deviceId,
         UART_SERVICE_UUID,
@@ -154,6 +389,23 @@ export function useBle() {
         handleNotifications
       );
 
+      if (USE_BINARY_TELEMETRY) {
+        try {
+          const optIn = new TextEncoder().encode(JSON.stringify({ type: 'set_telemetry_mode', mode: 'binary' }) + '\n');
+          await BleClient.write(device.deviceId, UART_SERVICE_UUID, UART_RX_CHARACTERISTIC_UUID, new DataView(optIn.buffer));
+          rxLinesSentRef.current++;
+        } catch (e) { console.warn("Telemetry mode request failed", e); }
+      }
+
+      if (USE_RX_FLOW_CONTROL) {
+        // Hasta que llegue "rx_flow_response" se sigue escribiendo con respuesta
+        try {
+          const flowRequest = new TextEncoder().encode(JSON.stringify({ type: 'set_rx_flow', enabled: true }) + '\n');
+          await BleClient.write(device.deviceId, UART_SERVICE_UUID, UART_RX_CHARACTERISTIC_UUID, new DataView(flowRequest.buffer));
+          rxLinesSentRef.current++;
+        } catch (e) { console.warn("RX flow control request failed", e); }
+      }
+
       isConnectingRef.current = false;
       if (isMountedRef.current) setConnectionState('connected');
       toast({ title: '✅ ¡Conectado!', description: `Conectado a ${device.name || device.deviceId}`, duration: 3000 });
@@ -170,6 +422,7 @@ export function useBle() {
   
   const onDisconnected = useCallback((deviceId: string) => {
       if (!isMountedRef.current) return;
+      setIsSyncingHistory(false);
   
       if (expectDisconnectRef.current && lastConnectedDeviceIdRef.current === deviceId) {
           expectDisconnectRef.current = false;
@@ -257,6 +510,184 @@ export function useBle() {
     }
   }, [connectToDevice, toast, isNative, connectionState, stopScan]);
 
+  // Resuelve cuando hay crédito para una línea más, o con `drained` cuando todas
+  // las enviadas ya llegaron o se descartaron (o ya no hay control de flujo)
+  const waitForRxCredit = (drained = false) => new Promise<void>((resolve, reject) => {
+    const hasCredit = () => {
+      const flow = rxFlowRef.current;
+      if (flow && rxLinesSentRef.current - flow.acked - flow.dropped >= (drained ? 1 : flow.window)) return false;
+      resolve();
+      return true;
+    };
+    if (hasCredit()) return;
+    const waiter = () => {
+      if (!hasCredit()) return false;
+      clearTimeout(timer);
+      return true;
+    };
+    const timer = setTimeout(() => {
+      creditWaitersRef.current = creditWaitersRef.current.filter(other => other !== waiter);
+      reject(new Error('El dispositivo no devolvió crédito RX.'));
+    }, RX_CREDIT_TIMEOUT_MS);
+    creditWaitersRef.current.push(waiter);
+  });
+
+  // Escribe líneas JSON completas. Con control de flujo cada línea espera su
+  // crédito y va en escrituras sin respuesta del tamaño del MTU; las que el
+  // dispositivo descarte se reenvían antes que las nuevas, y al final se espera
+  // a que todas tengan destino. Sin él, con respuesta y pausas, como siempre.
+  // Las escrituras se encadenan para que dos envíos a la vez no mezclen sus trozos.
+  const writeLines = (lines: string[]) => {
+    const run = writeQueueRef.current.then(async () => {
+      const deviceId = connectedDeviceRef.current!.deviceId;
+      const encoder = new TextEncoder();
+
+      if (!rxFlowRef.current) {
+        const encodedData = encoder.encode(lines.map(line => line + '\n').join(''));
+        for (let i = 0; i < encodedData.byteLength; i += (CHUNK_SIZE - 3)) {
+          const chunkBuffer = encodedData.slice(i, i + (CHUNK_SIZE - 3));
+          await BleClient.write(deviceId, UART_SERVICE_UUID, UART_RX_CHARACTERISTIC_UUID, new DataView(chunkBuffer.buffer));
+          if (encodedData.byteLength > (CHUNK_SIZE - 3)) {
+            await new Promise(resolve => setTimeout(resolve, CHUNK_DELAY_MS));
+          }
+        }
+        rxLinesSentRef.current += lines.length;
+        return;
+      }
+
+      const queue = [...lines];
+      for (;;) {
+        if (rxResendRef.current.length === 0 && queue.length === 0) {
+          await waitForRxCredit(true);
+          if (rxResendRef.current.length === 0) break;
+        }
+        await waitForRxCredit();
+        const line = rxResendRef.current.shift() ?? queue.shift()!;
+        // Se anota antes de escribir: el "rx_credit" puede llegar antes de que la escritura resuelva
+        rxSentLinesRef.current.set(rxLinesSentRef.current++, line);
+        const encodedLine = encoder.encode(line + '\n');
+        const chunkSize = (rxFlowRef.current?.mtu ?? 23) - 3;
+        for (let i = 0; i < encodedLine.byteLength; i += chunkSize) {
+          const chunkBuffer = encodedLine.slice(i, i + chunkSize);
+          await BleClient.writeWithoutResponse(deviceId, UART_SERVICE_UUID, UART_RX_CHARACTERISTIC_UUID, new DataView(chunkBuffer.buffer));
+        }
+      }
+      if (rxLostRef.current > 0) {
+        rxLostRef.current = 0;
+        throw new Error('El dispositivo descartó líneas que no se pueden reenviar.');
+      }
+    });
+    writeQueueRef.current = run.catch(() => {});
+    return run;
+  };
+
+  // Envía varios comandos seguidos sin esperar a cada respuesta: cada uno lleva
+  // un "id" y su promesa se resuelve con la respuesta que lo repite, llegue en
+  // el orden que llegue. Van en grupos que caben en la cola del dispositivo.
+  const sendRequests = async (commands: object[], timeoutMs = REQUEST_TIMEOUT_MS): Promise<CommandResponse[]> => {
+    if (!connectedDeviceRef.current || connectionState !== 'connected') {
+      throw new Error('No hay un dispositivo conectado.');
+    }
+
+    const responses: CommandResponse[] = [];
+    for (let start = 0; start < commands.length; start += MAX_PIPELINED_COMMANDS) {
+      const group = commands.slice(start, start + MAX_PIPELINED_COMMANDS);
+      const ids: number[] = [];
+      const lines: string[] = [];
+      const pending = group.map(command => {
+        const id = nextRequestIdRef.current;
+        nextRequestIdRef.current = (id % 0xffffffff) + 1;
+        ids.push(id);
+        lines.push(JSON.stringify({ ...command, id }));
+        return new Promise<CommandResponse>((resolve, reject) => {
+          const timer = setTimeout(() => {
+            pendingRequestsRef.current.delete(id);
+            reject(new Error(`Sin respuesta al comando ${id}`));
+          }, timeoutMs);
+          pendingRequestsRef.current.set(id, { resolve, reject, timer });
+        });
+      });
+      try {
+        await writeLines(lines);
+      } catch (error) {
+        ids.forEach(id => {
+          clearTimeout(pendingRequestsRef.current.get(id)?.timer);
+          pendingRequestsRef.current.delete(id);
+        });
+        throw error;
+      }
+      responses.push(...await Promise.all(pending));
+    }
+    return responses;
+  };
+
+  // Sube una imagen de firmware por OTA. Si se cortó una subida de la misma
+  // imagen, el dispositivo responde con el offset desde el que continuar.
+  const uploadFirmware = async (image: Uint8Array, onProgress?: (sent: number, total: number) => void) => {
+    const digest = new Uint8Array(await crypto.subtle.digest('SHA-256', image));
+    const sha256 = Array.from(digest, byte => byte.toString(16).padStart(2, '0')).join('');
+    const [begin] = await sendRequests([{ type: 'ota_begin', size: image.byteLength, sha256 }]);
+    if (begin.status !== 'success') throw new Error(begin.message || 'ota_begin failed');
+
+    const chunkMax = (begin.chunk_max as number) || OTA_CHUNK_SIZE;
+    let offset = (begin.offset as number) || 0;
+    otaErrorRef.current = null;
+    while (offset < image.byteLength) {
+      const lines: string[] = [];
+      for (let i = 0; i < MAX_PIPELINED_COMMANDS && offset < image.byteLength; i++) {
+        const chunk = image.subarray(offset, offset + chunkMax);
+        lines.push(JSON.stringify({ type: 'ota_data', offset, data: btoa(String.fromCharCode(...chunk)) }));
+        offset += chunk.byteLength;
+      }
+      await writeLines(lines);
+      const error = otaErrorRef.current as CommandResponse | null;
+      if (error) throw new Error(`${error.message} (offset ${error.offset})`);
+      onProgress?.(offset, image.byteLength);
+    }
+
+    const [end] = await sendRequests([{ type: 'ota_end' }]);
+    if (end.status !== 'success') throw new Error(end.message || 'ota_end failed');
+    expectDisconnectRef.current = true; // Reinicia con la imagen nueva
+  };
+
+  // Lanza un benchmark en el dispositivo y mide lo que llega: pérdida, desorden,
+  // caudal y percentiles de latencia de un sentido. El desfase de relojes sale
+  // de la ida y vuelta más corta de varios "bench_sync". Con transport "mqtt" las
+  // tramas llegan por el broker: `attachMqtt` (de useMqtt) conecta el colector.
+  const runBenchmark = async (
+    options: BenchmarkOptions,
+    attachMqtt?: (collector: BenchmarkCollector | null) => void,
+  ): Promise<BenchmarkReport> => {
+    if (options.transport === 'mqtt' && !attachMqtt) throw new Error('MQTT benchmark needs attachMqtt.');
+
+    let best = { rttMs: Infinity, offsetUs: 0 };
+    for (let i = 0; i < BENCH_CLOCK_SYNC_SAMPLES; i++) {
+      const sentAt = performance.now();
+      const [sync] = await sendRequests([{ type: 'bench_sync' }]);
+      const receivedAt = performance.now();
+      const rttMs = receivedAt - sentAt;
+      if (rttMs < best.rttMs) {
+        best = { rttMs, offsetUs: (sync.device_us as number) - ((sentAt + receivedAt) / 2) * 1000 };
+      }
+    }
+
+    const collector = new BenchmarkCollector(best.offsetUs, best.rttMs);
+    if (options.transport === 'mqtt') attachMqtt!(collector); else benchCollectorRef.current = collector;
+    try {
+      // La respuesta con el "id" es el resumen final; "started" se descarta
+      const [summary] = await sendRequests(
+        [{ type: 'start_benchmark', ...options }],
+        options.duration_s * 1000 + BENCH_DRAIN_MS + REQUEST_TIMEOUT_MS,
+      );
+      if (summary.status !== 'success') throw new Error(summary.message || 'start_benchmark failed');
+      // Lo último puede ir aún de camino por el broker
+      if (options.transport === 'mqtt') await new Promise(resolve => setTimeout(resolve, 1000));
+      return collector.report(options, summary as unknown as BenchmarkDeviceSummary);
+    } finally {
+      if (options.transport === 'mqtt') attachMqtt!(null); else benchCollectorRef.current = null;
+    }
+  };
+
   const sendCommand = async (command: object) => {
     if (!connectedDeviceRef.current || connectionState !== 'connected') {
       toast({ variant: 'destructive', title: 'Error', description: 'No hay un dispositivo conectado.' });
@@ -267,23 +698,8 @@ export function useBle() {
         expectDisconnectRef.current = true;
     }
 
-    const jsonCommand = JSON.stringify(command) + '\n';
-    const encoder = new TextEncoder();
-    const encodedData = encoder.encode(jsonCommand);
-
     try {
-      for (let i = 0; i < encodedData.byteLength; i += (CHUNK_SIZE - 3)) {
-        const chunkBuffer = encodedData.slice(i, i + (CHUNK_SIZE - 3));
-        await BleClient.write(
-          connectedDeviceRef.current.deviceId,
-          UART_SERVICE_UUID,
-          UART_RX_CHARACTERISTIC_UUID,
-          new DataView(chunkBuffer.buffer)
-        );
-        if (encodedData.byteLength > (CHUNK_SIZE - 3)) {
-          await new Promise(resolve => setTimeout(resolve, CHUNK_DELAY_MS));
-        }
-      }
+      await writeLines([JSON.stringify(command)]);
       toast({
         title: '📤 Comando Enviado',
         description: 'La configuración se envió al dispositivo.',
@@ -297,6 +713,24 @@ export function useBle() {
     }
   };
 
+  // Pide al dispositivo los registros del histórico que aún no tenemos
+  const syncHistory = async () => {
+    setIsSyncingHistory(true);
+    const since = lastHistorySequenceRef.current;
+    await sendCommand(since === null ? { type: 'history_sync' } : { type: 'history_sync', since });
+  };
+
+  // Pide los histogramas de latencia y contadores; con reset empieza otra ventana
+  const requestDiagnostics = async (reset = false) => {
+    await sendCommand({ type: 'get_diagnostics', reset });
+  };
+
+  // Con alertsOnly el dispositivo deja de enviar telemetría y solo manda "alert"
+  const setAlertsOnly = async (alertsOnly: boolean) => {
+    const mode = alertsOnly ? 'alerts' : USE_BINARY_TELEMETRY ? 'binary' : 'json';
+    await sendCommand({ type: 'set_telemetry_mode', mode });
+  };
+
   return {
     connectionState,
     devices,
@@ -307,6 +741,16 @@ export function useBle() {
     connectToDevice,
     disconnect,
     sendCommand,
+    sendRequests,
+    uploadFirmware,
+    runBenchmark,
+    history,
+    isSyncingHistory,
+    syncHistory,
+    diagnostics,
+    requestDiagnostics,
+    alerts,
+    setAlertsOnly,
     isNative,
   };
 }
@@ -1,16 +1,18 @@
 
 'use client';
 
-import { useState, useEffect, useRef } from 'react';
+import { useState, useEffect, useRef, useCallback } from 'react';
 import mqtt, { MqttClient } from 'mqtt';
 import { useToast } from './use-toast';
 import { type SensorData } from '@/app/ble-connector';
+import { BENCH_FRAME_MAGIC, decodeBenchFrame, parseBenchLine, type BenchmarkCollector } from '@/lib/benchmark';
 
 type MqttStatus = 'Conectando' | 'Conectado' | 'Desconectado' | 'Error';
 
 // CONSTANTES MQTT - Cambia esto cuando migres a un broker de producción
 const MQTT_BROKER_URL = 'wss://broker.hivemq.com:8884/mqtt';
 const MQTT_TOPIC = 'aquadata/sensor-data';
+const MQTT_BENCH_TOPIC = 'aquadata/bench'; // MQTT_BENCH_TOPIC del firmware, una trama por mensaje
 // Definir un Client ID único para la aplicación web
 const MQTT_CLIENT_ID = `aquadata-webapp-${Math.random().toString(16).substr(2, 8)}`;
 
@@ -21,6 +23,15 @@ export function useMqtt(enabled: boolean) {
   const [sensorData, setSensorData] = useState<SensorData | null>(null);
   const clientRef = useRef<MqttClient | null>(null);
   const receivedDataBuffer = useRef('');
+  // Colector del benchmark en curso (ver runBenchmark en use-ble.ts)
+  const benchCollectorRef = useRef<BenchmarkCollector | null>(null);
+
+  const attachBenchmark = useCallback((collector: BenchmarkCollector | null) => {
+    benchCollectorRef.current = collector;
+    const client = clientRef.current;
+    if (!client) return;
+    if (collector) client.subscribe(MQTT_BENCH_TOPIC, { qos: 0 }); else client.unsubscribe(MQTT_BENCH_TOPIC);
+  }, []);
 
   const safeJsonParse = (messageStr: string): SensorData | null => {
     try {
@@ -94,6 +105,19 @@ export function useMqtt(enabled: boolean) {
     });
 
     client.on('message', (receivedTopic, payload) => {
+      if (receivedTopic === MQTT_BENCH_TOPIC) {
+        const arrivalMs = performance.now();
+        const bytes = new Uint8Array(payload.buffer, payload.byteOffset, payload.byteLength);
+        let frame = null;
+        if (bytes[0] === BENCH_FRAME_MAGIC) {
+          frame = decodeBenchFrame(bytes);
+        } else {
+          try { frame = parseBenchLine(JSON.parse(payload.toString()), bytes.byteLength); } catch { /* Trama corrupta */ }
+        }
+        if (frame) benchCollectorRef.current?.add(frame, arrivalMs);
+        return;
+      }
+
       receivedDataBuffer.current += payload.toString();
       
       // Procesar todos los mensajes completos en el buffer
@@ -147,7 +171,7 @@ export function useMqtt(enabled: boolean) {
     };
   }, [enabled, toast]);
 
-  return { connectionStatus, sensorData };
+  return { connectionStatus, sensorData, attachBenchmark };
 }
 
     
\ No newline at end of file
@@ -0,0 +1,133 @@
+import { crc16Ccitt } from '@/lib/telemetry-frame';
+
+// Trama binaria de benchmark v1 (ver BenchmarkRunner en src/esp32-reference-code.cpp).
+// Longitud variable en el byte 2; secuencia y hora del dispositivo (µs, u32) little-endian.
+export const BENCH_FRAME_MAGIC = 0xa9;
+export const BENCH_FRAME_VERSION = 1;
+export const BENCH_FRAME_MIN_SIZE = 14;
+
+export interface BenchFrame {
+  sequence: number;
+  deviceUs: number;
+  size: number;
+}
+
+export interface BenchmarkOptions {
+  encoding: 'json' | 'binary';
+  transport: 'ble' | 'mqtt';
+  rate_hz: number;
+  size: number;
+  duration_s: number;
+}
+
+/** Resumen de "benchmark_response" tal como lo envía el dispositivo. */
+export interface BenchmarkDeviceSummary {
+  sent: number;
+  bytes: number;
+  stalls: number;
+  duration_ms: number;
+  mtu: number;
+  conn_profile: string;
+  notifications: number;
+}
+
+export interface BenchmarkReport {
+  options: BenchmarkOptions;
+  device: BenchmarkDeviceSummary;
+  received: number;
+  lost: number;
+  duplicates: number;
+  reordered: number;
+  loss_rate: number;
+  reorder_rate: number;
+  throughput_bps: number;
+  frames_per_s: number;
+  clock_offset_us: number;
+  clock_rtt_ms: number;
+  latency_ms: { p50: number; p90: number; p99: number; max: number } | null;
+}
+
+/**
+ * Decodifica una trama binaria de benchmark. Devuelve null si la versión, la longitud o el CRC no coinciden.
+ */
+export function decodeBenchFrame(frame: Uint8Array): BenchFrame | null {
+  if (frame.byteLength < BENCH_FRAME_MIN_SIZE) return null;
+  const length = frame[2];
+  if (length < BENCH_FRAME_MIN_SIZE || frame.byteLength < length) return null;
+  const view = new DataView(frame.buffer, frame.byteOffset, length);
+
+  if (view.getUint8(0) !== BENCH_FRAME_MAGIC || view.getUint8(1) !== BENCH_FRAME_VERSION) return null;
+  if (crc16Ccitt(frame.subarray(0, length - 2)) !== view.getUint16(length - 2, true)) return null;
+  return { sequence: view.getUint32(4, true), deviceUs: view.getUint32(8, true), size: length };
+}
+
+function percentile(sorted: number[], p: number): number {
+  const index = Math.min(sorted.length - 1, Math.ceil((p / 100) * sorted.length) - 1);
+  return sorted[Math.max(0, index)];
+}
+
+/**
+ * Acumula las tramas de un benchmark. `clockOffsetUs` convierte la hora local
+ * (performance.now() en µs) a la del dispositivo; las horas del dispositivo son
+ * u32 y se comparan módulo 2^32.
+ */
+export class BenchmarkCollector {
+  private seen = new Set<number>();
+  private highest = -1;
+  private duplicates = 0;
+  private reordered = 0;
+  private bytes = 0;
+  private firstArrivalMs: number | null = null;
+  private lastArrivalMs = 0;
+  private latenciesMs: number[] = [];
+
+  constructor(readonly clockOffsetUs: number, readonly clockRttMs: number) {}
+
+  add(frame: BenchFrame, arrivalMs: number) {
+    if (this.firstArrivalMs === null) this.firstArrivalMs = arrivalMs;
+    this.lastArrivalMs = arrivalMs;
+    this.bytes += frame.size;
+
+    if (this.seen.has(frame.sequence)) {
+      this.duplicates++;
+      return;
+    }
+    this.seen.add(frame.sequence);
+    if (frame.sequence < this.highest) this.reordered++;
+    this.highest = Math.max(this.highest, frame.sequence);
+
+    const deviceNowUs = (Math.round(arrivalMs * 1000 + this.clockOffsetUs) >>> 0);
+    const latencyUs = (deviceNowUs - frame.deviceUs) >>> 0;
+    if (latencyUs < 0x80000000) this.latenciesMs.push(latencyUs / 1000); // Hacia atrás = desfase mal estimado
+  }
+
+  report(options: BenchmarkOptions, device: BenchmarkDeviceSummary): BenchmarkReport {
+    const received = this.seen.size;
+    const lost = Math.max(0, device.sent - received);
+    const spanS = this.firstArrivalMs === null ? 0 : (this.lastArrivalMs - this.firstArrivalMs) / 1000;
+    const sorted = [...this.latenciesMs].sort((a, b) => a - b);
+    return {
+      options,
+      device,
+      received,
+      lost,
+      duplicates: this.duplicates,
+      reordered: this.reordered,
+      loss_rate: device.sent ? lost / device.sent : 0,
+      reorder_rate: received ? this.reordered / received : 0,
+      throughput_bps: spanS > 0 ? this.bytes / spanS : 0,
+      frames_per_s: spanS > 0 ? received / spanS : 0,
+      clock_offset_us: this.clockOffsetUs,
+      clock_rtt_ms: this.clockRttMs,
+      latency_ms: sorted.length
+        ? { p50: percentile(sorted, 50), p90: percentile(sorted, 90), p99: percentile(sorted, 99), max: sorted[sorted.length - 1] }
+        : null,
+    };
+  }
+}
+
+/** Trama JSON {"type":"bench",...}; null si no lo es. */
+export function parseBenchLine(message: { type?: string; seq?: unknown; t_us?: unknown }, size: number): BenchFrame | null {
+  if (message.type !== 'bench' || typeof message.seq !== 'number' || typeof message.t_us !== 'number') return null;
+  return { sequence: message.seq, deviceUs: message.t_us, size };
+}
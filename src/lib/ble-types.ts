@@ -24,6 +24,68 @@ export interface SensorData {
     };
 }
 
+// Respuesta de "get_diagnostics". buckets[i] cuenta las muestras en [2^i, 2^(i+1)) µs.
+export interface DiagnosticsStage {
+  count: number;
+  avg_us: number;
+  p50_us: number;
+  p99_us: number;
+  max_us: number;
+  buckets: number[];
+}
+
+export interface Diagnostics {
+  uptime_ms: number;
+  window_ms: number;
+  stages: Record<'rx_frame' | 'parse' | 'handler' | 'serialize' | 'notify' | 'command', DiagnosticsStage>;
+  ble: {
+    rx_writes: number;
+    rx_bytes: number;
+    tx_bytes: number;
+    notifications: number;
+    notify_errors: number;
+    tx_dropped: number;
+    mtu: number;
+  };
+  commands: { processed: number; parse_errors: number; unknown: number; queue_overflows: number; too_long: number; registration_errors: number };
+  heap: { free: number; min_free: number; max_alloc: number };
+  log: { written: number; dropped: number; suppressed: number };
+  // Hitos del arranque en µs desde el reset (null = aún no); wake_cause es esp_sleep_wakeup_cause_t
+  boot?: Record<
+    'setup' | 'config' | 'ble_init' | 'advertising' | 'history' | 'sensors' | 'network' | 'ready' |
+    'first_sample' | 'first_connection',
+    number | null
+  > & { wake_cause: number };
+}
+
+// Línea "alert" emitida por el propio dispositivo. "raised"/"cleared" marcan
+// la entrada y salida de un umbral o fallo de sonda; "event", un aviso puntual.
+export interface DeviceAlert {
+  type: 'alert';
+  seq: number;
+  channel: 'ph' | 'do_conc' | 'do_sat' | 'temp';
+  kind: 'low' | 'high' | 'sensor' | 'rate' | 'deviation';
+  state: 'raised' | 'cleared' | 'event';
+  value: number | null;
+  limit: number | null;
+  rate_per_min?: number;
+  z?: number;
+  mean?: number;
+  uptime_s: number;
+}
+
+// Respuesta a un comando. Si la petición llevaba "id" numérico, vuelve el mismo;
+// exec_us es lo que tardó en ejecutarse y queue_us lo que esperó en la cola.
+export interface CommandResponse {
+  type: string;
+  status?: string;
+  message?: string;
+  id?: number;
+  exec_us?: number;
+  queue_us?: number;
+  [key: string]: unknown;
+}
+
 export type ConnectionState = 'disconnected' | 'scanning' | 'connecting' | 'connected' | 'error';
 
 export const UART_SERVICE_UUID = '6e400001-b5a3-f393-e0a9-e50e24dcca9e';
@@ -34,3 +96,17 @@ export const SCAN_DURATION_MS = 10000;
 export const CONNECTION_TIMEOUT_MS = 15000;
 export const CHUNK_SIZE = 512;
 export const CHUNK_DELAY_MS = 100;
+export const REQUEST_TIMEOUT_MS = 60000; // wifi_config responde al terminar sus intentos
+export const MAX_PIPELINED_COMMANDS = 5; // RX_CREDIT_WINDOW del firmware (su parte de la cola)
+
+// Pedir créditos RX ("set_rx_flow") y escribir sin respuesta dentro de la ventana
+// anunciada. Si el firmware no lo soporta, se sigue escribiendo con respuesta.
+export const USE_RX_FLOW_CONTROL = true;
+export const RX_CREDIT_TIMEOUT_MS = 5000;
+export const OTA_CHUNK_SIZE = 256; // OTA_CHUNK_MAX del firmware
+export const BENCH_CLOCK_SYNC_SAMPLES = 8; // Idas y vueltas para estimar el desfase de relojes
+export const BENCH_DRAIN_MS = 5000; // Margen del firmware para vaciar lo atrasado
+
+// Pedir al ESP32 la trama binaria de telemetría (ver src/lib/telemetry-frame.ts).
+// Si el firmware no la soporta, sigue enviando JSON.
+export const USE_BINARY_TELEMETRY = true;
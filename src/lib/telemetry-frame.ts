@@ -0,0 +1,163 @@
+import type { SensorData } from '@/lib/ble-types';
+
+// Trama binaria de telemetría v1 (ver TelemetryFrame en src/esp32-reference-code.cpp).
+// 32 bytes little-endian; los valores van escalados a enteros y INT16_MIN indica "sin lectura".
+export const TELEMETRY_FRAME_MAGIC = 0xa5;
+export const TELEMETRY_FRAME_VERSION = 1;
+export const TELEMETRY_FRAME_SIZE = 32;
+
+const NO_READING = -32768;
+
+const STATUS_TEXT = [
+  '⚪ Sensor reading error',
+  '🔴 Critical levels detected',
+  '🟡 Warning levels detected',
+  '🟢 All systems normal',
+];
+
+const WIFI_STATUS: SensorData['wifi_status'][] = ['disconnected', 'connecting', 'connected', 'disconnected'];
+
+export function crc16Ccitt(bytes: Uint8Array): number {
+  let crc = 0xffff;
+  for (const byte of bytes) {
+    crc ^= byte << 8;
+    for (let bit = 0; bit < 8; bit++) {
+      crc = crc & 0x8000 ? ((crc << 1) ^ 0x1021) & 0xffff : (crc << 1) & 0xffff;
+    }
+  }
+  return crc;
+}
+
+function formatUptime(uptimeS: number): string {
+  const pad = (n: number) => n.toString().padStart(2, '0');
+  return `${pad(Math.floor(uptimeS / 3600))}:${pad(Math.floor(uptimeS / 60) % 60)}:${pad(uptimeS % 60)}`;
+}
+
+function scaled(value: number, scale: number): number | undefined {
+  return value === NO_READING ? undefined : value / scale;
+}
+
+/**
+ * Decodifica una trama completa. Devuelve null si la versión, la longitud o el CRC no coinciden.
+ */
+export function decodeTelemetryFrame(frame: Uint8Array): (SensorData & { sequence: number }) | null {
+  if (frame.byteLength < TELEMETRY_FRAME_SIZE) return null;
+  const view = new DataView(frame.buffer, frame.byteOffset, TELEMETRY_FRAME_SIZE);
+
+  if (view.getUint8(0) !== TELEMETRY_FRAME_MAGIC || view.getUint8(1) !== TELEMETRY_FRAME_VERSION) return null;
+  if (view.getUint8(2) !== TELEMETRY_FRAME_SIZE) return null;
+  if (crc16Ccitt(frame.subarray(0, TELEMETRY_FRAME_SIZE - 2)) !== view.getUint16(TELEMETRY_FRAME_SIZE - 2, true)) {
+    return null;
+  }
+
+  const flags = view.getUint8(3);
+  return {
+    type: 'telemetry',
+    status: STATUS_TEXT[flags & 0x03],
+    wifi_status: WIFI_STATUS[(flags >> 2) & 0x03],
+    timestamp: formatUptime(view.getUint32(4, true)),
+    ph: scaled(view.getInt16(8, true), 100),
+    do_conc: scaled(view.getInt16(10, true), 100),
+    do_sat: scaled(view.getInt16(12, true), 10),
+    temp: scaled(view.getInt16(14, true), 100),
+    readings_count: { ph: view.getUint16(16, true), do: view.getUint16(18, true) },
+    errors_count: { ph: view.getUint16(20, true), do: view.getUint16(22, true) },
+    altitude_info: {
+      meters: view.getInt16(24, true),
+      correction_factor: view.getUint16(26, true) / 10000,
+    },
+    sequence: view.getUint16(28, true),
+  };
+}
+
+// Trama parcial v1 (ver encodeTelemetryDelta en src/esp32-reference-code.cpp): solo
+// los campos que han cambiado más que su banda muerta. La longitud va en el byte 2.
+export const TELEMETRY_DELTA_MAGIC = 0xa8;
+export const TELEMETRY_DELTA_VERSION = 1;
+export const TELEMETRY_DELTA_MIN_SIZE = 13;
+export const TELEMETRY_DELTA_MAX_SIZE = 21;
+
+const DELTA_HEADER_SIZE = 11;
+const DELTA_FIELDS: { key: 'ph' | 'do_conc' | 'do_sat' | 'temp'; scale: number }[] = [
+  { key: 'ph', scale: 100 },
+  { key: 'do_conc', scale: 100 },
+  { key: 'do_sat', scale: 10 },
+  { key: 'temp', scale: 100 },
+];
+
+/**
+ * Decodifica una trama parcial. Devuelve solo los campos presentes, para mezclarlos con
+ * la última lectura, o null si la versión, la longitud o el CRC no coinciden.
+ */
+export function decodeTelemetryDelta(frame: Uint8Array): (Partial<SensorData> & { sequence: number }) | null {
+  if (frame.byteLength < TELEMETRY_DELTA_MIN_SIZE) return null;
+  const length = frame[2];
+  if (length < TELEMETRY_DELTA_MIN_SIZE || length > TELEMETRY_DELTA_MAX_SIZE || frame.byteLength < length) return null;
+  const view = new DataView(frame.buffer, frame.byteOffset, length);
+
+  if (view.getUint8(0) !== TELEMETRY_DELTA_MAGIC || view.getUint8(1) !== TELEMETRY_DELTA_VERSION) return null;
+  if (crc16Ccitt(frame.subarray(0, length - 2)) !== view.getUint16(length - 2, true)) return null;
+
+  const flags = view.getUint8(3);
+  const mask = view.getUint8(4);
+  const delta: Partial<SensorData> & { sequence: number } = {
+    status: STATUS_TEXT[flags & 0x03],
+    wifi_status: WIFI_STATUS[(flags >> 2) & 0x03],
+    timestamp: formatUptime(view.getUint32(7, true)),
+    sequence: view.getUint16(5, true),
+  };
+  let offset = DELTA_HEADER_SIZE;
+  DELTA_FIELDS.forEach(({ key, scale }, bit) => {
+    if (!(mask & (1 << bit))) return;
+    if (offset + 2 > length - 2) return;
+    delta[key] = scaled(view.getInt16(offset, true), scale);
+    offset += 2;
+  });
+  return delta;
+}
+
+// Registro del histórico en flash v1 (ver HistoryRecord en src/esp32-reference-code.cpp).
+// El dispositivo los envía tal cual, uno tras otro, en respuesta a "history_sync".
+export const HISTORY_RECORD_MAGIC = 0xa6;
+export const HISTORY_RECORD_VERSION = 1;
+export const HISTORY_RECORD_SIZE = 32;
+
+export interface HistoryRecord {
+  sequence: number;
+  boot: number;
+  uptime_s: number;
+  status: string;
+  ph?: number;
+  do_conc?: number;
+  do_sat?: number;
+  temp?: number;
+  altitude_m: number;
+  correction_factor: number;
+}
+
+/**
+ * Decodifica un registro del histórico. Devuelve null si la versión, la longitud o el CRC no coinciden.
+ */
+export function decodeHistoryRecord(record: Uint8Array): HistoryRecord | null {
+  if (record.byteLength < HISTORY_RECORD_SIZE) return null;
+  const view = new DataView(record.buffer, record.byteOffset, HISTORY_RECORD_SIZE);
+
+  if (view.getUint8(0) !== HISTORY_RECORD_MAGIC || view.getUint8(1) !== HISTORY_RECORD_VERSION) return null;
+  if (view.getUint8(2) !== HISTORY_RECORD_SIZE) return null;
+  if (crc16Ccitt(record.subarray(0, HISTORY_RECORD_SIZE - 2)) !== view.getUint16(HISTORY_RECORD_SIZE - 2, true)) {
+    return null;
+  }
+
+  return {
+    sequence: view.getUint32(4, true),
+    uptime_s: view.getUint32(8, true),
+    boot: view.getUint16(12, true),
+    status: STATUS_TEXT[view.getUint8(3) & 0x03],
+    ph: scaled(view.getInt16(14, true), 100),
+    do_conc: scaled(view.getInt16(16, true), 100),
+    do_sat: scaled(view.getInt16(18, true), 10),
+    temp: scaled(view.getInt16(20, true), 100),
+    altitude_m: view.getInt16(22, true),
+    correction_factor: view.getUint16(24, true) / 10000,
+  };
+}
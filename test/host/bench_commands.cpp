@@ -0,0 +1,200 @@
+// Banco de pruebas del camino de comandos, compilado para el host contra los
+// simulacros de mock/. Cada iteración recorre lo mismo que una escritura BLE en
+// el dispositivo, salvo la cola hacia commandTask: LineFramer::feed(),
+// processCommand() (parseo, handler y respuesta en el anillo TX de la sesión)
+// y TxScheduler::drain() contra una BLECharacteristic simulada.
+//
+// Por caso informa de comandos por segundo, reservas de memoria por comando y
+// latencia p50/p99, y comprueba que la respuesta sea la esperada: si un cambio
+// rompe un handler o el despacho, el banco falla en lugar de medir otra cosa.
+//
+//   bench_commands [--iterations N] [--warmup N]
+
+#include "esp32-reference-code.cpp"
+
+#include <chrono>
+#include <new>
+#include <string>
+#include <vector>
+
+// --- Recuento de reservas ---
+// operator new pasa por malloc en libstdc++ y ArduinoJson usa malloc con su
+// asignador por defecto, así que basta con interceptar la familia malloc.
+static std::atomic<uint64_t> allocationCount{0};
+
+#if defined(__GLIBC__)
+extern "C" {
+void* __libc_malloc(size_t);
+void* __libc_calloc(size_t, size_t);
+void* __libc_realloc(void*, size_t);
+void __libc_free(void*);
+
+void* malloc(size_t size) {
+    allocationCount.fetch_add(1, std::memory_order_relaxed);
+    return __libc_malloc(size);
+}
+void* calloc(size_t count, size_t size) {
+    allocationCount.fetch_add(1, std::memory_order_relaxed);
+    return __libc_calloc(count, size);
+}
+void* realloc(void* ptr, size_t size) {
+    allocationCount.fetch_add(1, std::memory_order_relaxed);
+    return __libc_realloc(ptr, size);
+}
+void free(void* ptr) { __libc_free(ptr); }
+}
+#else
+// Fuera de glibc solo se cuentan las reservas de C++
+void* operator new(size_t size) {
+    allocationCount.fetch_add(1, std::memory_order_relaxed);
+    if (void* ptr = std::malloc(size)) return ptr;
+    throw std::bad_alloc();
+}
+void operator delete(void* ptr) noexcept { std::free(ptr); }
+void operator delete(void* ptr, size_t) noexcept { std::free(ptr); }
+#endif
+
+namespace {
+
+struct BenchCase {
+    const char* name;
+    std::string line;      // Lo que escribe la app, sin el '\n'
+    const char* expected;  // Texto que debe aparecer en la respuesta
+};
+
+struct BenchResult {
+    double commandsPerSecond;
+    double allocationsPerCommand;
+    double notificationsPerCommand;
+    double meanUs, p50Us, p99Us, maxUs;
+};
+
+BLECharacteristic characteristic("tx", BLECharacteristic::PROPERTY_NOTIFY);
+Session* session = nullptr;
+
+// Una escritura completa: framer, despacho y vaciado del anillo TX
+void runOnce(const std::string& frame) {
+    session->framer.feed(reinterpret_cast<const uint8_t*>(frame.data()), frame.size(),
+                         [](const char* line, size_t len) {
+                             currentSession = session;
+                             processCommand(*session, line, len, esp_timer_get_time());
+                         });
+    session->tx.drain(&characteristic);
+}
+
+double percentile(const std::vector<double>& sorted, double p) {
+    size_t index = (size_t)(p / 100.0 * sorted.size());
+    return sorted[std::min(index, sorted.size() - 1)];
+}
+
+BenchResult run(const BenchCase& bench, uint32_t iterations, uint32_t warmup) {
+    std::string frame = bench.line + "\n";
+    for (uint32_t i = 0; i < warmup; i++) runOnce(frame);
+
+    std::vector<double> latenciesUs;
+    latenciesUs.reserve(iterations);
+    uint32_t notificationsBefore = characteristic.notifications;
+    uint64_t allocationsBefore = allocationCount.load();
+    auto started = std::chrono::steady_clock::now();
+    for (uint32_t i = 0; i < iterations; i++) {
+        auto t0 = std::chrono::steady_clock::now();
+        runOnce(frame);
+        auto t1 = std::chrono::steady_clock::now();
+        latenciesUs.push_back(std::chrono::duration<double, std::micro>(t1 - t0).count());
+    }
+    double elapsedS = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+    // reserve() ya asignó el vector: lo medido es solo el camino del comando
+    uint64_t allocations = allocationCount.load() - allocationsBefore;
+
+    BenchResult result;
+    result.commandsPerSecond = iterations / elapsedS;
+    result.allocationsPerCommand = (double)allocations / iterations;
+    result.notificationsPerCommand = (double)(characteristic.notifications - notificationsBefore) / iterations;
+    double total = 0;
+    for (double us : latenciesUs) total += us;
+    result.meanUs = total / iterations;
+    std::sort(latenciesUs.begin(), latenciesUs.end());
+    result.p50Us = percentile(latenciesUs, 50);
+    result.p99Us = percentile(latenciesUs, 99);
+    result.maxUs = latenciesUs.back();
+    return result;
+}
+
+// La respuesta de una sola ejecución, para comprobar que el caso mide lo que dice
+bool responds(const BenchCase& bench) {
+    characteristic.clearSent();
+    runOnce(bench.line + "\n");
+    if (strstr(characteristic.sent, bench.expected) != nullptr) return true;
+    std::fprintf(stderr, "%s: se esperaba \"%s\" en la respuesta, llegó: %s\n", bench.name, bench.expected,
+                 characteristic.sentLen ? characteristic.sent : "(nada)");
+    return false;
+}
+
+// Lo que setup() y bootStageJob() dejan hecho antes de procesar comandos, sin
+// BLE, tareas ni red de verdad
+void bootForBench() {
+    config.begin();
+    Settings settings = config.get();
+    applyAltitude(settings.altitudeM);
+    calibration.begin(settings);
+    sessions.start(xTaskGetCurrentTaskHandle());
+    for (uint8_t phase = BOOT_SETUP; phase <= BOOT_NETWORK; phase++) bootTimeline.mark((BootPhase)phase);
+
+    const esp_bd_addr_t peer = {0x02, 0x00, 0x00, 0x00, 0x00, 0x01};
+    session = sessions.open(0, peer, 247); // MTU típico de Android tras negociar
+    session->subscribed = true;
+}
+
+uint32_t parseCount(const char* text) {
+    char* end = nullptr;
+    unsigned long value = strtoul(text, &end, 10);
+    if (end == text || *end != '\0' || value == 0) {
+        std::fprintf(stderr, "Número no válido: %s\n", text);
+        std::exit(2);
+    }
+    return (uint32_t)value;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    uint32_t iterations = 20000;
+    uint32_t warmup = 200;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--iterations") == 0 && i + 1 < argc) {
+            iterations = parseCount(argv[++i]);
+        } else if (strcmp(argv[i], "--warmup") == 0 && i + 1 < argc) {
+            warmup = parseCount(argv[++i]);
+        } else {
+            std::fprintf(stderr, "Uso: %s [--iterations N] [--warmup N]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    bootForBench();
+
+    const BenchCase cases[] = {
+        {"wifi_config", R"({"type":"wifi_config","ssid":"bench-net","password":"correct-horse","id":7})",
+         "\"wifi_config_response\""},
+        {"set_altitude", R"({"type":"set_altitude","value":1200,"id":8})", "\"altitude_set_response\""},
+        {"malformed_json", R"({"type":"set_altitude","value":)", "Invalid JSON format."},
+        {"unknown_type", R"({"type":"no_such_command"})", "Unknown command type."},
+        // Más larga que MAX_COMMAND_LENGTH: el framer la descarta sin despachar
+        {"too_long", std::string("{\"type\":\"wifi_config\",\"ssid\":\"") + std::string(MAX_COMMAND_LENGTH, 'x') + "\"}",
+         ""},
+    };
+
+    bool ok = true;
+    std::printf("%-16s %10s %12s %10s %10s %10s %10s %12s %11s\n", "Benchmark", "Iterations", "cmd/s",
+                "mean_us", "p50_us", "p99_us", "max_us", "allocs/cmd", "notify/cmd");
+    for (const BenchCase& bench : cases) {
+        if (bench.expected[0] != '\0' && !responds(bench)) ok = false;
+        BenchResult r = run(bench, iterations, warmup);
+        std::printf("%-16s %10u %12.0f %10.2f %10.2f %10.2f %10.2f %12.2f %11.2f\n", bench.name,
+                    (unsigned)iterations, r.commandsPerSecond, r.meanUs, r.p50Us, r.p99Us, r.maxUs,
+                    r.allocationsPerCommand, r.notificationsPerCommand);
+    }
+    std::printf("framer overflows: %u, tx dropped: %u\n", (unsigned)session->framer.overflowCount.load(),
+                (unsigned)session->tx.statistics().dropped);
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,97 @@
+// Fuzzer de LineFramer. El primer byte elige cómo se trocea el resto en
+// escrituras BLE; el resultado se compara con un modelo que parte la entrada
+// entera por '\n', así cualquier diferencia que dependa del troceo (líneas
+// perdidas, duplicadas, mal recortadas o desbordamientos mal contados) aborta.
+// Se prueba con una capacidad pequeña, para llegar a menudo al descarte de
+// líneas largas, y con la de las sesiones (MAX_COMMAND_LENGTH).
+//
+// Con clang se enlaza con libFuzzer (-fsanitize=fuzzer). Con otros
+// compiladores fuzz_main.cpp aporta un main() que ejecuta los ficheros o
+// directorios de corpus que reciba y después entradas aleatorias (-runs=N).
+
+#include "esp32-reference-code.cpp"
+
+#include <string>
+#include <vector>
+
+namespace {
+
+void require(bool condition, const char* what) {
+    if (!condition) {
+        std::fprintf(stderr, "LineFramer: %s\n", what);
+        std::abort();
+    }
+}
+
+struct Expected {
+    std::vector<std::string> lines;
+    uint32_t overflows = 0;
+};
+
+bool isSpace(char c) { return isspace((unsigned char)c) != 0; }
+
+// Modelo: cada tramo terminado en '\n' de como mucho Capacity bytes se entrega
+// recortado (si no queda vacío); uno más largo, o el final sin '\n' que ya no
+// cabe, cuenta un desbordamiento
+template <size_t Capacity>
+Expected model(const uint8_t* data, size_t size) {
+    Expected expected;
+    const char* text = reinterpret_cast<const char*>(data);
+    size_t start = 0;
+    for (size_t i = 0; i <= size; i++) {
+        bool complete = i < size && text[i] == '\n';
+        if (!complete && i < size) continue;
+        size_t len = i - start;
+        if (len > Capacity) {
+            expected.overflows++;
+        } else if (complete) {
+            size_t begin = start, end = i;
+            while (begin < end && isSpace(text[begin])) begin++;
+            while (end > begin && isSpace(text[end - 1])) end--;
+            if (end > begin) expected.lines.emplace_back(text + begin, end - begin);
+        }
+        start = i + 1;
+    }
+    return expected;
+}
+
+template <size_t Capacity>
+void check(const uint8_t* data, size_t size, uint8_t seed) {
+    static LineFramer<Capacity> framer; // Estático: el buffer de 512 B no va a la pila en cada entrada
+    framer.reset();
+    framer.overflowCount = 0;
+
+    std::vector<std::string> lines;
+    auto onLine = [&lines](const char* line, size_t len) {
+        require(len > 0 && len <= Capacity, "longitud de línea fuera de rango");
+        require(memchr(line, '\n', len) == nullptr, "línea con '\\n'");
+        require(!isSpace(line[0]) && !isSpace(line[len - 1]), "línea sin recortar");
+        lines.emplace_back(line, len);
+    };
+
+    // Escrituras de 1 a 64 bytes (1 a 256 si el bit alto de la semilla está
+    // puesto), como las de un MTU pequeño o uno ya negociado
+    uint32_t state = seed * 2654435761u + 1;
+    uint32_t maxChunk = (seed & 0x80) ? 256 : 64;
+    size_t offset = 0;
+    while (offset < size) {
+        state = state * 1664525u + 1013904223u;
+        size_t chunk = std::min<size_t>(1 + (state >> 16) % maxChunk, size - offset);
+        framer.feed(data + offset, chunk, onLine);
+        offset += chunk;
+    }
+
+    Expected expected = model<Capacity>(data, size);
+    require(lines == expected.lines, "líneas distintas de las del modelo");
+    require(framer.overflowCount.load() == expected.overflows, "desbordamientos mal contados");
+}
+
+}  // namespace
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+    if (size == 0) return 0;
+    uint8_t seed = data[0];
+    check<32>(data + 1, size - 1, seed);
+    check<MAX_COMMAND_LENGTH>(data + 1, size - 1, seed);
+    return 0;
+}
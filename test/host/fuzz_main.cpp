@@ -0,0 +1,87 @@
+// main() para los fuzzers cuando no hay libFuzzer (p. ej. con g++). Acepta
+// las mismas opciones básicas: ficheros o directorios de corpus, -runs=N,
+// -seed=N y -max_len=N. Tras el corpus genera entradas aleatorias, con muchos
+// '\n' y espacios para que las líneas sean cortas y variadas.
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <dirent.h>
+#include <random>
+#include <string>
+#include <sys/stat.h>
+#include <vector>
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size);
+
+namespace {
+
+bool runFile(const std::string& path) {
+    FILE* file = std::fopen(path.c_str(), "rb");
+    if (file == nullptr) return false;
+    std::vector<uint8_t> data;
+    uint8_t buffer[4096];
+    size_t n;
+    while ((n = std::fread(buffer, 1, sizeof(buffer), file)) > 0) data.insert(data.end(), buffer, buffer + n);
+    std::fclose(file);
+    LLVMFuzzerTestOneInput(data.data(), data.size());
+    return true;
+}
+
+size_t runPath(const std::string& path) {
+    struct stat info;
+    if (stat(path.c_str(), &info) != 0) {
+        std::fprintf(stderr, "No existe: %s\n", path.c_str());
+        std::exit(2);
+    }
+    if (!S_ISDIR(info.st_mode)) return runFile(path) ? 1 : 0;
+
+    size_t count = 0;
+    if (DIR* dir = opendir(path.c_str())) {
+        while (dirent* entry = readdir(dir)) {
+            if (entry->d_name[0] == '.') continue;
+            count += runFile(path + "/" + entry->d_name) ? 1 : 0;
+        }
+        closedir(dir);
+    }
+    return count;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    unsigned long runs = 10000, seed = 1, maxLen = 4096;
+    std::vector<std::string> paths;
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "-runs=", 6) == 0) {
+            runs = strtoul(argv[i] + 6, nullptr, 10);
+        } else if (strncmp(argv[i], "-seed=", 6) == 0) {
+            seed = strtoul(argv[i] + 6, nullptr, 10);
+        } else if (strncmp(argv[i], "-max_len=", 9) == 0) {
+            maxLen = strtoul(argv[i] + 9, nullptr, 10);
+        } else if (argv[i][0] == '-') {
+            std::fprintf(stderr, "Opción no admitida: %s\n", argv[i]);
+            return 2;
+        } else {
+            paths.push_back(argv[i]);
+        }
+    }
+
+    size_t corpus = 0;
+    for (const std::string& path : paths) corpus += runPath(path);
+
+    static const char ALPHABET[] = "\n\n\n\r \t{}\":,abcxyz019";
+    std::mt19937 rng(seed);
+    std::vector<uint8_t> data;
+    for (unsigned long run = 0; run < runs; run++) {
+        data.resize(rng() % (maxLen + 1));
+        bool binary = rng() % 4 == 0; // A veces bytes cualquiera
+        for (uint8_t& byte : data) {
+            byte = binary ? (uint8_t)rng() : (uint8_t)ALPHABET[rng() % (sizeof(ALPHABET) - 1)];
+        }
+        LLVMFuzzerTestOneInput(data.data(), data.size());
+    }
+    std::printf("Done: %zu corpus inputs, %lu random runs (seed %lu)\n", corpus, runs, seed);
+    return 0;
+}
@@ -0,0 +1,96 @@
+// Núcleo Arduino-ESP32 mínimo para compilar el sketch en el host. Solo lo que
+// usa src/esp32-reference-code.cpp; el reloj es el monotónico del sistema.
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cctype>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "freertos/queue.h"
+#include "esp_timer.h"
+
+#define IRAM_ATTR
+#define DRAM_ATTR
+#define RTC_DATA_ATTR
+#define RTC_NOINIT_ATTR
+
+inline unsigned long millis() { return (unsigned long)(esp_timer_get_time() / 1000); }
+inline unsigned long micros() { return (unsigned long)esp_timer_get_time(); }
+inline TickType_t xTaskGetTickCount() { return (TickType_t)millis(); }
+inline void delay(unsigned long) {}
+inline void yield() {}
+
+#define constrain(amt, low, high) ((amt) < (low) ? (low) : ((amt) > (high) ? (high) : (amt)))
+
+inline long random(long max) { return max > 0 ? std::rand() % max : 0; }
+inline long random(long min, long max) { return max > min ? min + random(max - min) : min; }
+inline uint32_t getCpuFrequencyMhz() { return 240; }
+inline size_t getArduinoLoopTaskStackSize() { return 8192; }
+
+inline bool btStop() { return true; }
+inline void esp_restart() { std::abort(); }
+inline void esp_system_abort(const char* details) {
+    std::fprintf(stderr, "abort: %s\n", details);
+    std::abort();
+}
+
+// glibc la trae desde la 2.38; macOS, los BSD y musl, desde siempre
+#if defined(__GLIBC__) && !__GLIBC_PREREQ(2, 38)
+extern "C" inline size_t strlcpy(char* dst, const char* src, size_t size) {
+    size_t len = std::strlen(src);
+    if (size) {
+        size_t n = std::min(len, size - 1);
+        std::memcpy(dst, src, n);
+        dst[n] = '\0';
+    }
+    return len;
+}
+#endif
+
+class String {
+  public:
+    String(const char* text = "") : value(text ? text : "") {}
+    const char* c_str() const { return value.c_str(); }
+    size_t length() const { return value.size(); }
+
+  private:
+    std::string value;
+};
+
+// El log del sketch acaba aquí; en el host se descarta salvo HOST_SERIAL_STDOUT
+struct HardwareSerial {
+    void begin(unsigned long) {}
+    size_t write(const uint8_t* data, size_t len) {
+#ifdef HOST_SERIAL_STDOUT
+        return std::fwrite(data, 1, len, stdout);
+#else
+        (void)data;
+        return len;
+#endif
+    }
+    size_t println(const char* line) {
+#ifdef HOST_SERIAL_STDOUT
+        return std::printf("%s\n", line);
+#else
+        return std::strlen(line) + 1;
+#endif
+    }
+};
+inline HardwareSerial Serial;
+
+struct EspClass {
+    uint32_t getFreeHeap() { return 200 * 1024; }
+    uint32_t getMinFreeHeap() { return 180 * 1024; }
+    uint32_t getMaxAllocHeap() { return 110 * 1024; }
+    uint64_t getEfuseMac() { return 0x0000AABBCCDDEEFFULL; }
+};
+inline EspClass ESP;
@@ -0,0 +1,5 @@
+#pragma once
+#include "BLEServer.h"
+
+// CCCD de notificaciones
+class BLE2902 : public BLEDescriptor {};
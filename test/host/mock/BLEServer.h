@@ -0,0 +1,162 @@
+// Pila BLE (Bluedroid + BLE de Arduino-ESP32) simulada para el host. Solo
+// tipos y llamadas que usa el sketch; ninguna llega a una radio.
+#pragma once
+#include <Arduino.h>
+#include <vector>
+
+typedef int esp_err_t;
+#define ESP_OK   0
+#define ESP_FAIL -1
+#define ESP_ERR_NOT_SUPPORTED 0x106
+
+typedef uint8_t esp_bd_addr_t[6];
+typedef uint8_t esp_gatt_if_t;
+typedef int esp_bt_status_t;
+#define ESP_BT_STATUS_SUCCESS 0
+
+typedef union {
+    struct { uint16_t conn_id; esp_bd_addr_t remote_bda;
+             struct { uint16_t interval, latency, timeout; } conn_params; } connect;
+    struct { uint16_t conn_id; int reason; } disconnect;
+    struct { uint16_t conn_id; uint16_t mtu; } mtu;
+    struct { uint16_t conn_id; uint32_t trans_id; uint16_t handle; uint16_t offset;
+             bool need_rsp, is_prep; uint16_t len; uint8_t* value; } write;
+} esp_ble_gatts_cb_param_t;
+
+typedef enum { ESP_GATTS_WRITE_EVT = 2 } esp_gatts_cb_event_t;
+typedef enum { ESP_GAP_BLE_UPDATE_CONN_PARAMS_EVT = 20 } esp_gap_ble_cb_event_t;
+typedef union {
+    struct { esp_bt_status_t status; esp_bd_addr_t bda;
+             uint16_t min_int, max_int, latency, conn_int, timeout; } update_conn_params;
+} esp_ble_gap_cb_param_t;
+
+namespace host {
+// Notificaciones enviadas por esp_ble_gatts_send_indicate (camino de SessionNotifier)
+inline uint32_t indications = 0;
+inline uint64_t indicatedBytes = 0;
+}
+
+inline esp_err_t esp_ble_gatts_send_indicate(esp_gatt_if_t, uint16_t, uint16_t, uint16_t len, uint8_t*, bool) {
+    host::indications++;
+    host::indicatedBytes += len;
+    return ESP_OK;
+}
+
+class BLEDescriptor {
+  public:
+    virtual ~BLEDescriptor() {}
+    uint16_t getHandle() { return 0x2A; }
+};
+
+class BLECharacteristic;
+class BLECharacteristicCallbacks {
+  public:
+    virtual ~BLECharacteristicCallbacks() {}
+    virtual void onWrite(BLECharacteristic*) {}
+    virtual void onWrite(BLECharacteristic*, esp_ble_gatts_cb_param_t*) {}
+    enum Status { SUCCESS_INDICATE, SUCCESS_NOTIFY, ERROR_INDICATE_DISABLED, ERROR_NOTIFY_DISABLED, ERROR_GATT,
+                  ERROR_NO_CLIENT, ERROR_INDICATE_TIMEOUT, ERROR_INDICATE_FAILURE };
+    virtual void onStatus(BLECharacteristic*, Status, uint32_t) {}
+};
+
+// Característica simulada: guarda el último valor, cuenta las notificaciones y
+// acumula lo notificado en `sent` (hasta llenarlo), todo sin memoria dinámica
+// para no falsear los recuentos del banco de pruebas. Es también un destino
+// válido para TxScheduler::drain().
+class BLECharacteristic {
+  public:
+    static const uint32_t PROPERTY_READ = 1, PROPERTY_WRITE = 2, PROPERTY_NOTIFY = 4,
+                          PROPERTY_WRITE_NR = 8, PROPERTY_INDICATE = 16;
+
+    explicit BLECharacteristic(const char* uuid = "", uint32_t properties = 0) { (void)uuid; (void)properties; }
+    virtual ~BLECharacteristic() {}
+
+    void setValue(const uint8_t* data, size_t len) {
+        length = std::min(len, sizeof(value));
+        std::memcpy(value, data, length);
+    }
+    void setValue(uint8_t* data, size_t len) { setValue(const_cast<const uint8_t*>(data), len); }
+    uint8_t* getData() { return value; }
+    size_t getLength() { return length; }
+    void notify(bool = true) {
+        notifications++;
+        notifiedBytes += length;
+        size_t room = sizeof(sent) - 1 - sentLen;
+        size_t n = std::min(length, room);
+        std::memcpy(sent + sentLen, value, n);
+        sentLen += n;
+        sent[sentLen] = '\0';
+    }
+    void clearSent() {
+        sentLen = 0;
+        sent[0] = '\0';
+    }
+    void addDescriptor(BLEDescriptor*) {}
+    void setCallbacks(BLECharacteristicCallbacks* cb) { callbacks = cb; }
+    uint16_t getHandle() { return 0x2B; }
+
+    uint8_t value[512] = {}; // ATT_MAX_VALUE_LEN
+    size_t length = 0;
+    char sent[4096] = {};
+    size_t sentLen = 0;
+    uint32_t notifications = 0;
+    uint64_t notifiedBytes = 0;
+    BLECharacteristicCallbacks* callbacks = nullptr;
+};
+
+class BLEServer;
+class BLEServerCallbacks {
+  public:
+    virtual ~BLEServerCallbacks() {}
+    virtual void onConnect(BLEServer*) {}
+    virtual void onConnect(BLEServer*, esp_ble_gatts_cb_param_t*) {}
+    virtual void onDisconnect(BLEServer*) {}
+    virtual void onDisconnect(BLEServer*, esp_ble_gatts_cb_param_t*) {}
+    virtual void onMtuChanged(BLEServer*, esp_ble_gatts_cb_param_t*) {}
+};
+
+class BLEService {
+  public:
+    BLECharacteristic* createCharacteristic(const char* uuid, uint32_t properties) {
+        characteristics.emplace_back(new BLECharacteristic(uuid, properties));
+        return characteristics.back();
+    }
+    void start() {}
+
+  private:
+    std::vector<BLECharacteristic*> characteristics;
+};
+
+class BLEAdvertising {
+  public:
+    void addServiceUUID(const char*) {}
+    void setScanResponse(bool) {}
+    void setMinPreferred(uint16_t) {}
+    void setMaxPreferred(uint16_t) {}
+    void setMinInterval(uint16_t) {}
+    void setMaxInterval(uint16_t) {}
+    void start() {}
+    void stop() {}
+};
+
+class BLEServer {
+  public:
+    BLEService* createService(const char*) { return new BLEService(); }
+    void setCallbacks(BLEServerCallbacks*) {}
+    uint16_t getPeerMTU(uint16_t) { return 23; }
+    void disconnect(uint16_t) {}
+    void updateConnParams(esp_bd_addr_t, uint16_t, uint16_t, uint16_t, uint16_t) {}
+    uint16_t getGattsIf() { return 3; }
+};
+
+class BLEDevice {
+  public:
+    static void init(String) {}
+    static BLEServer* createServer() { return new BLEServer(); }
+    static BLEAdvertising* getAdvertising() {
+        static BLEAdvertising advertising;
+        return &advertising;
+    }
+    static void setCustomGapHandler(void (*)(esp_gap_ble_cb_event_t, esp_ble_gap_cb_param_t*)) {}
+    static void setCustomGattsHandler(void (*)(esp_gatts_cb_event_t, esp_gatt_if_t, esp_ble_gatts_cb_param_t*)) {}
+};
@@ -0,0 +1,12 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+
+// NVS vacía y de solo lectura: ConfigStore arranca con los valores por defecto
+class Preferences {
+  public:
+    bool begin(const char*, bool = false) { return true; }
+    void end() {}
+    size_t getBytes(const char*, void*, size_t) { return 0; }
+    size_t putBytes(const char*, const void*, size_t len) { return len; }
+};
@@ -0,0 +1,34 @@
+#pragma once
+#include <cstdint>
+
+// Radio WiFi simulada: nunca asocia, así que el gestor se queda reintentando
+typedef enum { WIFI_OFF, WIFI_STA } wifi_mode_t;
+typedef enum {
+    ARDUINO_EVENT_WIFI_STA_CONNECTED, ARDUINO_EVENT_WIFI_STA_DISCONNECTED,
+    ARDUINO_EVENT_WIFI_STA_GOT_IP, ARDUINO_EVENT_WIFI_STA_LOST_IP
+} arduino_event_id_t;
+typedef union {
+    struct { uint8_t ssid[33]; uint8_t ssid_len; uint8_t bssid[6]; uint8_t reason; int8_t rssi; } wifi_sta_disconnected;
+    struct { uint8_t ssid[33]; uint8_t ssid_len; uint8_t bssid[6]; uint8_t channel; } wifi_sta_connected;
+} arduino_event_info_t;
+typedef void (*WiFiEventSysCb)(arduino_event_id_t, arduino_event_info_t);
+typedef enum { WL_IDLE_STATUS = 0, WL_CONNECTED = 3, WL_DISCONNECTED = 6 } wl_status_t;
+
+enum {
+    WIFI_REASON_AUTH_EXPIRE = 2, WIFI_REASON_ASSOC_LEAVE = 8, WIFI_REASON_4WAY_HANDSHAKE_TIMEOUT = 15,
+    WIFI_REASON_AUTH_FAIL = 202, WIFI_REASON_HANDSHAKE_TIMEOUT = 204,
+};
+
+class WiFiClass {
+  public:
+    bool mode(wifi_mode_t) { return true; }
+    wl_status_t begin(const char*, const char* = nullptr, int32_t = 0, const uint8_t* = nullptr, bool = true) {
+        return WL_DISCONNECTED;
+    }
+    bool disconnect(bool = false, bool = false) { return true; }
+    bool persistent(bool) { return true; }
+    bool setAutoReconnect(bool) { return true; }
+    int onEvent(WiFiEventSysCb, arduino_event_id_t = ARDUINO_EVENT_WIFI_STA_CONNECTED) { return 0; }
+    int8_t RSSI() { return -60; }
+};
+inline WiFiClass WiFi;
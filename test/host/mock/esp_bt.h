@@ -0,0 +1,5 @@
+#pragma once
+#include "BLEServer.h"
+
+inline esp_err_t esp_bt_sleep_enable() { return ESP_OK; }
+inline esp_err_t esp_bt_sleep_disable() { return ESP_OK; }
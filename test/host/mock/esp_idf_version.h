@@ -0,0 +1,5 @@
+#pragma once
+// El sketch elige entre las API de ADC/PM de IDF 4 y 5; el host sigue la de 4.x
+#define ESP_IDF_VERSION_VAL(major, minor, patch) (((major) << 16) | ((minor) << 8) | (patch))
+#define ESP_IDF_VERSION_MAJOR 4
+#define ESP_IDF_VERSION       ESP_IDF_VERSION_VAL(4, 4, 7)
@@ -0,0 +1,6 @@
+#pragma once
+#include "BLEServer.h"
+
+typedef struct { int max_freq_mhz; int min_freq_mhz; bool light_sleep_enable; } esp_pm_config_esp32_t;
+typedef esp_pm_config_esp32_t esp_pm_config_t;
+inline esp_err_t esp_pm_configure(const void*) { return ESP_ERR_NOT_SUPPORTED; }
@@ -0,0 +1,65 @@
+// FreeRTOS mínimo para compilar el sketch en el host. Un solo hilo: las tareas
+// no llegan a arrancar, las secciones críticas y los mutex no hacen nada y las
+// colas están siempre vacías. Suficiente para llamar al despacho de comandos y
+// vaciar los anillos TX desde el banco de pruebas.
+#pragma once
+#include <cstdint>
+
+typedef void* TaskHandle_t;
+typedef void* SemaphoreHandle_t;
+typedef void* QueueHandle_t;
+typedef uint32_t TickType_t;
+typedef uint32_t UBaseType_t;
+typedef int32_t BaseType_t;
+typedef uint32_t StackType_t;
+typedef void (*TaskFunction_t)(void*);
+struct StaticTask_t { int unused; };
+struct StaticSemaphore_t { int unused; };
+struct StaticQueue_t { int unused; };
+
+#define portMAX_DELAY      0xffffffffu
+#define pdTRUE             1
+#define pdFALSE            0
+#define pdPASS             1
+#define pdFAIL             0
+#define PRO_CPU_NUM        0
+#define APP_CPU_NUM        1
+#define portTICK_PERIOD_MS 1
+#define configTICK_RATE_HZ 1000
+#define pdMS_TO_TICKS(ms)  ((TickType_t)(ms))
+
+typedef struct { int unused; } portMUX_TYPE;
+#define portMUX_INITIALIZER_UNLOCKED {0}
+#define portENTER_CRITICAL(mux)     ((void)(mux))
+#define portEXIT_CRITICAL(mux)      ((void)(mux))
+#define portENTER_CRITICAL_ISR(mux) ((void)(mux))
+#define portEXIT_CRITICAL_ISR(mux)  ((void)(mux))
+#define portYIELD_FROM_ISR(woken)   ((void)(woken))
+
+namespace host {
+// Identidad de la única "tarea": la que ejecuta main()
+inline int currentTask;
+}
+
+inline TaskHandle_t xTaskGetCurrentTaskHandle() { return &host::currentTask; }
+inline BaseType_t xPortInIsrContext() { return pdFALSE; }
+
+inline BaseType_t xTaskCreatePinnedToCore(TaskFunction_t, const char*, uint32_t, void*, UBaseType_t,
+                                          TaskHandle_t* handle, BaseType_t) {
+    if (handle) *handle = nullptr;
+    return pdPASS;
+}
+inline TaskHandle_t xTaskCreateStaticPinnedToCore(TaskFunction_t, const char*, uint32_t, void*, UBaseType_t,
+                                                  StackType_t*, StaticTask_t* buffer, BaseType_t) {
+    return buffer; // Nunca se ejecuta
+}
+inline void vTaskDelete(TaskHandle_t) {}
+inline void vTaskDelay(TickType_t) {}
+inline void vTaskDelayUntil(TickType_t*, TickType_t) {}
+TickType_t xTaskGetTickCount(); // En Arduino.h, sobre el mismo reloj que millis()
+inline UBaseType_t uxTaskGetStackHighWaterMark(TaskHandle_t) { return 1024; }
+inline const char* pcTaskGetName(TaskHandle_t) { return "host"; }
+
+inline uint32_t ulTaskNotifyTake(BaseType_t, TickType_t) { return 0; }
+inline BaseType_t xTaskNotifyGive(TaskHandle_t) { return pdPASS; }
+inline void vTaskNotifyGiveFromISR(TaskHandle_t, BaseType_t*) {}
@@ -0,0 +1,11 @@
+#pragma once
+#include "FreeRTOS.h"
+
+// Colas siempre vacías y sin sitio: nadie las consume en el host
+inline QueueHandle_t xQueueCreateStatic(UBaseType_t, UBaseType_t, uint8_t* storage, StaticQueue_t*) {
+    return storage;
+}
+inline QueueHandle_t xQueueCreate(UBaseType_t, UBaseType_t) { return nullptr; }
+inline BaseType_t xQueueSend(QueueHandle_t, const void*, TickType_t) { return pdFAIL; }
+inline BaseType_t xQueueReceive(QueueHandle_t, void*, TickType_t) { return pdFAIL; }
+inline UBaseType_t uxQueueMessagesWaiting(QueueHandle_t) { return 0; }
@@ -0,0 +1,11 @@
+#pragma once
+#include "FreeRTOS.h"
+
+namespace host {
+inline StaticSemaphore_t heapMutex;
+}
+
+inline SemaphoreHandle_t xSemaphoreCreateMutex() { return &host::heapMutex; }
+inline SemaphoreHandle_t xSemaphoreCreateMutexStatic(StaticSemaphore_t* buffer) { return buffer; }
+inline BaseType_t xSemaphoreTake(SemaphoreHandle_t, TickType_t) { return pdTRUE; }
+inline BaseType_t xSemaphoreGive(SemaphoreHandle_t) { return pdTRUE; }
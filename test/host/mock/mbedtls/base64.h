@@ -0,0 +1,8 @@
+#pragma once
+#include <cstddef>
+
+#define MBEDTLS_ERR_BASE64_INVALID_CHARACTER -0x002C
+inline int mbedtls_base64_decode(unsigned char*, size_t, size_t* olen, const unsigned char*, size_t) {
+    *olen = 0;
+    return MBEDTLS_ERR_BASE64_INVALID_CHARACTER;
+}
@@ -0,0 +1,15 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+// Solo lo usa la verificación del OTA, que en el host nunca llega a escribir
+typedef struct { uint32_t unused; } mbedtls_sha256_context;
+inline void mbedtls_sha256_init(mbedtls_sha256_context*) {}
+inline void mbedtls_sha256_free(mbedtls_sha256_context*) {}
+inline int mbedtls_sha256_starts(mbedtls_sha256_context*, int) { return 0; }
+inline int mbedtls_sha256_update(mbedtls_sha256_context*, const unsigned char*, size_t) { return 0; }
+inline int mbedtls_sha256_finish(mbedtls_sha256_context*, unsigned char* output) {
+    std::memset(output, 0, 32);
+    return 0;
+}
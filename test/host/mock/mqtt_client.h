@@ -0,0 +1,24 @@
+#pragma once
+#include <cstdint>
+
+// Cliente esp-mqtt sin conexión: se crea, pero nunca llega MQTT_EVENT_CONNECTED
+typedef const char* esp_event_base_t;
+typedef struct esp_mqtt_client* esp_mqtt_client_handle_t;
+typedef enum {
+    MQTT_EVENT_ANY = -1, MQTT_EVENT_ERROR = 0, MQTT_EVENT_CONNECTED, MQTT_EVENT_DISCONNECTED,
+    MQTT_EVENT_SUBSCRIBED, MQTT_EVENT_UNSUBSCRIBED, MQTT_EVENT_PUBLISHED, MQTT_EVENT_DATA,
+} esp_mqtt_event_id_t;
+typedef struct { esp_mqtt_event_id_t event_id; esp_mqtt_client_handle_t client; int msg_id; } esp_mqtt_event_t;
+typedef esp_mqtt_event_t* esp_mqtt_event_handle_t;
+typedef void (*esp_event_handler_t)(void*, esp_event_base_t, int32_t, void*);
+typedef struct { const char* uri; const char* client_id; int keepalive; int out_buffer_size; } esp_mqtt_client_config_t;
+
+inline esp_mqtt_client_handle_t esp_mqtt_client_init(const esp_mqtt_client_config_t*) { return nullptr; }
+inline int esp_mqtt_client_register_event(esp_mqtt_client_handle_t, esp_mqtt_event_id_t, esp_event_handler_t, void*) {
+    return 0;
+}
+inline int esp_mqtt_client_start(esp_mqtt_client_handle_t) { return 0; }
+inline int esp_mqtt_client_publish(esp_mqtt_client_handle_t, const char*, const char*, int, int, int) { return -1; }
+inline int esp_mqtt_client_enqueue(esp_mqtt_client_handle_t, const char*, const char*, int, int, int, bool) {
+    return -1;
+}